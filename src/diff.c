@@ -22,6 +22,7 @@
 # include "config.h"
 #endif
 
+#include <ctype.h>
 #include <errno.h>
 
 #ifdef HAVE_ERROR_H
@@ -42,6 +43,7 @@
 #endif /* HAVE_UNISTD_H */
 
 #include "diff.h"
+#include "stats.h"
 #include "util.h"
 
 int num_pathname_components (const char *x)
@@ -71,9 +73,9 @@ char *best_name (int n, char **names)
         int best_pn, best_bn, best_n, best = 0; /* shut gcc up */
         int i;
 
-        pathname_components = xmalloc (sizeof (int) * n);
-        basename_length = xmalloc (sizeof (int) * n);
-        is_dev_null = xmalloc (sizeof (int) * n);
+        pathname_components = xmalloc_as (ALLOC_HEADER, sizeof (int) * n);
+        basename_length = xmalloc_as (ALLOC_HEADER, sizeof (int) * n);
+        is_dev_null = xmalloc_as (ALLOC_HEADER, sizeof (int) * n);
 
         best_pn = -1;
         for (i = 0; i < n; i++) {
@@ -130,9 +132,9 @@ char *best_name (int n, char **names)
 		}
 	}
 
-        free (pathname_components);
-        free (basename_length);
-        free (is_dev_null);
+        xfree_as (ALLOC_HEADER, pathname_components);
+        xfree_as (ALLOC_HEADER, basename_length);
+        xfree_as (ALLOC_HEADER, is_dev_null);
         return names[best];
 }
 
@@ -157,13 +159,22 @@ const char *stripped (const char *name, int num_components)
 	return name ? name : basename;
 }
 
+/* Like strchr, but don't look beyond the end of the line. */
+static const char *line_chr (const char *line, int c)
+{
+	for (; *line && *line != '\n'; line++)
+		if (*line == c)
+			return line;
+	return NULL;
+}
+
 unsigned long calculate_num_lines (const char *atatline, char which)
 {
-        char *p = strchr (atatline, which);
+        const char *p = line_chr (atatline, which);
         if (!p)
                 return 1;
-        while (*p && *p != ',' && *p != ' ') p++;
-        if (!*p || *p == ' ')
+        while (*p && *p != ',' && *p != ' ' && *p != '\n') p++;
+        if (*p != ',')
                 return 1;
         return strtoul (p + 1, NULL, 10);
 }
@@ -187,10 +198,10 @@ int read_atatline (const char *atatline,
 {
 	char *endptr;
 	unsigned long res;
-	char *p;
+	const char *p;
 
 	if (orig_offset) {
-		p = strchr (atatline, '-');
+		p = line_chr (atatline, '-');
 		if (!p)
 			return 1;
 		p++;
@@ -204,7 +215,7 @@ int read_atatline (const char *atatline,
 		*orig_count = orig_num_lines (atatline);
 
 	if (new_offset) {
-		p = strchr (atatline, '+');
+		p = line_chr (atatline, '+');
 		if (!p)
 			return 1;
 		p++;
@@ -220,18 +231,188 @@ int read_atatline (const char *atatline,
 	return 0;
 }
 
-static void copy_context_hunks (char **line, size_t *linelen, ssize_t *got,
+void patch_reader_init (struct patch_reader *r, const char *data,
+			size_t size)
+{
+	r->data = data;
+	r->size = size;
+	r->pos = 0;
+	r->eof = 0;
+}
+
+ssize_t patch_getline (struct patch_reader *r, const char **line)
+{
+	const char *start = r->data + r->pos;
+	const char *nl;
+	size_t left = r->size - r->pos;
+
+	if (!left) {
+		r->eof = 1;
+		return -1;
+	}
+
+	nl = memchr (start, '\n', left);
+	if (nl)
+		left = nl - start + 1;
+	else
+		/* Last line, with no newline. */
+		r->eof = 1;
+
+	*line = start;
+	r->pos += left;
+	return (ssize_t) left;
+}
+
+unsigned long patch_skip_hunk (struct patch_reader *r,
+			       unsigned long *orig_left,
+			       unsigned long *new_left)
+{
+	const char *p = r->data + r->pos, *end = r->data + r->size;
+	unsigned long orig = *orig_left, new = *new_left, lines = 0;
+
+	while ((orig || new) && p < end) {
+		const char *nl;
+
+		switch (*p) {
+		case '\\':
+			break;
+		case '+':
+			if (new)
+				new--;
+			break;
+		case '-':
+			if (orig)
+				orig--;
+			break;
+		default:
+			if (orig)
+				orig--;
+			if (new)
+				new--;
+		}
+
+		lines++;
+		nl = memchr (p, '\n', end - p);
+		if (!nl) {
+			/* Last line, with no newline. */
+			r->eof = 1;
+			p = end;
+			break;
+		}
+		p = nl + 1;
+	}
+
+	r->pos = p - r->data;
+	*orig_left = orig;
+	*new_left = new;
+	return lines;
+}
+
+int patch_eof (const struct patch_reader *r)
+{
+	return r->eof;
+}
+
+size_t patch_tell (const struct patch_reader *r)
+{
+	return r->pos;
+}
+
+void patch_seek (struct patch_reader *r, size_t pos)
+{
+	r->pos = pos < r->size ? pos : r->size;
+	r->eof = 0;
+}
+
+void patch_parser_init (struct patch_parser *p, struct patch_reader *r)
+{
+	p->reader = r;
+	p->linenum = 0;
+	patch_parser_reset (p);
+}
+
+void patch_parser_reset (struct patch_parser *p)
+{
+	p->orig_left = p->new_left = 0;
+	p->in_hunk = 0;
+}
+
+enum patch_record_type patch_next_record (struct patch_parser *p,
+					  struct patch_record *rec)
+{
+	struct patch_reader *r = p->reader;
+	const char *line;
+	ssize_t got;
+
+	rec->offset = patch_tell (r);
+	got = patch_getline (r, &line);
+	if (got == -1)
+		return rec->type = PATCH_EOF;
+
+	rec->linenum = ++p->linenum;
+	rec->line = line;
+	rec->length = got;
+
+	if (p->in_hunk) {
+		if (p->orig_left || p->new_left) {
+			if (*line != '\\') {
+				if (p->orig_left && *line != '+')
+					p->orig_left--;
+				if (p->new_left && *line != '-')
+					p->new_left--;
+			}
+			return rec->type = PATCH_LINE;
+		}
+
+		/* A '\' line still belongs to the hunk it follows. */
+		if (*line == '\\')
+			return rec->type = PATCH_LINE;
+
+		p->in_hunk = 0;
+	}
+
+	if (!strncmp (line, "@@ ", 3) &&
+	    !read_atatline (line, &rec->orig_offset, &rec->orig_count,
+			    &rec->new_offset, &rec->new_count)) {
+		p->orig_left = rec->orig_count;
+		p->new_left = rec->new_count;
+		p->in_hunk = 1;
+		STATS_ADD (STATS_HUNKS, 1);
+		return rec->type = PATCH_HUNK;
+	}
+
+	if (!strncmp (line, "--- ", 4)) {
+		size_t pos = patch_tell (r);
+		got = patch_getline (r, &rec->line2);
+		if (got != -1 && !strncmp (rec->line2, "+++ ", 4)) {
+			p->linenum++;
+			rec->length2 = got;
+			STATS_ADD (STATS_FILES, 1);
+			return rec->type = PATCH_FILE;
+		}
+
+		/* Not a file header after all; look at that line again
+		 * next time. */
+		patch_seek (r, pos);
+	}
+
+	return rec->type = PATCH_OTHER;
+}
+
+static void copy_context_hunks (struct patch_reader *in, struct filebuf *out,
+				const char **line, ssize_t *got,
 				unsigned long *linenum)
 {
 	for (;;) {
 		unsigned long unchanged = 0;
 		unsigned long line_start, line_end, line_count;
-		char *n, *end;
+		const char *n;
+		char *end;
 		int i;
 
 		for (i = 0; i < 2; i++) {
 			int first = 1;
-			*got = getline (line, linelen, stdin);
+			*got = patch_getline (in, line);
 			if (*got == -1)
 				return;
 			++*linenum;
@@ -269,13 +450,13 @@ static void copy_context_hunks (char **line, size_t *linelen, ssize_t *got,
 				line_count = line_start ? 1 : 0;
 			}
 
-			fwrite (*line, (size_t) *got, 1, stdout);
+			filebuf_append (out, *line, (size_t) *got);
 
 			if (i && line_count == unchanged)
 				break;
 
 			while (line_count--) {
-				*got = getline (line, linelen, stdin);
+				*got = patch_getline (in, line);
 				if (*got == -1)
 					return;
 				++*linenum;
@@ -289,7 +470,7 @@ static void copy_context_hunks (char **line, size_t *linelen, ssize_t *got,
 					}
 				}
 
-				fwrite (*line, (size_t) *got, 1, stdout);
+				filebuf_append (out, *line, (size_t) *got);
 				if (**line == ' ')
 					unchanged++;
 			}
@@ -297,8 +478,10 @@ static void copy_context_hunks (char **line, size_t *linelen, ssize_t *got,
 	}
 }
 
-static void convert_unified_hunks_to_context (char **line, size_t *linelen,
-					      ssize_t *got, unsigned long *linenum)
+static void convert_unified_hunks_to_context (struct patch_reader *in,
+					      struct filebuf *out,
+					      const char **line, ssize_t *got,
+					      unsigned long *linenum)
 {
 	unsigned long orig_offset, orig_count = 0, new_offset, new_count = 0;
 	char **orig_line = NULL, **new_line = NULL;
@@ -308,11 +491,12 @@ static void convert_unified_hunks_to_context (char **line, size_t *linelen,
 	unsigned long orig_linenum, new_linenum;
 	const char *no_newline_str = "\\ No newline at end of file\n";
 	char *misc = NULL;
+	const char *eol;
 
-	if (feof (stdin))
+	if (patch_eof (in))
 		goto eof;
 
-	if ((*got = getline (line, linelen, stdin)) == -1)
+	if ((*got = patch_getline (in, line)) == -1)
 		goto eof;
 	++*linenum;
 
@@ -330,22 +514,28 @@ static void convert_unified_hunks_to_context (char **line, size_t *linelen,
 				   &new_offset, &new_count))
 			return;
 
-		misc = strchr (*line + 2, '@');
-		misc += 2;
-		misc = xstrdup (misc);
+		eol = *line + *got;
+		misc = (char *) line_chr (*line + 2, '@') + 2;
+		misc = xstrndup_as (ALLOC_HUNKS, misc,
+				    misc < eol ? eol - misc : 0);
 
 		/* Read in the change lines. */
-		orig_line = xmalloc (sizeof (char *) * orig_count);
-		new_line = xmalloc (sizeof (char *) * new_count);
-		orig_what = xmalloc (sizeof (char *) * orig_count);
-		new_what = xmalloc (sizeof (char *) * new_count);
-		whats = xmalloc (sizeof (char *) * (orig_count + new_count));
+		orig_line = xmalloc_as (ALLOC_HUNKS,
+					sizeof (char *) * orig_count);
+		new_line = xmalloc_as (ALLOC_HUNKS,
+				       sizeof (char *) * new_count);
+		orig_what = xmalloc_as (ALLOC_HUNKS,
+					sizeof (char *) * orig_count);
+		new_what = xmalloc_as (ALLOC_HUNKS,
+				       sizeof (char *) * new_count);
+		whats = xmalloc_as (ALLOC_HUNKS, sizeof (char *) *
+				    (orig_count + new_count));
 		orig_linenum = new_linenum = 0;
 		while ((orig_linenum < orig_count) ||
 		       (new_linenum < new_count) || newline) {
 			int get_out = 0;
 
-			if ((*got = getline (line, linelen, stdin)) == -1)
+			if ((*got = patch_getline (in, line)) == -1)
 				/* Should write out everything to date? */
 				break;
 			++*linenum;
@@ -374,8 +564,12 @@ static void convert_unified_hunks_to_context (char **line, size_t *linelen,
 				what = NULL;
 				orig_what[orig_linenum] = " ";
 				new_what[new_linenum] = " ";
-				orig_line[orig_linenum] = xstrdup (*line + 1);
-				new_line[new_linenum] = xstrdup (*line + 1);
+				orig_line[orig_linenum] =
+					xstrndup_as (ALLOC_HUNKS, *line + 1,
+						     *got - 1);
+				new_line[new_linenum] =
+					xstrndup_as (ALLOC_HUNKS, *line + 1,
+						     *got - 1);
 				last_orig = orig_line[orig_linenum++];
 				last_new = new_line[new_linenum++];
 				break;
@@ -392,12 +586,14 @@ static void convert_unified_hunks_to_context (char **line, size_t *linelen,
 					if (*what != '-')
 						*what = '!';
 				} else {
-					what = xmalloc (sizeof (char));
+					what = xmalloc_as (ALLOC_HUNKS, sizeof (char));
 					*what = '-';
 					whats[n_whats++] = what;
 				}
 				orig_what[orig_linenum] = what;
-				orig_line[orig_linenum] = xstrdup (*line + 1);
+				orig_line[orig_linenum] =
+					xstrndup_as (ALLOC_HUNKS, *line + 1,
+						     *got - 1);
 				last_orig = orig_line[orig_linenum++];
 				last_new = NULL;
 				can_omit_from = 0;
@@ -415,12 +611,14 @@ static void convert_unified_hunks_to_context (char **line, size_t *linelen,
 					if (*what != '+')
 						*what = '!';
 				} else {
-					what = xmalloc (sizeof (char));
+					what = xmalloc_as (ALLOC_HUNKS, sizeof (char));
 					*what = '+';
 					whats[n_whats++] = what;
 				}
 				new_what[new_linenum] = what;
-				new_line[new_linenum] = xstrdup (*line + 1);
+				new_line[new_linenum] =
+					xstrndup_as (ALLOC_HUNKS, *line + 1,
+						     *got - 1);
 				last_orig = NULL;
 				last_new = new_line[new_linenum++];
 				can_omit_to = 0;
@@ -448,67 +646,71 @@ static void convert_unified_hunks_to_context (char **line, size_t *linelen,
 			error (EXIT_FAILURE, 0, "Garbled input at line %lu",
 			       *linenum);
 
-		printf ("*** %lu", orig_offset);
+		filebuf_printf (out, "*** %lu", orig_offset);
 		if (orig_count)
-			printf (",%lu", orig_offset + orig_count - 1);
+			filebuf_printf (out, ",%lu",
+					orig_offset + orig_count - 1);
 
-		printf (" ****%s", misc);
+		filebuf_printf (out, " ****%s", misc);
 		if (!can_omit_from)
 			for (i = 0; i < orig_count; i++) {
 				char *l = orig_line[i];
-				printf ("%c %s", *orig_what[i], l);
+				filebuf_printf (out, "%c %s", *orig_what[i], l);
 				if (l[strlen (l) - 1] != '\n')
-					printf ("\n%s", no_newline_str);
+					filebuf_printf (out, "\n%s",
+							no_newline_str);
 			}
 
-		printf ("--- %lu", new_offset);
+		filebuf_printf (out, "--- %lu", new_offset);
 		if (new_count)
-			printf (",%lu", new_offset + new_count - 1);
+			filebuf_printf (out, ",%lu",
+					new_offset + new_count - 1);
 
-		puts (" ----");
+		filebuf_append (out, " ----\n", 6);
 		if (!can_omit_to)
 			for (i = 0; i < new_count; i++) {
 				char *l = new_line[i];
-				printf ("%c %s", *new_what[i], l);
+				filebuf_printf (out, "%c %s", *new_what[i], l);
 				if (l[strlen (l) - 1] != '\n')
-					printf ("\n%s", no_newline_str);
+					filebuf_printf (out, "\n%s",
+							no_newline_str);
 			}
 
 	eof:
 		for (i = 0; i < orig_count; i++)
-			free (orig_line[i]);
+			xfree_as (ALLOC_HUNKS, orig_line[i]);
 
 		for (i = 0; i < new_count; i++)
-			free (new_line[i]);
+			xfree_as (ALLOC_HUNKS, new_line[i]);
 
 		for (i = 0; i < n_whats; i++)
-			free (whats[i]);
-
-		free (orig_line);
-		free (new_line);
-		free (orig_what);
-		free (new_what);
-		free (whats);
-		free (misc);
+			xfree_as (ALLOC_HUNKS, whats[i]);
+
+		xfree_as (ALLOC_HUNKS, orig_line);
+		xfree_as (ALLOC_HUNKS, new_line);
+		xfree_as (ALLOC_HUNKS, orig_what);
+		xfree_as (ALLOC_HUNKS, new_what);
+		xfree_as (ALLOC_HUNKS, whats);
+		xfree_as (ALLOC_HUNKS, misc);
 		orig_count = new_count = n_whats = 0;
 		orig_line = new_line = NULL;
 		orig_what = new_what = NULL;
 		whats = NULL;
 		misc = NULL;
 
-		if (feof (stdin))
+		if (patch_eof (in))
 			return;
 	}
 }
 
-/* Read diff on stdin, write context format version on stdout.
- * Note: stdin may already be in context format. */
-static void do_convert_to_context (void)
+/* Read diff from in, append context format version to out.
+ * Note: the input may already be in context format. */
+static void do_convert_to_context (struct patch_reader *in,
+				   struct filebuf *out)
 {
-	char *line = NULL;
-	size_t linelen = 0;
+	const char *line;
 	unsigned long linenum = 0;
-	ssize_t got = getline (&line, &linelen, stdin);
+	ssize_t got = patch_getline (in, &line);
 
 	if (got == -1)
 		return;
@@ -518,7 +720,7 @@ static void do_convert_to_context (void)
 		int is_context = 0;
 
 		for (;;) {
-			if (feof (stdin))
+			if (patch_eof (in))
 				goto eof;
 
 			if (!strncmp (line, "--- ", 4)) {
@@ -531,17 +733,17 @@ static void do_convert_to_context (void)
 				break;
 			}
 
-			fwrite (line, (size_t) got, 1, stdout);
+			filebuf_append (out, line, (size_t) got);
 
-			got = getline (&line, &linelen, stdin);
+			got = patch_getline (in, &line);
 			if (got == -1)
 				goto eof;
 			linenum++;
 		}
 
 		if (is_context) {
-			fwrite (line, (size_t) got, 1, stdout);
-			got = getline (&line, &linelen, stdin);
+			filebuf_append (out, line, (size_t) got);
+			got = patch_getline (in, &line);
 			if (got == -1)
 				goto eof;
 			linenum++;
@@ -549,8 +751,8 @@ static void do_convert_to_context (void)
 			if (strncmp (line, "--- ", 4))
 				continue;
 
-			fwrite (line, (size_t) got, 1, stdout);
-			got = getline (&line, &linelen, stdin);
+			filebuf_append (out, line, (size_t) got);
+			got = patch_getline (in, &line);
 			if (got == -1)
 				goto eof;
 			linenum++;
@@ -558,11 +760,12 @@ static void do_convert_to_context (void)
 			if (strncmp (line, "***************", 15))
 				continue;
 
-			fwrite (line, (size_t) got, 1, stdout);
-			copy_context_hunks (&line, &linelen, &got, &linenum);
+			filebuf_append (out, line, (size_t) got);
+			copy_context_hunks (in, out, &line, &got, &linenum);
 		} else {
-			printf ("*** %s", line + 4);
-			got = getline (&line, &linelen, stdin);
+			filebuf_printf (out, "*** %.*s", (int) got - 4,
+					line + 4);
+			got = patch_getline (in, &line);
 			if (got == -1)
 				goto eof;
 			linenum++;
@@ -570,32 +773,30 @@ static void do_convert_to_context (void)
 			if (strncmp (line, "+++ ", 4))
 				continue;
 
-			printf ("--- ");
-			fwrite (line + 4, (size_t) got - 4, 1, stdout);
-			puts ("***************");
-			convert_unified_hunks_to_context (&line, &linelen,
+			filebuf_append (out, "--- ", 4);
+			filebuf_append (out, line + 4, (size_t) got - 4);
+			filebuf_append (out, "***************\n", 16);
+			convert_unified_hunks_to_context (in, out, &line,
 							  &got, &linenum);
 		}
 	}
 
  eof:
-	if (line)
-		free (line);
-
 	return;
 }
 
-static void copy_unified_hunks (char **line, size_t *linelen, ssize_t *got,
+static void copy_unified_hunks (struct patch_reader *in, struct filebuf *out,
+				const char **line, ssize_t *got,
 				unsigned long *linenum)
 {
 	unsigned long orig_count = 0, new_count = 0;
 	unsigned long orig_offset, new_offset;
 
 	for (;;) {
-		if (feof (stdin))
+		if (patch_eof (in))
 			return;
 
-		*got = getline (line, linelen, stdin);
+		*got = patch_getline (in, line);
 		if (*got == -1)
 			return;
 		++*linenum;
@@ -606,11 +807,11 @@ static void copy_unified_hunks (char **line, size_t *linelen, ssize_t *got,
 
 			if (read_atatline (*line, &orig_offset, &orig_count,
 					   &new_offset, &new_count))
-				error (EXIT_FAILURE, 0,
-				       "line %lu not understood: %s", *linenum,
-				       *line);
+					error (EXIT_FAILURE, 0,
+					       "line %lu not understood: %.*s",
+					       *linenum, (int) *got, *line);
 
-			fwrite (*line, (size_t) *got, 1, stdout);
+			filebuf_append (out, *line, (size_t) *got);
 			continue;
 		}
 
@@ -619,12 +820,14 @@ static void copy_unified_hunks (char **line, size_t *linelen, ssize_t *got,
 		if (new_count && **line != '-')
 			new_count--;
 
-		fwrite (*line, (size_t) *got, 1, stdout);
+		filebuf_append (out, *line, (size_t) *got);
 	}
 }
 
-static void convert_context_hunks_to_unified (char **line, size_t *linelen,
-					      ssize_t *got, unsigned long *linenum)
+static void convert_context_hunks_to_unified (struct patch_reader *in,
+					      struct filebuf *out,
+					      const char **line, ssize_t *got,
+					      unsigned long *linenum)
 {
 	int happy = 1;
 
@@ -633,7 +836,8 @@ static void convert_context_hunks_to_unified (char **line, size_t *linelen,
 		char *misc = NULL;
 		unsigned long unchanged = 0;
 		unsigned long line_start[2], line_end, line_count[2];
-		char *n, *end;
+		const char *n;
+		char *end;
 		char **lines[2];
 		size_t *linelengths[2];
 		size_t n_lines[2];
@@ -647,19 +851,19 @@ static void convert_context_hunks_to_unified (char **line, size_t *linelen,
 			int first = 1;
 			unsigned long lnum;
 
-			if (feof (stdin))
+			if (patch_eof (in))
 				goto eof;
 
-			*got = getline (line, linelen, stdin);
+			*got = patch_getline (in, line);
 			if (*got == -1)
 				goto eof;
 			++*linenum;
 
 			if (!i && !misc &&
 			    !strncmp (*line, "***************", 15)) {
-				char *m = *line + 15;
-				if (strcmp (m, "\n"))
-					misc = xstrdup (m);
+				const char *m = *line + 15;
+				if (*got != 16 || *m != '\n')
+					misc = xstrndup_as (ALLOC_HUNKS, m, *got - 15);
 				i--;
 				continue;
 			}
@@ -688,21 +892,26 @@ static void convert_context_hunks_to_unified (char **line, size_t *linelen,
 				line_count[i] = line_start[i] ? 1 : 0;
 			}
 
-			n = strstr (n, i ? "----" : "****");
+			n = memmem (n, *line + *got - n,
+				    i ? "----" : "****", 4);
 			if (!misc)
-				misc = xstrdup (n + 4);
+				misc = n ? xstrndup_as (ALLOC_HUNKS, n + 4,
+							*line + *got - n - 4)
+					 : xstrdup_as (ALLOC_HUNKS, "\n");
 
 			if (i && line_count[i] == unchanged)
 				break;
 
 			n_lines[i] = line_count[i];
-			lines[i] = xmalloc (sizeof (char *) * line_count[i]);
-			linelengths[i] = xmalloc (sizeof (size_t) *
-						  line_count[i]);
+			lines[i] = xmalloc_as (ALLOC_HUNKS, sizeof (char *) *
+					       line_count[i]);
+			linelengths[i] = xmalloc_as (ALLOC_HUNKS,
+						     sizeof (size_t) *
+						     line_count[i]);
 			memset (lines[i], 0, sizeof (char *) * line_count[i]);
 
 			for (lnum = 0; lnum < line_count[i]; lnum++) {
-				*got = getline (line, linelen, stdin);
+				*got = patch_getline (in, line);
 				if (*got == -1)
 					goto eof;
 				++*linenum;
@@ -717,7 +926,8 @@ static void convert_context_hunks_to_unified (char **line, size_t *linelen,
 					}
 				}
 
-				lines[i][lnum] = xmalloc ((size_t) *got + 1);
+				lines[i][lnum] = xmalloc_as (ALLOC_HUNKS,
+							     (size_t) *got + 1);
 				memcpy (lines[i][lnum], *line, (size_t) *got);
 				lines[i][lnum][*got] = '\0';
 				linelengths[i][lnum] = (size_t) *got;
@@ -726,15 +936,15 @@ static void convert_context_hunks_to_unified (char **line, size_t *linelen,
 			}
 		}
 
-		printf ("@@ -%lu", line_start[0]);
+		filebuf_printf (out, "@@ -%lu", line_start[0]);
 		if (line_count[0] != 1)
-			printf (",%lu", line_count[0]);
+			filebuf_printf (out, ",%lu", line_count[0]);
 
-		printf (" +%lu", line_start[1]);
+		filebuf_printf (out, " +%lu", line_start[1]);
 		if (line_count[1] != 1)
-			printf (",%lu", line_count[1]);
+			filebuf_printf (out, ",%lu", line_count[1]);
 
-		printf (" @@%s", misc);
+		filebuf_printf (out, " @@%s", misc);
 
 		/* There MUST be an easier way than this!! */
 		at[0] = at[1] = 0;
@@ -752,77 +962,75 @@ static void convert_context_hunks_to_unified (char **line, size_t *linelen,
 			}
 
 			if (l[0] && *l[0] == ' ' && l[1] && *l[1] == ' ') {
-				fwrite (l[0] + 1, llen[0] - 1, 1, stdout);
+				filebuf_append (out, l[0] + 1, llen[0] - 1);
 				at[0]++;
 				at[1]++;
 			} else if (l[0] && *l[0] == ' ' && !l[1]) {
-				fwrite (l[0] + 1, llen[0] - 1, 1, stdout);
+				filebuf_append (out, l[0] + 1, llen[0] - 1);
 				at[0]++;
 			} else if (l[0] && *l[0] == '-') {
-				putchar ('-');
-				fwrite (l[0] + 2, llen[0] - 2, 1, stdout);
+				filebuf_append (out, "-", 1);
+				filebuf_append (out, l[0] + 2, llen[0] - 2);
 				at[0]++;
 			} else if (l[1] && *l[1] == '+') {
-				putchar ('+');
-				fwrite (l[1] + 2, llen[1] - 2, 1, stdout);
+				filebuf_append (out, "+", 1);
+				filebuf_append (out, l[1] + 2, llen[1] - 2);
 				at[1]++;
 			} else if (l[0] && *l[0] == '!' &&
 				   l[1] && *l[1] == '!') {
 				while (at[0] < n_lines[0] &&
 				       *lines[0][at[0]] == '!') {
-					putchar ('-');
-					fwrite (lines[0][at[0]] + 2,
-						linelengths[0][at[0]] - 2,
-						1, stdout);
+					filebuf_append (out, "-", 1);
+					filebuf_append (out, lines[0][at[0]] + 2,
+							linelengths[0][at[0]] - 2);
 					at[0]++;
 				}
 				while (at[1] < n_lines[1] &&
 				       *lines[1][at[1]] == '!') {
-					putchar ('+');
-					fwrite (lines[1][at[1]] + 2,
-						linelengths[1][at[1]] - 2,
-						1, stdout);
+					filebuf_append (out, "+", 1);
+					filebuf_append (out, lines[1][at[1]] + 2,
+							linelengths[1][at[1]] - 2);
 					at[1]++;
 				}
 			} else if (l[0] && *l[0] == '!') {
-				putchar ('-');
-				fwrite (l[0] + 2, llen[0] - 2, 1, stdout);
+				filebuf_append (out, "-", 1);
+				filebuf_append (out, l[0] + 2, llen[0] - 2);
 				at[0]++;
 			} else if (l[1] && *l[1] == '!') {
-				putchar ('+');
-				fwrite (l[1] + 2, llen[1] - 2, 1, stdout);
+				filebuf_append (out, "+", 1);
+				filebuf_append (out, l[1] + 2, llen[1] - 2);
 				at[1]++;
 			} else if (l[0] && *l[0] == '\\') {
-				fwrite (l[0], llen[0], 1, stdout);
-				putchar ('\n');
+				filebuf_append (out, l[0], llen[0]);
+				filebuf_append (out, "\n", 1);
 				at[0]++;
 			} else if (l[1] && *l[1] == '\\') {
-				fwrite (l[1], llen[1], 1, stdout);
-				putchar ('\n');
+				filebuf_append (out, l[1], llen[1]);
+				filebuf_append (out, "\n", 1);
 				at[1]++;
 			} else if (!l[0]) {
-				putchar (*l[1]);
-				fwrite (l[1] + 2, llen[1] - 2, 1, stdout);
+				filebuf_append (out, l[1], 1);
+				filebuf_append (out, l[1] + 2, llen[1] - 2);
 				at[1]++;
 			} else {
-				printf ("Don't know how to handle this:\n"
-					"1: %s2: %s", l[0], l[1]);
-				exit (1);
+				error (EXIT_FAILURE, 0,
+				       "Don't know how to handle this:\n"
+				       "1: %s2: %s", l[0], l[1] ? l[1] : "");
 			}
 		}
 
 	eof:
-		free (misc);
+		xfree_as (ALLOC_HUNKS, misc);
 		for (i = 0; i < n_lines[0]; i++)
-			free (lines[0][i]);
+			xfree_as (ALLOC_HUNKS, lines[0][i]);
 		for (i = 0; i < n_lines[1]; i++)
-			free (lines[1][i]);
-		free (lines[0]);
-		free (linelengths[0]);
-		free (lines[1]);
-		free (linelengths[1]);
+			xfree_as (ALLOC_HUNKS, lines[1][i]);
+		xfree_as (ALLOC_HUNKS, lines[0]);
+		xfree_as (ALLOC_HUNKS, linelengths[0]);
+		xfree_as (ALLOC_HUNKS, lines[1]);
+		xfree_as (ALLOC_HUNKS, linelengths[1]);
 
-		if (feof (stdin))
+		if (patch_eof (in))
 			return;
 
 		continue;
@@ -833,14 +1041,14 @@ static void convert_context_hunks_to_unified (char **line, size_t *linelen,
 	}
 }
 
-/* Read diff on stdin, write unified format version on stdout.
- * Note: stdin may already be in unified format. */
-static void do_convert_to_unified (void)
+/* Read diff from in, append unified format version to out.
+ * Note: the input may already be in unified format. */
+static void do_convert_to_unified (struct patch_reader *in,
+				   struct filebuf *out)
 {
-	char *line = NULL;
-	size_t linelen = 0;
+	const char *line;
 	unsigned long linenum = 0;
-	ssize_t got = getline (&line, &linelen, stdin);
+	ssize_t got = patch_getline (in, &line);
 
 	if (got == -1)
 		return;
@@ -850,7 +1058,7 @@ static void do_convert_to_unified (void)
 		int is_context = 0;
 
 		for (;;) {
-			if (feof (stdin))
+			if (patch_eof (in))
 				goto eof;
 
 			if (!strncmp (line, "--- ", 4)) {
@@ -863,17 +1071,18 @@ static void do_convert_to_unified (void)
 				break;
 			}
 
-			fwrite (line, (size_t) got, 1, stdout);
+			filebuf_append (out, line, (size_t) got);
 
-			got = getline (&line, &linelen, stdin);
+			got = patch_getline (in, &line);
 			if (got == -1)
 				goto eof;
 			linenum++;
 		}
 
 		if (is_context) {
-			printf ("--- %s", line + 4);
-			got = getline (&line, &linelen, stdin);
+			filebuf_printf (out, "--- %.*s", (int) got - 4,
+					line + 4);
+			got = patch_getline (in, &line);
 			if (got == -1)
 				goto eof;
 			linenum++;
@@ -881,13 +1090,13 @@ static void do_convert_to_unified (void)
 			if (strncmp (line, "--- ", 4))
 				continue;
 
-			printf ("+++ ");
-			fwrite (line + 4, (size_t) got - 4, 1, stdout);
-			convert_context_hunks_to_unified (&line, &linelen,
+			filebuf_append (out, "+++ ", 4);
+			filebuf_append (out, line + 4, (size_t) got - 4);
+			convert_context_hunks_to_unified (in, out, &line,
 							  &got, &linenum);
 		} else {
-			fwrite (line, (size_t) got, 1, stdout);
-			got = getline (&line, &linelen, stdin);
+			filebuf_append (out, line, (size_t) got);
+			got = patch_getline (in, &line);
 			if (got == -1)
 				goto eof;
 			linenum++;
@@ -895,202 +1104,204 @@ static void do_convert_to_unified (void)
 			if (strncmp (line, "+++ ", 4))
 				continue;
 
-			fwrite (line, (size_t) got, 1, stdout);
-			copy_unified_hunks (&line, &linelen, &got, &linenum);
+			filebuf_append (out, line, (size_t) got);
+			copy_unified_hunks (in, out, &line, &got, &linenum);
 		}
 	}
 
  eof:
-	if (line)
-		free (line);
-
 	return;
 }
 
-static FILE *do_convert (FILE *f, const char *mode, int seekable,
-			 void (*fn) (void))
+/* Replace the patch held in buf with the output of fn. */
+static void filebuf_convert (struct filebuf *buf,
+			     void (*fn) (struct patch_reader *,
+					 struct filebuf *))
 {
-	int fildes[2];
-	int fd = fileno (f);
-	FILE *ret;
+	struct patch_reader in;
+	struct filebuf converted;
 
-	fflush (NULL);
-	if (strchr (mode, 'r')) {
-		if (strchr (mode, 'w') || strchr (mode, '+'))
-			/* Can't do bidirectional conversions. */
-			return NULL;
+	if (!buf->size)
+		return;
 
-		/* Read from f (which may be in unified format), and
-		 * return a FILE* that gives context format when
-		 * read. */
+	patch_reader_init (&in, buf->data, buf->size);
+	filebuf_init (&converted);
+	(*fn) (&in, &converted);
+	converted.data[converted.size] = '\0';
+	filebuf_free (buf);
+	*buf = converted;
+}
 
-		if (pipe (fildes))
-			error (EXIT_FAILURE, errno, "pipe failed");
+void convert_to_context (struct filebuf *buf)
+{
+	filebuf_convert (buf, do_convert_to_context);
+}
 
-		switch (fork ()) {
-		case -1:
-			error (EXIT_FAILURE, errno, "fork failed");
+void convert_to_unified (struct filebuf *buf)
+{
+	filebuf_convert (buf, do_convert_to_unified);
+}
 
-		default:
-			/* Parent. */
-			close (fildes[1]);
-			ret = fdopen (fildes[0], mode);
-			if (!ret)
-			    error (EXIT_FAILURE, errno, "fdopen failed");
+static int
+read_timezone (const char *tz)
+{
+	int zone = -1;
+	char *endptr;
 
-			if (seekable) {
-				FILE *tmp = xtmpfile ();	
-				while (!feof (ret)) {
-					int c = fgetc (ret);
+	tz += strspn (tz, " ");
+	zone = strtol (tz, &endptr, 10);
+	if (tz == endptr)
+		zone = -1;
 
-					if (c == EOF)
-						break;
+	return zone;
+}
 
-					fputc (c, tmp);
-				}
+/* The timestamps below are read the way strptime() reads them in the C
+ * locale, white space and all, but without its cost: it is tried at
+ * every space in every file name. */
 
-				fclose (ret);
-				rewind (tmp);
-				return tmp;
-			}
+static const char *const day_names[] = {
+	"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+	"Saturday"
+};
 
-			return ret;
+static const char *const month_names[] = {
+	"January", "February", "March", "April", "May", "June", "July",
+	"August", "September", "October", "November", "December"
+};
 
-		case 0:
-			/* Child. */
-#ifdef PROFILE
-			{
-				extern void _start (void), etext (void);
-				monstartup ((u_long) &_start, (u_long) &etext);
-			}
-#endif
-#ifdef DEBUG
-			sleep (10);
-#endif /* DEBUG */
-			close (fildes[0]);
-
-			if (fd != STDIN_FILENO) {
-				dup2 (fd, STDIN_FILENO);
-				fclose (f);
-			}
+static const char *
+skip_space (const char *p)
+{
+	while (isspace ((unsigned char) *p))
+		p++;
+	return p;
+}
 
-			if (fildes[1] != STDOUT_FILENO)
-				dup2 (fildes[1], STDOUT_FILENO);
+/* A number of at most width digits, after any white space. */
+static const char *
+read_number (const char *p, int width, int min, int max, int *val)
+{
+	int n = 0;
 
-			(*fn) ();
-			exit (0);
-		}
-	}
-	else if (strchr (mode, 'w')) {
-		if (strchr (mode, 'r') || strchr (mode, '+'))
-			/* Can't do bidirectional conversions. */
-			return NULL;
+	p = skip_space (p);
+	if (*p < '0' || *p > '9')
+		return NULL;
 
-		/* Return a FILE* that, when written in unified
-		 * format, sends cnotext format to f. */
+	do
+		n = n * 10 + *p++ - '0';
+	while (--width > 0 && n * 10 <= max && *p >= '0' && *p <= '9');
 
-		if (pipe (fildes))
-			error (EXIT_FAILURE, errno, "pipe failed");
+	if (n < min || n > max)
+		return NULL;
 
-		switch (fork ()) {
-		case -1:
-			error (EXIT_FAILURE, errno, "fork failed");
+	*val = n;
+	return p;
+}
 
-		default:
-			/* Parent. */
-			close (fildes[1]);
-			return fdopen (fildes[1], mode);
-
-		case 0:
-			/* Child. */
-#ifdef PROFILE
-			{
-				extern void _start (void), etext (void);
-				monstartup ((u_long) &_start, (u_long) &etext);
-			}
-#endif
-			close (fildes[0]);
+/* A day or month name, in full or cut to three letters. */
+static const char *
+read_name (const char *p, const char *const *names, int count, int *val)
+{
+	int i;
 
-			if (fildes[0] != STDIN_FILENO)
-				dup2 (fildes[0], STDIN_FILENO);
+	for (i = 0; i < count; i++) {
+		const char *name = names[i];
+		size_t len = 0;
 
-			if (fd != STDOUT_FILENO) {
-				dup2 (fd, STDOUT_FILENO);
-				fclose (f);
-			}
+		while (name[len] && tolower ((unsigned char) p[len]) ==
+		       tolower ((unsigned char) name[len]))
+			len++;
 
-			(*fn) ();
-			exit (0);
+		if (!name[len] || len >= 3) {
+			*val = i;
+			return p + (name[len] ? 3 : len);
 		}
 	}
 
 	return NULL;
 }
 
-FILE *convert_to_context (FILE *f, const char *mode, int seekable)
+/* HH:MM:SS */
+static const char *
+read_time (const char *p, struct tm *tm)
 {
-	return do_convert (f, mode, seekable, do_convert_to_context);
-}
+	if ((p = read_number (p, 2, 0, 23, &tm->tm_hour)) && *p == ':' &&
+	    (p = read_number (p + 1, 2, 0, 59, &tm->tm_min)) && *p == ':')
+		return read_number (p + 1, 2, 0, 61, &tm->tm_sec);
 
-FILE *convert_to_unified (FILE *f, const char *mode, int seekable)
-{
-	return do_convert (f, mode, seekable, do_convert_to_unified);
+	return NULL;
 }
 
-static int
-read_timezone (const char *tz)
+/* Read a timestamp in one of the forms diff writes, returning the
+ * end of it or NULL if there isn't one. */
+static const char *
+scan_timestamp (const char *p, struct tm *result)
 {
-	int zone = -1;
-	char *endptr;
+	const char *end;
+	struct tm tm;
+	int year, mon, mday = 0, wday = -1;
 
-	tz += strspn (tz, " ");
-	zone = strtol (tz, &endptr, 10);
-	if (tz == endptr)
-		zone = -1;
+	/* First try ISO 8601-style timestamp */
+	if ((end = read_number (p, 4, 0, 9999, &year)) && *end == '-' &&
+	    (end = read_number (end + 1, 2, 1, 12, &mon)) && *end == '-' &&
+	    (end = read_number (end + 1, 2, 1, 31, &mday)) &&
+	    (end = read_time (end, &tm))) {
+		mon--;
 
-	return zone;
+		/* Skip nanoseconds. */
+		if (*end == '.') {
+			end++;
+			end += strspn (end, "0123456789");
+		}
+	}
+	/* If that fails try a traditional format: ctime's
+	 * "Sat Jan 31 12:34:56 2009", or CVS's "Jan 2009 12:34:56" */
+	else if ((end = read_name (p, day_names, 7, &wday)) &&
+		 (end = read_name (skip_space (end), month_names, 12,
+				   &mon)) &&
+		 (end = read_number (end, 2, 1, 31, &mday)) &&
+		 (end = read_time (end, &tm)))
+		end = read_number (end, 4, 0, 9999, &year);
+	else if ((end = read_name (p, month_names, 12, &mon)) &&
+		 (end = read_number (end, 4, 0, 9999, &year)))
+		end = read_time (end, &tm);
+
+	if (end && result) {
+		result->tm_year = year - 1900;
+		result->tm_mon = mon;
+		result->tm_hour = tm.tm_hour;
+		result->tm_min = tm.tm_min;
+		result->tm_sec = tm.tm_sec;
+		/* CVS's form has no day, and only ctime's has a
+		 * weekday. */
+		if (mday)
+			result->tm_mday = mday;
+		if (wday != -1)
+			result->tm_wday = wday;
+	}
+
+	return end;
 }
 
 int
 read_timestamp (const char *timestamp, struct tm *result, long *zone)
 {
-	char *end;
-	struct tm tm_t;
-	long zone_t;
-
-	if (!result)
-		result = &tm_t;
-	if (!zone)
-		zone = &zone_t;
+	const char *end;
 
 	timestamp += strspn (timestamp, " \t");
+	end = scan_timestamp (timestamp, result);
+	if (!end)
+		return 1;
 
-	/* First try ISO 8601-style timestamp */
-	end = strptime (timestamp, "%Y-%m-%d %H:%M:%S", result);
-	if (end) {
-		/* Skip nanoseconds. */
-		if (*end == '.') {
-			end++;
-			end += strspn (end, "0123456789");
-		}
-
+	if (zone)
 		*zone = read_timezone (end);
-	} else {
-		/* If that fails try a traditional format */
-		if ((end = strptime (timestamp, "%a %b %e %T %Y", result)))
-			*zone = read_timezone (end);
-		else if ((end = strptime (timestamp, "%b %Y %H:%M:%S",
-					  result)))
-			*zone = read_timezone (end);
-		else
-			return 1;
-	}
 
 	return 0;
 }
 
-char *
-filename_from_header (const char *header)
+size_t
+filename_length (const char *header)
 {
 	int first_space = strcspn (header, " \t\n");
 	int h = first_space;
@@ -1099,7 +1310,7 @@ filename_from_header (const char *header)
 		i = strspn (header + h, " \t");
 		if (!header[h + i])
 			break;
-		if (!read_timestamp (header + h + i, NULL, NULL))
+		if (scan_timestamp (header + h + i, NULL))
 			break;
 		h += i + 1;
 		h += strcspn (header + h, " \t\n");
@@ -1110,5 +1321,11 @@ filename_from_header (const char *header)
 		   at least one space, split at the first. */
 		h = first_space;
 
-	return xstrndup (header, h);
+	return h;
+}
+
+char *
+filename_from_header (const char *header)
+{
+	return xstrndup_as (ALLOC_HEADER, header, filename_length (header));
 }
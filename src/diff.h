@@ -19,6 +19,87 @@
  */
 
 #include <time.h>
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h> /* for ssize_t */
+#endif /* HAVE_SYS_TYPES_H */
+
+/*
+ * Zero-copy patch reading.
+ *
+ * A patch_reader walks a patch held in memory (see struct filebuf),
+ * handing out each line as a pointer into the buffer together with
+ * its length, which includes the trailing newline if there is one.
+ * Lines are not NUL-terminated, but the buffer as a whole is, so a
+ * line can always be scanned up to its newline.
+ */
+struct patch_reader {
+	const char *data;
+	size_t size;
+	size_t pos;
+	int eof;
+};
+
+void patch_reader_init (struct patch_reader *r, const char *data,
+			size_t size);
+
+/* Like getline(3): returns the line length, or -1 at end of input.
+ * patch_eof() becomes true once the end has been reached, as feof()
+ * would, and patch_seek() clears it again. */
+ssize_t patch_getline (struct patch_reader *r, const char **line);
+int patch_eof (const struct patch_reader *r);
+size_t patch_tell (const struct patch_reader *r);
+void patch_seek (struct patch_reader *r, size_t pos);
+
+/* Move past the body of a unified hunk, given how many old and new
+ * lines are still to come, as a loop calling patch_getline() would.
+ * Only the first character of each line is looked at.  Returns the
+ * number of lines passed over, and updates the counts, which are only
+ * left non-zero if the input ends first.  A '\' line after the last
+ * counted line is left to be read. */
+unsigned long patch_skip_hunk (struct patch_reader *r,
+			       unsigned long *orig_left,
+			       unsigned long *new_left);
+
+/*
+ * Record-level parsing of unified diffs on top of a patch_reader.
+ *
+ * Each call to patch_next_record() consumes one record: a '--- '/'+++ '
+ * file header pair, an '@@ ' hunk line, a line belonging to a hunk
+ * body (including any '\' lines ending it), or any other line.
+ */
+enum patch_record_type {
+	PATCH_EOF = 0,
+	PATCH_OTHER,
+	PATCH_FILE,
+	PATCH_HUNK,
+	PATCH_LINE
+};
+
+struct patch_record {
+	enum patch_record_type type;
+	size_t offset;		/* where the record starts */
+	unsigned long linenum;	/* line number of its first line */
+	const char *line;	/* the (first) line, with its length */
+	size_t length;
+	const char *line2;	/* PATCH_FILE: the '+++ ' line */
+	size_t length2;
+	unsigned long orig_offset, orig_count;	/* PATCH_HUNK */
+	unsigned long new_offset, new_count;
+};
+
+struct patch_parser {
+	struct patch_reader *reader;
+	unsigned long linenum;	/* lines consumed so far */
+	unsigned long orig_left, new_left;
+	int in_hunk;
+};
+
+void patch_parser_init (struct patch_parser *p, struct patch_reader *r);
+
+/* Forget any hunk in progress, e.g. after the reader has been moved. */
+void patch_parser_reset (struct patch_parser *p);
+enum patch_record_type patch_next_record (struct patch_parser *p,
+					  struct patch_record *rec);
 
 int num_pathname_components (const char *x);
 
@@ -46,12 +127,18 @@ int read_atatline (const char *atatline,
 		   unsigned long *new_count);
 
 /* Conversion between formats. */
-FILE *convert_to_context (FILE *destination, const char *mode, int seekable);
-FILE *convert_to_unified (FILE *destination, const char *mode, int seekable);
+struct filebuf;
+
+/* Convert the patch in buf, in place, to context or unified format. */
+void convert_to_context (struct filebuf *buf);
+void convert_to_unified (struct filebuf *buf);
 
 /* Filename/timestamp separation. */
 int read_timestamp (const char *timestamp,
 		    struct tm *result /* may be NULL */,
 		    long *zone        /* may be NULL */);
 
+/* The length of the file name at the start of a ---/+++ header line
+ * (after the "--- "), and a copy of it. */
+size_t filename_length (const char *header);
 char *filename_from_header (const char *header);
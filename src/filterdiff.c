@@ -31,9 +31,21 @@
 #ifdef HAVE_SYS_TYPES_H
 # include <sys/types.h> // for ssize_t
 #endif /* HAVE_SYS_TYPES_H */
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif /* HAVE_SYS_SENDFILE_H */
 #include <fnmatch.h>
 #include <getopt.h>
 #include <locale.h>
+#ifdef HAVE_PCRE2_H
+# define PCRE2_CODE_UNIT_WIDTH 8
+# include <pcre2.h>
+#endif /* HAVE_PCRE2_H */
 #ifdef HAVE_PCRE2POSIX_H
 # include <pcre2posix.h>
 #else
@@ -44,9 +56,16 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
 
 #include "util.h"
 #include "diff.h"
+#include "literals.h"
+#include "pidx.h"
+#include "probes.h"
+#include "stats.h"
 
 struct range {
 	struct range *next;
@@ -91,7 +110,17 @@ static enum {
 	mode_grep,
 } mode;
 static regex_t *regex = NULL;
+static struct literals **prefilter = NULL; /* what regex[i] needs to match */
 static size_t num_regex = 0;
+#ifdef HAVE_PCRE2_H
+static pcre2_code **pcre = NULL;	/* -P patterns */
+static size_t num_pcre = 0;
+#endif /* HAVE_PCRE2_H */
+static struct literals *fixed = NULL;	/* patterns that are plain strings */
+static int fixed_strings = 0;
+static char **alternatives = NULL;	/* patterns to join into one regex */
+static size_t num_alternatives = 0;
+static int alternatives_egrepping = 0;	/* the syntax they are written in */
 static int clean_comments = 0;
 static int numbering = 0;
 static int annotating = 0;
@@ -104,23 +133,169 @@ static int show_status = 0;
 static int verbose = 0;
 static int removing_timestamp = 0;
 static int egrepping = 0;
+static int perl_regexp = 0;
 static int print_patchnames = -1;
 static int empty_files_as_absent = 0;
-static unsigned long filecount=0;
+static unsigned int jobs = 1;
+static int build_index = 0;
+static int use_index = 0;	/* can an index stand in for reading? */
+static int copy_hunks = 0;	/* are hunks printed just as they are? */
+
+/* One input file: where its output goes, and the running counts that
+ * the output depends on.  Without -j a single job is used for all the
+ * inputs, so the counts carry on from one file to the next. */
+struct job {
+	const char *patchname;
+	FILE *out;
+	unsigned long linenum;
+	unsigned long filecount;
+	char *output;		/* with -j, the output waiting to be printed */
+	size_t output_size;
+	int done;
+
+	/* When -j splits a single patch, the piece this job covers, and
+	 * the line filterdiff() stopped at: the first file boundary at or
+	 * after stop. */
+	const char *text;
+	const char *stop;
+	const char *stopped;
+
+	int counting;		/* only counting the lines and files */
+
+	/* When line and file numbers carry on from one job to the next,
+	 * where the job after this one starts.  These are known once
+	 * numbered is set, before this job has been filtered. */
+	int numbered;
+	unsigned long next_linenum;
+	unsigned long next_filecount;
+	const char *next_text;
+
+	struct pidx_builder *index;	/* --build-index: where files are */
+
+#ifdef HAVE_PCRE2_H
+	pcre2_match_data *match_data;	/* for this job's -P matches */
+#endif /* HAVE_PCRE2_H */
+};
 
+/* Match the first len bytes of string, which need not be
+ * NUL-terminated, against each regex in turn.  A regex whose prefilter
+ * finds none of its strings in the text is not tried at all. */
 static int
-regexecs (regex_t *regex, size_t num_regex, const char *string,
-	  size_t nmatch, regmatch_t pmatch[], int eflags)
+regexecs (regex_t *regex, struct literals **prefilter, size_t num_regex,
+	  const char *string, size_t len, int eflags)
 {
+	const char *nul = memchr (string, '\0', len);
+	regmatch_t match;
 	size_t i;
 	int ret = REG_NOMATCH;
-	for (i = 0; i < num_regex; i++)
-		if (!(ret = regexec (&regex[i], string, nmatch,
-				     pmatch, eflags)))
+#ifndef REG_STARTEND
+	char *copy;
+#endif
+
+	/* As with a C string, a NUL byte ends the text. */
+	if (nul)
+		len = nul - string;
+
+#ifdef REG_STARTEND
+	match.rm_so = 0;
+	match.rm_eo = len;
+	eflags |= REG_STARTEND;
+#else
+	copy = xstrndup_as (ALLOC_REGEX, string, len);
+	string = copy;
+#endif
+
+	for (i = 0; i < num_regex; i++) {
+		if (prefilter[i] && !literals_find (prefilter[i], string, len))
+			continue;
+		STATS_ADD (STATS_REGEX, 1);
+		if (!(ret = regexec (&regex[i], string, 1, &match, eflags)))
 			break;
+	}
+#ifndef REG_STARTEND
+	xfree_as (ALLOC_REGEX, copy);
+#endif
 	return ret;
 }
 
+/* Does the hunk line text (len bytes, not NUL-terminated) match any of
+ * the patterns? */
+static int
+line_matches (struct job *job, const char *text, size_t len)
+{
+	const char *nul = memchr (text, '\0', len);
+#ifdef HAVE_PCRE2_H
+	size_t i;
+#endif /* HAVE_PCRE2_H */
+
+	/* As with a C string, a NUL byte ends the text. */
+	if (nul)
+		len = nul - text;
+
+	if (fixed && literals_find (fixed, text, len))
+		return 1;
+
+#ifdef HAVE_PCRE2_H
+	for (i = 0; i < num_pcre; i++) {
+		int ret;
+
+		/* Each job has its own match data, so that jobs can run
+		 * at the same time. */
+		if (!job->match_data) {
+			job->match_data = pcre2_match_data_create (1, NULL);
+			if (!job->match_data)
+				error (EXIT_FAILURE, errno, "malloc");
+		}
+
+		STATS_ADD (STATS_REGEX, 1);
+		ret = pcre2_match (pcre[i], (PCRE2_SPTR) text, len, 0, 0,
+				   job->match_data, NULL);
+		if (ret >= 0)
+			return 1;
+		if (ret != PCRE2_ERROR_NOMATCH) {
+			PCRE2_UCHAR errstr[300];
+			pcre2_get_error_message (ret, errstr, sizeof (errstr));
+			error (EXIT_FAILURE, 0, "%s", (char *) errstr);
+		}
+	}
+#endif /* HAVE_PCRE2_H */
+
+	return num_regex && !regexecs (regex, prefilter, num_regex, text, len,
+				       0);
+}
+
+/* Fetch the next line, as getline would, but without copying it. */
+static ssize_t
+read_line (const char **line, size_t *linelen, struct patch_reader *f)
+{
+	ssize_t got = patch_getline (f, line);
+	if (got != -1)
+		*linelen = got;
+	return got;
+}
+
+/* Like strtoul, but never skips past the end of the line. */
+static unsigned long
+line_strtoul (const char *n, char **end)
+{
+	const char *p = n + strspn (n, " \t");
+
+	if (!isdigit ((unsigned char) *p)) {
+		*end = (char *) n;
+		return 0;
+	}
+
+	return strtoul (p, end, 10);
+}
+
+/* The length of a line within the patch, including its newline. */
+static size_t
+line_length (const char *line)
+{
+	size_t len = strcspn (line, "\n");
+	return line[len] ? len + 1 : len;
+}
+
 static int file_exists (const char *name, const char *timestamp)
 {
 	struct tm t;
@@ -164,72 +339,79 @@ static int file_exists (const char *name, const char *timestamp)
 	return 1;
 }
 
-static int output_header_line (const char *line)
+static int output_header_line (FILE *out, const char *line)
 {
+	size_t len = line_length (line);
 	char *fn;
 
 	if (strncmp (line, "diff", 4) == 0 && isspace (line[4])) {
 		size_t		args = 0;
 		const char	*end = line + 5, *begin = end, *ws = end;
-		printf ("%.5s", line);
-		while (*end != 0) {
+		fprintf (out, "%.5s", line);
+		while (end < line + len) {
 			if (isspace (*begin))
 				begin = end;
 			if (isspace (*end)) {
 				if (*begin == '-') {
 					if (isspace (begin[1]))
 						++args;
-					printf ("%.*s", (int)(end - ws), ws);
+					fprintf (out, "%.*s",
+						 (int)(end - ws), ws);
 				} else {
-					printf ("%.*s", (int)(begin - ws), ws);
+					fprintf (out, "%.*s",
+						 (int)(begin - ws), ws);
 					if (args == 0 && old_prefix_to_add)
 						fputs (old_prefix_to_add,
-						       stdout);
+						       out);
 					if (args == 1 && new_prefix_to_add)
 						fputs (new_prefix_to_add,
-						       stdout);
+						       out);
 					++args;
-					fn = xstrndup (begin, end - begin);
+					fn = xstrndup_as (ALLOC_HEADER, begin,
+							  end - begin);
 					fputs (stripped (fn,
 							 strip_components),
-					       stdout);
-					free (fn);
+					       out);
+					xfree_as (ALLOC_HEADER, fn);
 				}
 				ws = begin = end;
 			}
 			++end;
 		}
-		printf ("%.*s", (int)(end - ws), ws);
+		fprintf (out, "%.*s", (int)(end - ws), ws);
 	} else if (strncmp (line, "---", 3) == 0 ||
 		   strncmp (line, "+++", 3) == 0) {
 
-		int h = strcspn (line + 4, "\t\n");
-		fwrite (line, 1, 4, stdout);
+		size_t h = 0;
+
+		if (len > 4)
+			h = strcspn (line + 4, "\t\n");
+		fwrite (line, 1, len < 4 ? len : 4, out);
 
 		if (prefix_to_add)
-			fputs (prefix_to_add, stdout);
+			fputs (prefix_to_add, out);
 		else {
 			if (old_prefix_to_add && strncmp (line, "---", 3) == 0)
-				fputs (old_prefix_to_add, stdout);
+				fputs (old_prefix_to_add, out);
 			if (new_prefix_to_add && strncmp (line, "+++", 3) == 0)
-				fputs (new_prefix_to_add, stdout);
+				fputs (new_prefix_to_add, out);
 		}
 
-		fn = xstrndup (line + 4, h);
-		fputs (stripped (fn, strip_components), stdout);
+		fn = xstrndup_as (ALLOC_HEADER, line + 4, h);
+		fputs (stripped (fn, strip_components), out);
 		if (removing_timestamp)
-			putchar ('\n');
-		else
-			fputs (line + 4 + h, stdout);
+			putc ('\n', out);
+		else if (len > 4 + h)
+			fwrite (line + 4 + h, len - 4 - h, 1, out);
 
-		free (fn);
+		xfree_as (ALLOC_HEADER, fn);
 	} else
-		fputs (line, stdout);
+		fwrite (line, len, 1, out);
 	return 0;
 }
 
 static int
-file_matches (void)
+file_matches (const struct job *job)
 {
 	int f = 0;
 	struct range *r;
@@ -238,9 +420,9 @@ file_matches (void)
 	// wildcard.
 	for (r = files; r; r = r->next)
 		if ((r->start == -1UL ||
-		     r->start <= filecount) &&
+		     r->start <= job->filecount) &&
 		    (r->end == -1UL ||
-		     filecount <= r->end)) {
+		     job->filecount <= r->end)) {
 			f = 1;
 			break;
 		}
@@ -253,36 +435,38 @@ file_matches (void)
 	return 1;
 }
 
-static void display_filename (unsigned long linenum, char status,
-			      const char *filename, const char *patchname)
+static void display_filename (struct job *job, unsigned long linenum,
+			      char status, const char *filename,
+			      const char *patchname)
 {
-	if (mode == mode_list && !file_matches ())
+	if (mode == mode_list && !file_matches (job))
 		/* This is lsdiff --files=... and this file is not to be
 		 * listed. */
 		return;
 
 	if (print_patchnames)
-		printf ("%s:", patchname);
+		fprintf (job->out, "%s:", patchname);
 	if (numbering)
-		printf ("%lu\t", linenum);
+		fprintf (job->out, "%lu\t", linenum);
 	if (number_files)
-		printf ("File #%-3lu\t", filecount);
+		fprintf (job->out, "File #%-3lu\t", job->filecount);
 	if (show_status)
-		printf ("%c ", status);
+		fprintf (job->out, "%c ", status);
 	if (prefix_to_add)
-		fputs (prefix_to_add, stdout);
-	puts (stripped (filename, strip_components));
+		fputs (prefix_to_add, job->out);
+	fputs (stripped (filename, strip_components), job->out);
+	putc ('\n', job->out);
 }
 
 static int
-hunk_matches (unsigned long orig_offset, unsigned long orig_count,
-	      unsigned long hunknum)
+hunk_matches (const struct job *job, unsigned long orig_offset,
+	      unsigned long orig_count, unsigned long hunknum)
 {
 	int h = 0, l = 0;
 	struct range *r;
 
 	/* The hunk can't match if the containing file doesn't. */
-	if (!file_matches ())
+	if (!file_matches (job))
 		return 0;
 
 	// For the purposes of matching, zero lines at offset n counts
@@ -327,9 +511,70 @@ hunk_matches (unsigned long orig_offset, unsigned long orig_count,
 	return 1;
 }
 
+/* Room for the start of an "@@" line, up to and including its "@@". */
+#define ATAT_SIZE (4 * 21 + 16)
+
+/* Write the start of a hunk's "@@" line the way it is printed, with
+ * counts of 1 left out, and return its length. */
+static int
+format_atat (char *buf, unsigned long orig_offset, unsigned long orig_count,
+	     unsigned long new_offset, unsigned long new_count)
+{
+	int n = sprintf (buf, "@@ -%lu", orig_offset);
+
+	if (orig_count != 1)
+		n += sprintf (buf + n, ",%lu", orig_count);
+	n += sprintf (buf + n, " +%lu", new_offset);
+	if (new_count != 1)
+		n += sprintf (buf + n, ",%lu", new_count);
+	n += sprintf (buf + n, " @@");
+	return n;
+}
+
+/* Find what follows the ranges in an "@@" line. */
+static const char *
+atat_trailing (const char *line)
+{
+	const char *trailing = line + strcspn (line, "+");
+
+	trailing += strcspn (trailing, " \n");
+	if (*trailing == ' ')
+		trailing++;
+	return trailing + strspn (trailing, "@");
+}
+
+/* Would the "@@" line be printed just as it is? */
+static int
+atat_unchanged (const char *line, const char *trailing,
+		unsigned long orig_offset, unsigned long orig_count,
+		unsigned long new_offset, unsigned long new_count)
+{
+	char atat[ATAT_SIZE];
+	int len = format_atat (atat, orig_offset, orig_count,
+			       new_offset, new_count);
+
+	return len == trailing - line && !memcmp (atat, line, len);
+}
+
+/* Do the header lines follow one another in the patch, running up to
+ * next? */
+static int
+headers_adjacent (const char **header, unsigned int num_headers,
+		  const char *next)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_headers; i++)
+		if (header[i] + line_length (header[i]) !=
+		    (i + 1 < num_headers ? header[i + 1] : next))
+			return 0;
+
+	return 1;
+}
+
 static int
-do_unified (FILE *f, char **header, unsigned int num_headers,
-            int match, char **line,
+do_unified (struct job *job, struct patch_reader *f, const char **header,
+	    unsigned int num_headers, int match, const char **line,
 	    size_t *linelen, unsigned long *linenum,
 	    unsigned long start_linenum, char status,
 	    const char *bestname, const char *patchname,
@@ -352,11 +597,11 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 	int ret = 0;
 	int orig_is_empty = 1, new_is_empty = 1; /* assume until otherwise */
 
-	if (output_matching == output_file)
+	if (match && output_matching == output_file)
 		match_tmpf = xtmpfile ();
 
 	for (;;) {
-		ssize_t got = getline (line, linelen, f);
+		ssize_t got = read_line (line, linelen, f);
 		if (got == -1) {
 			ret = EOF;
 			goto out;
@@ -364,7 +609,8 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 		++*linenum;
 
 		if (!orig_count && !new_count && **line != '\\') {
-			char *trailing;
+			const char *trailing;
+			char atat[ATAT_SIZE];
 
 			if (strncmp (*line, "@@ ", 3))
 				break;
@@ -372,6 +618,11 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 			/* Next chunk. */
 			hunknum++;
 			hunk_linenum = *linenum;
+			if (!job->counting) {
+				STATS_ADD (STATS_HUNKS, 1);
+				PROBE3 (hunk__start, job->filecount, hunknum,
+					hunk_linenum);
+			}
 
 			if (output_matching == output_hunk && !grepmatch)
 				// We are missing this hunk out, but
@@ -381,16 +632,29 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 
 			if (output_matching != output_file)
 				grepmatch = 0;
-			if (output_matching == output_hunk) {
+			if (match && output_matching == output_hunk) {
 				if (match_tmpf)
-					fclose (match_tmpf);
+					xtmpclose (match_tmpf);
 				match_tmpf = xtmpfile ();
 			}
 
 			if (read_atatline (*line, &orig_offset, &orig_count,
 					   &new_offset, &new_count))
 				error (EXIT_FAILURE, 0,
-				      "line not understood: %s", *line);
+				      "line not understood: %.*s",
+				      (int) strcspn (*line, "\n"), *line);
+
+			if (job->index) {
+				struct pidx_hunk hunk;
+
+				hunk.offset = *line - f->data;
+				hunk.linenum = *linenum;
+				hunk.orig_offset = orig_offset;
+				hunk.orig_count = orig_count;
+				hunk.new_offset = new_offset;
+				hunk.new_count = new_count;
+				pidx_add_hunk (job->index, &hunk);
+			}
 
 			if (orig_count)
 				orig_is_empty = 0;
@@ -399,37 +663,65 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 
 			// Decide if this hunk matches.
 			if (match)
-				hunk_match = hunk_matches (orig_offset,
+				hunk_match = hunk_matches (job, orig_offset,
 							   orig_count,
 							   hunknum);
 			else hunk_match = 0;
 
-			trailing = strchr (*line, '+');
-			trailing += strcspn (trailing, " \n");
-			if (*trailing == ' ')
-				trailing++;
-			trailing += strspn (trailing, "@");
+			trailing = atat_trailing (*line);
+
+			// A hunk that is printed just as it is in the
+			// patch goes out in one piece, along with the
+			// header if that is unchanged and just before.
+			if (hunk_match && copy_hunks &&
+			    atat_unchanged (*line, trailing, orig_offset,
+					    orig_count,
+					    new_offset + munge_offset,
+					    new_count)) {
+				const char *from = *line;
+
+				if (!header_displayed) {
+					unsigned int i;
+
+					if (headers_adjacent (header,
+							      num_headers,
+							      *line))
+						from = header[0];
+					else for (i = 0; i < num_headers; i++)
+						output_header_line (job->out,
+								    header[i]);
+					header_displayed = 1;
+				}
+
+				*linenum += patch_skip_hunk (f, &orig_count,
+							     &new_count);
+				fwrite (from, f->data + patch_tell (f) - from,
+					1, job->out);
+				continue;
+			}
 
 			if (hunk_match && numbering && verbose &&
 			    mode != mode_grep) {
 				if (print_patchnames)
-					printf ("%s-", patchname);
-				printf ("\t%lu\tHunk #%lu",
-					hunk_linenum, hunknum);
+					fprintf (job->out, "%s-", patchname);
+				fprintf (job->out, "\t%lu\tHunk #%lu",
+					 hunk_linenum, hunknum);
 				if (verbose > 1) {
-					char *p = trailing;
+					const char *p = trailing;
 					if (*p != '\n')
 						p++;
-					printf ("\t%s", p);
+					putc ('\t', job->out);
+					fwrite (p, got - (p - *line), 1,
+						job->out);
 				} else
-					putchar ('\n');
+					putc ('\n', job->out);
 			}
 
 			if (hunk_match &&
 			    (mode == mode_filter ||
 			     output_matching != output_none)) {
 				int first_hunk = !header_displayed;
-				FILE *output_to = stdout;
+				FILE *output_to = job->out;
 
 				if (mode == mode_grep) {
 					delayed_munge = orig_count - new_count;
@@ -442,11 +734,11 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 					// Display the header.
                                         unsigned int i;
                                         for (i = 0; i < num_headers - 2; i++)
-                                                output_header_line (header[i]);
+                                                output_header_line (job->out, header[i]);
 					if (number_lines != After)
-						output_header_line (header[num_headers - 2]);
+						output_header_line (job->out, header[num_headers - 2]);
 					if (number_lines != Before)
-						output_header_line (header[num_headers - 1]);
+						output_header_line (job->out, header[num_headers - 1]);
 					header_displayed = 1;
 				}
 				switch (number_lines) {
@@ -455,17 +747,10 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 					// counts, adjusting for any
 					// hunks we've previously
 					// missed out.
-					fprintf (output_to,
-						 "@@ -%lu", orig_offset);
-					if (orig_count != 1)
-						fprintf (output_to,
-							 ",%lu", orig_count);
-					fprintf (output_to, " +%lu",
-						 new_offset + munge_offset);
-					if (new_count != 1)
-						fprintf (output_to,
-							 ",%lu", new_count);
-					fprintf (output_to, " @@");
+					fwrite (atat, format_atat
+						(atat, orig_offset, orig_count,
+						 new_offset + munge_offset,
+						 new_count), 1, output_to);
 
 					if (annotating)
 						fprintf (output_to,
@@ -504,6 +789,12 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 				// it would have added or removed.
 				munge_offset += orig_count - new_count;
 
+			// Nothing needs to see the lines in this hunk
+			// one at a time, so just step over them.
+			if (!hunk_match || mode == mode_list)
+				*linenum += patch_skip_hunk (f, &orig_count,
+							     &new_count);
+
 			continue;
 		}
 
@@ -519,11 +810,11 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 		     || (**line == '-' && only_matching & only_match_rem)
 		    || (**line == '+' && only_matching & only_match_add)
 		    ) &&
-		    !regexecs (regex, num_regex, *line + 1, 0, NULL, 0)) {
+		    line_matches (job, *line + 1, got - 1)) {
 			if (output_matching == output_none) {
 				if (!displayed_filename) {
 					displayed_filename = 1;
-					display_filename (start_linenum,
+					display_filename (job, start_linenum,
 							  status, bestname,
 							  patchname);
 				}
@@ -532,20 +823,22 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 				    hunknum > last_hunkmatch) {
 					last_hunkmatch = hunknum;
 					if (print_patchnames)
-						printf ("%s-", patchname);
-					printf ("\t%lu\tHunk #%lu\n",
-						hunk_linenum, hunknum);
+						fprintf (job->out, "%s-",
+							 patchname);
+					fprintf (job->out,
+						 "\t%lu\tHunk #%lu\n",
+						 hunk_linenum, hunknum);
 				}
 			} else {
 				if (match_tmpf) {
                                         if (!header_displayed) {
                                                 unsigned int i;
                                                 for (i = 0; i < num_headers - 2; i++)
-                                                        output_header_line (header[i]);
+                                                        output_header_line (job->out, header[i]);
                                                 if (number_lines != After)
-                                                        output_header_line (header[num_headers - 2]);
+                                                        output_header_line (job->out, header[num_headers - 2]);
                                                 if (number_lines != Before)
-                                                        output_header_line (header[num_headers - 1]);
+                                                        output_header_line (job->out, header[num_headers - 1]);
 						header_displayed = 1;
                                         }
 
@@ -554,9 +847,9 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 						int ch = fgetc (match_tmpf);
 						if (ch == EOF)
 							break;
-						putchar (ch);
+						putc (ch, job->out);
 					}
-					fclose (match_tmpf);
+					xtmpclose (match_tmpf);
 					match_tmpf = NULL;
 				}
 				grepmatch = 1;
@@ -566,7 +859,7 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 		if (hunk_match &&
 		    (mode == mode_filter ||
 		     output_matching != output_none)) {
-			FILE *output_to = stdout;
+			FILE *output_to = job->out;
 			if (mode == mode_grep && !grepmatch)
 				output_to = match_tmpf;
 			if (number_lines == None)
@@ -580,15 +873,17 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
                                         // Handle whitespace damage
                                         rest++;
 
-				fprintf (output_to, "%lu\t:%s",
-					 track_linenum++, rest);
+				fprintf (output_to, "%lu\t:",
+					 track_linenum++);
+				fwrite (rest, got - (rest - *line), 1,
+					output_to);
                         }
 		}
 	}
 
  out:
 	if (match_tmpf)
-		fclose (match_tmpf);
+		xtmpclose (match_tmpf);
 
 	if (empty_files_as_absent) {
 		if (orig_file_exists != NULL && orig_is_empty)
@@ -601,8 +896,8 @@ do_unified (FILE *f, char **header, unsigned int num_headers,
 }
 
 static int
-do_context (FILE *f, char **header, unsigned int num_headers,
-            int match, char **line,
+do_context (struct job *job, struct patch_reader *f, const char **header,
+	    unsigned int num_headers, int match, const char **line,
 	    size_t *linelen, unsigned long *linenum,
 	    unsigned long start_linenum, char status,
 	    const char *bestname, const char *patchname,
@@ -615,7 +910,8 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 	unsigned long changed[2];
 	long munge_offset = 0;
 	int header_displayed = 0;
-	char *n, *end;
+	const char *n, *eol;
+	char *end;
 	int i;
 	int hunk_match = 0;
 	int displayed_filename = 0;
@@ -627,7 +923,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 	unsigned long unchanged;
 	int first_hunk = 0;
 	int orig_is_empty = 1, new_is_empty = 1; /* assume until otherwise */
-	size_t got = 0;
+	ssize_t got = 0;
 
 	/* Context diff hunks are like this:
 	 *
@@ -644,18 +940,18 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 	 * \ No newline at end of file
 	 */
 
-	if (getline (line, linelen, f) == -1)
+	if (read_line (line, linelen, f) == -1)
 		return EOF;
 	++*linenum;
 
 	if (strncmp (*line, "***************", 15))
 		return 1;
 
-	if (getline (line, linelen, f) == -1)
+	if (read_line (line, linelen, f) == -1)
 		return EOF;
 	++*linenum;
 
-	if (output_matching == output_file)
+	if (match && output_matching == output_file)
 		match_tmpf = xtmpfile ();
 
  next_hunk:
@@ -674,7 +970,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 			 * but the GNU diff info page disagrees. */
 			i--;
 
-			if (getline (line, linelen, f) == -1) {
+			if (read_line (line, linelen, f) == -1) {
 			    ret = EOF;
 			    goto out;
 			}
@@ -691,18 +987,24 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 		if (!i) {
 			hunknum++;
 			hunk_linenum = *linenum;
+			if (!job->counting) {
+				STATS_ADD (STATS_HUNKS, 1);
+				PROBE3 (hunk__start, job->filecount, hunknum,
+					hunk_linenum);
+			}
 			if (output_matching != output_file)
 				grepmatch = 0;
-			if (output_matching == output_hunk) {
+			if (match && output_matching == output_hunk) {
 				if (match_tmpf)
-					fclose (match_tmpf);
+					xtmpclose (match_tmpf);
 				match_tmpf = xtmpfile ();
 			}
 		}
 
 	do_line_counts:
+		eol = *line + *linelen;
 		n = *line + 4;
-		line_start = strtoul (n, &end, 10);
+		line_start = line_strtoul (n, &end);
 		if (n == end) {
 			ret = 1;
 			goto out;
@@ -710,7 +1012,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 
 		if (*end == ',') {
 			n = end + 1;
-			line_end = strtoul (n, &end, 10);
+			line_end = line_strtoul (n, &end);
 			if (n == end) {
 				ret = 1;
 				goto out;
@@ -727,13 +1029,16 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 			line_count = line_start ? 1 : 0;
 		}
 
-		n = strchr (n, '*');
-		if (n)
+		n = memchr (n, '*', eol - n);
+		if (n) {
 			n += 4;
+			if (n > eol)
+				n = eol;
+		}
 
 		if (!i) {
 			if (match)
-				hunk_match = hunk_matches (line_start,
+				hunk_match = hunk_matches (job, line_start,
 							   line_count,
 							   hunknum);
 			else hunk_match = 0;
@@ -741,15 +1046,15 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 			if (hunk_match && numbering && verbose &&
 			    mode != mode_grep) {
 				if (print_patchnames)
-					printf ("%s-", patchname);
-				printf ("\t%lu\tHunk #%lu\n",
-					hunk_linenum, hunknum);
+					fprintf (job->out, "%s-", patchname);
+				fprintf (job->out, "\t%lu\tHunk #%lu\n",
+					 hunk_linenum, hunknum);
 			}
 		}
 
 		if (hunk_match &&
 		    (mode == mode_filter || output_matching != output_none)) {
-			FILE *output_to= stdout;
+			FILE *output_to= job->out;
 
 			if (mode == mode_grep && !grepmatch)
 				output_to = match_tmpf;
@@ -758,11 +1063,11 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 			if (!header_displayed && mode == mode_filter) {
                                 unsigned int i;
                                 for (i = 0; i < num_headers - 2; i++)
-                                        output_header_line (header[i]);
+                                        output_header_line (job->out, header[i]);
 				if (number_lines != After)
-					output_header_line (header[num_headers - 2]);
+					output_header_line (job->out, header[num_headers - 2]);
 				if (number_lines != Before)
-					output_header_line (header[num_headers - 1]);
+					output_header_line (job->out, header[num_headers - 1]);
 				header_displayed = 1;
 			}
 
@@ -779,7 +1084,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 						 " Hunk #%lu, %s\n",
 						 hunknum, bestname);
 				else if (n)
-					fputs (n, output_to);
+					fwrite (n, eol - n, 1, output_to);
 				else
 					fputc ('\n', output_to);
 
@@ -823,7 +1128,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 			}
 		}
 
-		got = getline (line, linelen, f);
+		got = read_line (line, linelen, f);
 		if (got == -1) {
 			ret = EOF;
 			goto out;
@@ -841,35 +1146,39 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 			     || (**line != ' ' && i == 0 && only_matching & only_match_rem)
 			     || (**line != ' ' && i == 1 && only_matching & only_match_add)
 			    ) &&
-			    !regexecs (regex, num_regex, *line + 2,
-				       0, NULL, 0)) {
+			    got >= 2 &&
+			    line_matches (job, *line + 2, got - 2)) {
 				if (output_matching == output_none) {
 					if (!displayed_filename) {
 						displayed_filename = 1;
-						display_filename(start_linenum,
-								 status,
-								 bestname,
-								 patchname);
+						display_filename (job,
+								  start_linenum,
+								  status,
+								  bestname,
+								  patchname);
 					}
 
 					if (numbering && verbose &&
 					    hunknum > last_hunkmatch) {
 						last_hunkmatch = hunknum;
 						if (print_patchnames)
-							printf ("%s-",
-								patchname);
-						printf ("\t%lu\tHunk #%lu\n",
-							hunk_linenum, hunknum);
+							fprintf (job->out,
+								 "%s-",
+								 patchname);
+						fprintf (job->out,
+							 "\t%lu\tHunk #%lu\n",
+							 hunk_linenum,
+							 hunknum);
 					}
 				} else {
 					if (!header_displayed) {
                                                 unsigned int i;
                                                 for (i = 0; i < num_headers - 2; i++)
-                                                        output_header_line (header[i]);
+                                                        output_header_line (job->out, header[i]);
 						if (number_lines != After)
-							output_header_line (header[num_headers - 2]);
+							output_header_line (job->out, header[num_headers - 2]);
 						if (number_lines != Before)
-							output_header_line (header[num_headers - 1]);
+							output_header_line (job->out, header[num_headers - 1]);
 						header_displayed = 1;
 					}
 
@@ -880,9 +1189,9 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 							ch = fgetc(match_tmpf);
 							if (ch == EOF)
 								break;
-							putchar (ch);
+							putc (ch, job->out);
 						}
-						fclose (match_tmpf);
+						xtmpclose (match_tmpf);
 						match_tmpf = NULL;
 					}
 
@@ -919,7 +1228,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 			if (hunk_match &&
 			    (mode == mode_filter ||
 			     output_matching != output_none)) {
-				FILE *output_to = stdout;
+				FILE *output_to = job->out;
 				if (mode == mode_grep && !grepmatch)
 					output_to = match_tmpf;
 
@@ -950,7 +1259,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 					break;
 				}
 
-			got = getline (line, linelen, f);
+			got = read_line (line, linelen, f);
 			if (got == -1) {
 				ret = EOF;
 				goto out;
@@ -966,7 +1275,7 @@ do_context (FILE *f, char **header, unsigned int num_headers,
 
 out:
 	if (match_tmpf)
-		fclose (match_tmpf);
+		xtmpclose (match_tmpf);
 
 	if (empty_files_as_absent) {
 		if (orig_file_exists != NULL && orig_is_empty)
@@ -979,21 +1288,24 @@ out:
 }
 
 #define MAX_HEADERS 6
-static int filterdiff (FILE *f, const char *patchname)
+static int filterdiff (struct job *job, struct patch_reader *f)
 {
-	static unsigned long linenum = 1;
+	const char *patchname = job->patchname;
+	unsigned long linenum = job->linenum;
+	struct arena pool = ARENA_INIT (ALLOC_HEADER);	/* this file's names */
 	char *names[2];
-	char *header[MAX_HEADERS + 2] = { NULL, NULL };
+	const char *header[MAX_HEADERS + 2] = { NULL, NULL };
         unsigned int num_headers = 0;
-	char *line = NULL;
+	const char *line;
 	size_t linelen = 0;
 	char *p;
 	const char *p_stripped;
 	int match;
-	int i;
+	struct stats_timer timer;
 
-	if (getline (&line, &linelen, f) == -1)
-		return 0;
+	STATS_START (&timer);
+	if (read_line (&line, &linelen, f) == -1)
+		goto eof;
 
 	for (;;) {
 		char status = '!';
@@ -1001,8 +1313,9 @@ static int filterdiff (FILE *f, const char *patchname)
 		int orig_file_exists, new_file_exists;
 		int is_context = -1;
 		int result;
-		int (*do_diff) (FILE *, char **, unsigned int,
-                                int, char **, size_t *,
+		int (*do_diff) (struct job *, struct patch_reader *,
+				const char **,
+				unsigned int, int, const char **, size_t *,
 				unsigned long *, unsigned long,
 				char, const char *, const char *,
 				int *, int *);
@@ -1012,6 +1325,11 @@ static int filterdiff (FILE *f, const char *patchname)
 		// Search for start of patch ("diff ", or "--- " for
 		// unified diff, "*** " for context).
 		for (;;) {
+			if (job->stop && line >= job->stop) {
+				job->stopped = line;
+				goto eof;
+			}
+
                         if (!strncmp (line, "diff ", 5))
                                 break;
 
@@ -1028,27 +1346,27 @@ static int filterdiff (FILE *f, const char *patchname)
 			/* Show non-diff lines if excluding, or if
 			 * in verbose mode, and if --clean isn't specified. */
 			if (mode == mode_filter && (pat_exclude || verbose)
-				&& !clean_comments)
-				fputs (line, stdout);
+				&& !clean_comments && !job->counting)
+				fwrite (line, linelen, 1, job->out);
 
-			if (getline (&line, &linelen, f) == -1)
+			if (read_line (&line, &linelen, f) == -1)
 				goto eof;
 			linenum++;
 		}
 
 		start_linenum = linenum;
-		header[0] = xstrdup (line);
+		header[0] = line;
                 num_headers = 1;
 
                 if (is_context == -1) {
                         int valid_extended = 1;
                         for (;;) {
-                                if (getline (&line, &linelen, f) == -1)
+                                if (read_line (&line, &linelen, f) == -1)
                                         goto eof;
                                 linenum++;
 
                                 if (!strncmp (line, "diff ", 5)) {
-                                        header[num_headers++] = xstrdup (line);
+                                        header[num_headers++] = line;
                                         break;
                                 }
 
@@ -1074,9 +1392,9 @@ static int filterdiff (FILE *f, const char *patchname)
 
                                 /* Drop excess header lines */
                                 if (num_headers > MAX_HEADERS )
-                                        free (header[--num_headers]);
+                                        num_headers--;
 
-                                header[num_headers++] = xstrdup (line);
+                                header[num_headers++] = line;
 
                                 if (is_context != -1)
                                         break;
@@ -1092,30 +1410,30 @@ static int filterdiff (FILE *f, const char *patchname)
                         unsigned int i = 0;
                 flush_continue:
                         if (mode == mode_filter && (pat_exclude || verbose)
-                            && !clean_comments) {
+                            && !clean_comments && !job->counting) {
                                 for (i = 0; i < num_headers; i++)
-                                        fputs (header[i], stdout);
-                        }
-                        for (i = 0; i < num_headers; i++) {
-                                free (header[i]);
-                                header[i] = NULL;
+                                        fwrite (header[i],
+                                                line_length (header[i]),
+                                                1, job->out);
                         }
                         num_headers = 0;
                         continue;
                 }
 
-		names[0] = filename_from_header (line + 4);
+		arena_reset (&pool);
+		names[0] = arena_strndup (&pool, line + 4,
+					  filename_length (line + 4));
 		if (mode != mode_filter && show_status)
 			orig_file_exists = file_exists (names[0], line + 4 +
 							strlen (names[0]));
 
-		if (getline (&line, &linelen, f) == -1) {
+		if (read_line (&line, &linelen, f) == -1) {
 			/* Show non-diff lines if excluding, or if
 			 * in verbose mode, and if --clean isn't specified. */
 			if (mode == mode_filter && (pat_exclude || verbose)
-				&& !clean_comments)
-				fputs (header[0], stdout);
-			free (names[0]);
+				&& !clean_comments && !job->counting)
+				fwrite (header[0], line_length (header[0]),
+					1, job->out);
 			goto eof;
 		}
 		linenum++;
@@ -1123,13 +1441,15 @@ static int filterdiff (FILE *f, const char *patchname)
 		if (strncmp (line, is_context ? "--- " : "+++ ", 4)) {
 			/* Show non-diff lines if excluding, or if
 			 * in verbose mode, and if --clean isn't specified. */
-			free (names[0]);
                         goto flush_continue;
 		}
 
-		filecount++;
-		header[num_headers++] = xstrdup (line);
-		names[1] = filename_from_header (line + 4);
+		job->filecount++;
+		if (!job->counting)
+			STATS_ADD (STATS_FILES, 1);
+		header[num_headers++] = line;
+		names[1] = arena_strndup (&pool, line + 4,
+					  filename_length (line + 4));
 
 		if (mode != mode_filter && show_status)
 			new_file_exists = file_exists (names[1], line + 4 +
@@ -1138,14 +1458,31 @@ static int filterdiff (FILE *f, const char *patchname)
 		// Decide whether this matches this pattern.
 		p = best_name (2, names);
 		p_stripped = stripped (p, ignore_components);
+		if (!job->counting)
+			PROBE3 (file__start, job->filecount, p,
+				start_linenum);
+
+		if (job->index) {
+			struct pidx_file file;
+
+			file.offset = header[0] - f->data;
+			file.linenum = start_linenum;
+			file.names = header[num_headers - 2] - f->data;
+			file.context = is_context;
+			file.name = p;
+			pidx_add_file (job->index, &file);
+		}
 
-		match = !patlist_match(pat_exclude, p_stripped);
+		/* Only the extent of the file matters when counting, so
+		 * its hunks are stepped over. */
+		match = !job->counting &&
+			!patlist_match(pat_exclude, p_stripped);
 		if (match && pat_include != NULL)
 			match = patlist_match(pat_include, p_stripped);
 
 		// print if it matches.
 		if (match && !show_status && mode == mode_list)
-			display_filename (start_linenum, status,
+			display_filename (job, start_linenum, status,
 					  p, patchname);
 
 		if (is_context)
@@ -1153,12 +1490,18 @@ static int filterdiff (FILE *f, const char *patchname)
 		else
 			do_diff = do_unified;
 
-		result = do_diff (f, header, num_headers,
+		result = do_diff (job, f, header, num_headers,
                                   match, &line,
 				  &linelen, &linenum,
 				  start_linenum, status, p, patchname,
 				  &orig_file_exists, &new_file_exists);
 
+		if (job->index)
+			pidx_end_file (job->index, result == EOF ? f->size :
+				       (size_t) (line - f->data));
+		if (!job->counting)
+			PROBE3 (file__end, job->filecount, p, match);
+
 		// print if it matches.
 		if (match && show_status && mode == mode_list) {
 			if (!orig_file_exists)
@@ -1166,38 +1509,319 @@ static int filterdiff (FILE *f, const char *patchname)
 			else if (!new_file_exists)
 				status = '-';
 
-			display_filename (start_linenum, status,
+			display_filename (job, start_linenum, status,
 					  p, patchname);
 		}
 
 		switch (result) {
 		case EOF:
-			free (names[0]);
-			free (names[1]);
 			goto eof;
 		case 1:
 			goto next_diff;
 		}
 
 	next_diff:
-		for (i = 0; i < 2; i++)
-			free (names[i]);
-                for (i = 0; i < num_headers; i++) {
-			free (header[i]);
-			header[i] = NULL;
-		}
                 num_headers = 0;
 	}
 
  eof:
-	for (i = 0; i < num_headers; i++)
-		if (header[i])
-			free (header[i]);
+	job->linenum = linenum;
+	arena_free (&pool);
+	STATS_STOP (&timer, STATS_PARSE);
+	return 0;
+}
 
-	if (line)
-		free (line);
+/* Filter a patch held in memory, then release it. */
+static int filterdiff_buf (struct job *job, struct filebuf *buf)
+{
+	struct patch_reader reader;
+	int ret;
 
-	return 0;
+	patch_reader_init (&reader, buf->data, buf->size);
+	ret = filterdiff (job, &reader);
+	filebuf_free (buf);
+	return ret;
+}
+
+/* Spans shorter than this are cheaper to print from memory than to
+ * have the kernel copy. */
+#define MIN_COPY_SIZE (64 * 1024)
+
+/* Print len bytes of the patch, starting at offset.  When they are
+ * going straight to standard output, and fd is the patch file, the
+ * kernel is asked to copy them across without them passing through
+ * here. */
+static void write_span (struct job *job, const struct filebuf *buf, int fd,
+			size_t offset, size_t len)
+{
+	struct stats_timer timer;
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+	static int cannot_copy = 0;
+#endif /* HAVE_COPY_FILE_RANGE || HAVE_SENDFILE */
+
+	STATS_START (&timer);
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+	if (fd != -1 && job->out == stdout && !cannot_copy &&
+	    len >= MIN_COPY_SIZE) {
+		off_t pos = offset;
+
+		fflush (stdout);
+		while (len) {
+			ssize_t n = -1;
+
+#ifdef HAVE_COPY_FILE_RANGE
+			n = copy_file_range (fd, &pos, STDOUT_FILENO, NULL,
+					     len, 0);
+#endif /* HAVE_COPY_FILE_RANGE */
+#ifdef HAVE_SENDFILE
+			if (n == -1)
+				n = sendfile (STDOUT_FILENO, fd, &pos, len);
+#endif /* HAVE_SENDFILE */
+			if (n <= 0) {
+				/* Not between these two, so don't try
+				 * again. */
+				cannot_copy = 1;
+				break;
+			}
+			len -= n;
+		}
+		offset = pos;
+	}
+#endif /* HAVE_COPY_FILE_RANGE || HAVE_SENDFILE */
+
+	fwrite (buf->data + offset, len, 1, job->out);
+	STATS_STOP (&timer, STATS_OUTPUT);
+}
+
+/* The part of the patch waiting to be printed.  Pieces printed as
+ * they are, one straight after the other, go out together. */
+struct span {
+	size_t start, end;
+};
+
+static void flush_span (struct job *job, const struct filebuf *buf, int fd,
+			struct span *span)
+{
+	write_span (job, buf, fd, span->start, span->end - span->start);
+	span->start = span->end;
+}
+
+static void add_span (struct job *job, const struct filebuf *buf, int fd,
+		      struct span *span, size_t start, size_t end)
+{
+	if (span->end != start) {
+		flush_span (job, buf, fd, span);
+		span->start = start;
+	}
+	span->end = end;
+}
+
+/* How many hunks a file has, for --stats.  The index only has the
+ * hunks of unified diffs, so those of a context diff are counted from
+ * their "*** " lines, which cannot be mistaken for the lines in them. */
+static unsigned long count_hunks (const char *data,
+				  const struct pidx_file *file)
+{
+	unsigned long hunks = 0;
+	const char *p;
+
+	if (!file->context)
+		return file->num_hunks;
+
+	/* Start after the "*** " line that names the file. */
+	for (p = data + file->names + line_length (data + file->names);
+	     p < data + file->end; p += line_length (p))
+		if (!strncmp (p, "*** ", 4))
+			hunks++;
+
+	return hunks;
+}
+
+/* Can extract_file() do this file? */
+static int can_extract (const char *data, const struct pidx_file *file)
+{
+	unsigned long headers = 1;
+	const char *p;
+
+	if (file->context)
+		return 0;
+
+	/* filterdiff() only keeps so many header lines. */
+	for (p = data + file->offset; p < data + file->names;
+	     p += line_length (p))
+		if (++headers > MAX_HEADERS + 1)
+			return 0;
+
+	return 1;
+}
+
+/* Print the hunks of a file's unified diff that -# and --lines pick
+ * out, without looking at every line: the index says where each hunk
+ * is, and the lines are printed as they are.  Only an "@@" line whose
+ * new-file offset has moved, because of hunks left out before it,
+ * needs to be written afresh. */
+static void extract_file (struct job *job, const struct filebuf *buf,
+			  const struct pidx *idx,
+			  const struct pidx_file *file, int fd,
+			  struct span *span)
+{
+	const char *data = buf->data;
+	struct pidx_hunk hunk;
+	size_t header_end;
+	unsigned long n;
+	long munge_offset = 0;
+	int header_displayed = 0;
+
+	if (!file->num_hunks)
+		return;
+
+	/* The header runs up to the first hunk. */
+	pidx_get_hunk (idx, file->first_hunk, &hunk);
+	header_end = hunk.offset;
+
+	for (n = 0; n < file->num_hunks; n++) {
+		const char *line, *trailing;
+		char atat[ATAT_SIZE];
+		size_t hunk_end, len;
+		int atat_len;
+
+		pidx_get_hunk (idx, file->first_hunk + n, &hunk);
+		PROBE3 (hunk__start, job->filecount, n + 1, hunk.linenum);
+		if (!hunk_matches (job, hunk.orig_offset, hunk.orig_count,
+				   n + 1)) {
+			munge_offset += hunk.orig_count - hunk.new_count;
+			continue;
+		}
+
+		if (!header_displayed) {
+			add_span (job, buf, fd, span, file->offset,
+				  header_end);
+			header_displayed = 1;
+		}
+
+		if (n + 1 < file->num_hunks) {
+			struct pidx_hunk next;
+
+			pidx_get_hunk (idx, file->first_hunk + n + 1, &next);
+			hunk_end = next.offset;
+		} else
+			hunk_end = file->end;
+
+		line = data + hunk.offset;
+		len = line_length (line);
+		trailing = atat_trailing (line);
+		atat_len = format_atat (atat, hunk.orig_offset,
+					hunk.orig_count,
+					hunk.new_offset + munge_offset,
+					hunk.new_count);
+		if (atat_len == trailing - line &&
+		    !memcmp (atat, line, atat_len)) {
+			add_span (job, buf, fd, span, hunk.offset, hunk_end);
+			continue;
+		}
+
+		flush_span (job, buf, fd, span);
+		fwrite (atat, atat_len, 1, job->out);
+		fwrite (trailing, len - (trailing - line), 1, job->out);
+		span->start = hunk.offset + len;
+		span->end = hunk_end;
+	}
+}
+
+/* Return the patch's index, if it has an up-to-date one and an index
+ * can stand in for reading it, or NULL. */
+static struct pidx *open_index (const struct job *job,
+				const struct filebuf *buf)
+{
+	if (!use_index)
+		return NULL;
+
+	return pidx_open (job->patchname, buf->data, buf->size);
+}
+
+/* Use the patch's index to list the files without reading the patch,
+ * or to filter only the files picked out by --files, then release the
+ * patch and the index. */
+static void filterdiff_indexed (struct job *job, struct filebuf *buf,
+				struct pidx *idx)
+{
+	unsigned long linenum = job->linenum, filecount = job->filecount;
+	struct span span = { 0, 0 };
+	unsigned long i;
+	int fd = -1;
+
+	/* To have the kernel copy from the patch file, it must be the
+	 * same file the index was checked against. */
+	if (copy_hunks && job->out == stdout) {
+		struct stat st;
+
+		fd = open (job->patchname, O_RDONLY);
+		if (fd != -1 && (fstat (fd, &st) || !pidx_matches (idx, &st))) {
+			close (fd);
+			fd = -1;
+		}
+	}
+
+	for (i = 0; i < idx->num_files; i++) {
+		struct pidx_file file;
+		struct patch_reader reader;
+		const char *p;
+		int wanted, match;
+
+		pidx_get_file (idx, i, &file);
+		job->linenum = linenum + file.linenum - 1;
+		job->filecount = filecount + i + 1;
+		wanted = file_matches (job);
+		p = stripped (file.name, ignore_components);
+		match = !patlist_match (pat_exclude, p) &&
+			(!pat_include || patlist_match (pat_include, p));
+
+		/* Files that are skipped, listed or copied straight from
+		 * the patch. */
+		if (!wanted || (mode == mode_list && !show_status && !verbose) ||
+		    (copy_hunks && (!match || can_extract (buf->data, &file)))) {
+			STATS_ADD (STATS_FILES, 1);
+			STATS_ADD (STATS_HUNKS, count_hunks (buf->data,
+							     &file));
+			PROBE3 (file__start, job->filecount, file.name,
+				job->linenum);
+			if (wanted && match) {
+				if (mode == mode_list)
+					display_filename (job, job->linenum,
+							  '!', file.name,
+							  job->patchname);
+				else
+					extract_file (job, buf, idx, &file,
+						      fd, &span);
+			}
+			PROBE3 (file__end, job->filecount, file.name, match);
+			continue;
+		}
+
+		/* Filter just this file, stopping where the next one
+		 * starts.  filterdiff() fires the probes for it. */
+		if (copy_hunks)
+			flush_span (job, buf, fd, &span);
+		if (i + 1 < idx->num_files) {
+			struct pidx_file next;
+
+			pidx_get_file (idx, i + 1, &next);
+			job->stop = buf->data + next.offset;
+		}
+		job->filecount--;
+		patch_reader_init (&reader, buf->data + file.offset,
+				   buf->size - file.offset);
+		filterdiff (job, &reader);
+		job->stop = NULL;
+	}
+
+	flush_span (job, buf, fd, &span);
+	if (fd != -1)
+		close (fd);
+	job->linenum = linenum + idx->lines;
+	job->filecount = filecount + idx->num_files;
+	pidx_close (idx);
+	filebuf_free (buf);
 }
 
 const char * syntax_str =
@@ -1232,7 +1856,9 @@ const char * syntax_str =
 "  --clean (filterdiff)\n"
 "            remove all comments (non-diff lines) from output (filterdiff)\n"
 "  -z, --decompress\n"
-"            decompress .gz and .bz2 files\n"
+"            decompress gzip, bzip2, xz and zstd files\n"
+"  -j N, --jobs=N\n"
+"            process up to N input files, or pieces of one, at once\n"
 "  -n, --line-number (lsdiff, grepdiff)\n"
 "            show line numbers (lsdiff, grepdiff)\n"
 "  -N, --number-files (lsdiff, grepdiff)\n"
@@ -1256,10 +1882,17 @@ const char * syntax_str =
 "            verbose output -- use more than once for extra verbosity\n"
 "  -E, --extended-regexp (grepdiff)\n"
 "            use extended regexps, like egrep (grepdiff)\n"
+"  -P, --perl-regexp (grepdiff)\n"
+"            use Perl-compatible regexps (grepdiff)\n"
 "  -E, --empty-files-as-absent (lsdiff)\n"
 "            treat empty files as absent (lsdiff)\n"
 "  -f FILE, --file=FILE (grepdiff)\n"
 "            read regular expressions from FILE (grepdiff)\n"
+"  --fixed-strings (grepdiff)\n"
+"            treat the patterns as plain strings, not regular expressions (grepdiff)\n"
+"  --build-index (lsdiff)\n"
+"            write an index beside each patch for later runs to use (lsdiff)\n"
+"  --stats   report what was read and where the time went on standard error\n"
 "  --filter  run as 'filterdiff' (grepdiff, patchview, lsdiff)\n"
 "  --list    run as 'lsdiff' (filterdiff, patchview, grepdiff)\n"
 "  --grep    run as 'grepdiff' (filterdiff, patchview, lsdiff)\n"
@@ -1399,20 +2032,816 @@ static void determine_mode_from_name (const char *argv0)
 		set_filter ();
 }
 
-static FILE *convert_format (FILE *f, char format)
+static void convert_format (struct filebuf *buf, char format)
 {
+	struct stats_timer timer;
+
+	STATS_START (&timer);
 	switch (format) {
 	default:
-		break;
+		return;
 	case 'c':
-		f = convert_to_context (f, "rb", 0);
+		convert_to_context (buf);
 		break;
 	case 'u':
-		f = convert_to_unified (f, "rb", 0);
+		convert_to_unified (buf);
 		break;
 	}
+	STATS_STOP (&timer, STATS_CONVERT);
+}
+
+/* Read the named patch (standard input if name is NULL), decompressing
+ * and converting it as needed. */
+static void read_patch (struct filebuf *buf, const char *name, char format)
+{
+	struct stats_timer timer;
+	FILE *f;
+
+	STATS_START (&timer);
+	if (!name) {
+		filebuf_read (buf, stdin);
+	} else if (unzip) {
+		filebuf_read_unzip (buf, name);
+	} else {
+		f = xopen (name, "rbm");
+		filebuf_read (buf, f);
+		fclose (f);
+	}
+	STATS_STOP (&timer, STATS_READ);
+	if (stats_enabled)
+		stats_input (buf->data, buf->size);
+
+	convert_format (buf, format);
+}
+
+/* With -j, the input files are shared out among a pool of threads,
+ * and the output for each is printed in the order they were given.
+ * A single input is instead cut into pieces, which are shared out in
+ * the same way. */
+static struct {
+	struct job *jobs;
+	unsigned long count;
+	unsigned long next;	/* the next one to hand out */
+	char format;
+	int count_first;	/* do line and file numbers matter? */
+	unsigned long linenum;	/* where the first job starts */
+	unsigned long filecount;
+	struct filebuf *split;	/* the patch being cut into pieces */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+#endif /* HAVE_PTHREAD_H */
+} job_list;
+
+/* Pieces of a patch are at least this big, apart from the last. */
+#define MIN_PIECE_SIZE (64 * 1024)
+
+static void init_job (struct job *job, const char *patchname)
+{
+	job->patchname = patchname;
+	job->out = NULL;
+	job->linenum = 1;
+	job->filecount = 0;
+	job->output = NULL;
+	job->output_size = 0;
+	job->done = 0;
+	job->text = NULL;
+	job->stop = NULL;
+	job->stopped = NULL;
+	job->counting = 0;
+	job->numbered = 0;
+	job->next_linenum = 0;
+	job->next_filecount = 0;
+	job->next_text = NULL;
+	job->index = NULL;
+#ifdef HAVE_PCRE2_H
+	job->match_data = NULL;
+#endif /* HAVE_PCRE2_H */
+}
+
+/* Find out where the job after this one will start, supposing this
+ * one starts at the first line and file.  The index says, if there is
+ * one, or else the patch (or this piece of it) is read through without
+ * matching or printing anything. */
+static void count_job (struct job *job, const struct filebuf *buf,
+		       const struct pidx *idx)
+{
+	struct patch_reader reader;
+
+	job->next_linenum = 1;
+	job->next_filecount = 0;
+	job->next_text = NULL;
+	if (idx) {
+		job->next_linenum += idx->lines;
+		job->next_filecount += idx->num_files;
+		return;
+	}
+
+	if (job_list.split) {
+		buf = job_list.split;
+		if (!job->text)
+			return;
+		patch_reader_init (&reader, job->text,
+				   buf->data + buf->size - job->text);
+	} else
+		patch_reader_init (&reader, buf->data, buf->size);
+
+	job->linenum = 1;
+	job->filecount = 0;
+	job->stopped = NULL;
+	job->counting = 1;
+	filterdiff (job, &reader);
+	job->counting = 0;
+	job->next_linenum = job->linenum;
+	job->next_filecount = job->filecount;
+	job->next_text = job->stopped;
+}
+
+/* Count the job, then wait for the one before it to be numbered, and
+ * carry on the numbers from there.  Jobs are handed out in order, so
+ * the one before is already under way, and numbering it only needs
+ * the counting done, not the filtering. */
+static void number_job (struct job *job, const struct filebuf *buf,
+			const struct pidx *idx)
+{
+	const struct job *prev = job == job_list.jobs ? NULL : job - 1;
+
+	count_job (job, buf, idx);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&job_list.lock);
+	while (prev && !prev->numbered)
+		pthread_cond_wait (&job_list.done, &job_list.lock);
+	pthread_mutex_unlock (&job_list.lock);
+#endif /* HAVE_PTHREAD_H */
+
+	/* As in run_jobs(), a piece that does not begin where the one
+	 * before it stopped begins there instead. */
+	if (prev && job_list.split && job->text != prev->next_text) {
+		job->text = prev->next_text;
+		count_job (job, buf, idx);
+	}
+
+	job->linenum = prev ? prev->next_linenum : job_list.linenum;
+	job->filecount = prev ? prev->next_filecount : job_list.filecount;
+	job->next_linenum += job->linenum - 1;
+	job->next_filecount += job->filecount;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&job_list.lock);
+	job->numbered = 1;
+	pthread_cond_broadcast (&job_list.done);
+	pthread_mutex_unlock (&job_list.lock);
+#else
+	job->numbered = 1;
+#endif /* HAVE_PTHREAD_H */
+}
+
+static void run_job (struct job *job)
+{
+	struct filebuf buf;
+	struct pidx *idx = NULL;
+
+	if (!job_list.split) {
+		read_patch (&buf, job->patchname, job_list.format);
+		idx = open_index (job, &buf);
+	}
+
+	if (job_list.count_first && !job->numbered)
+		number_job (job, &buf, idx);
+
+#ifdef HAVE_OPEN_MEMSTREAM
+	job->out = open_memstream (&job->output, &job->output_size);
+	if (!job->out)
+		error (EXIT_FAILURE, errno, "open_memstream");
+#else
+	job->out = xtmpfile ();
+#endif /* HAVE_OPEN_MEMSTREAM */
+
+	if (job_list.split) {
+		/* Carry on past the end of the piece to finish off the
+		 * file that is in progress there. */
+		const char *end = job_list.split->data + job_list.split->size;
+		struct patch_reader reader;
+
+		job->stopped = NULL;
+		if (job->text) {
+			patch_reader_init (&reader, job->text,
+					   end - job->text);
+			filterdiff (job, &reader);
+		}
+	} else if (idx)
+		filterdiff_indexed (job, &buf, idx);
+	else
+		filterdiff_buf (job, &buf);
+
+#ifndef HAVE_OPEN_MEMSTREAM
+	job->output_size = ftell (job->out);
+	job->output = xmalloc_as (ALLOC_IO, job->output_size + 1);
+	rewind (job->out);
+	if (fread (job->output, 1, job->output_size, job->out) !=
+	    job->output_size)
+		error (EXIT_FAILURE, errno, "error reading temporary file");
+	STATS_ADD (STATS_TMPFILE_BYTES, job->output_size);
+#endif /* HAVE_OPEN_MEMSTREAM */
+	fclose (job->out);
+	job->out = NULL;
+#ifdef HAVE_PCRE2_H
+	pcre2_match_data_free (job->match_data);
+	job->match_data = NULL;
+#endif /* HAVE_PCRE2_H */
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *job_worker (void *unused)
+{
+	for (;;) {
+		struct job *job;
+
+		pthread_mutex_lock (&job_list.lock);
+		if (job_list.next == job_list.count) {
+			pthread_mutex_unlock (&job_list.lock);
+			break;
+		}
+		job = &job_list.jobs[job_list.next++];
+		pthread_mutex_unlock (&job_list.lock);
+
+		run_job (job);
+
+		pthread_mutex_lock (&job_list.lock);
+		job->done = 1;
+		pthread_cond_broadcast (&job_list.done);
+		pthread_mutex_unlock (&job_list.lock);
+	}
+
+	return NULL;
+}
+#endif /* HAVE_PTHREAD_H */
+
+static void free_output (struct job *job)
+{
+#ifdef HAVE_OPEN_MEMSTREAM
+	free (job->output);	/* from open_memstream() */
+#else
+	xfree_as (ALLOC_IO, job->output);
+#endif /* HAVE_OPEN_MEMSTREAM */
+	job->output = NULL;
+}
+
+/* Run every job once, printing the output in order. */
+static void run_jobs (void)
+{
+	unsigned long i;
+#ifdef HAVE_PTHREAD_H
+	unsigned long nthreads = jobs < job_list.count ? jobs : job_list.count;
+	pthread_t *threads = xmalloc ((nthreads + 1) * sizeof (pthread_t));
+	unsigned long n;
+
+	job_list.next = 0;
+	pthread_mutex_init (&job_list.lock, NULL);
+	pthread_cond_init (&job_list.done, NULL);
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create (&threads[n], NULL, job_worker, NULL))
+			error (EXIT_FAILURE, 0, "cannot create thread");
+#endif /* HAVE_PTHREAD_H */
+
+	for (i = 0; i < job_list.count; i++) {
+		struct job *job = &job_list.jobs[i];
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock (&job_list.lock);
+		while (!job->done)
+			pthread_cond_wait (&job_list.done, &job_list.lock);
+		pthread_mutex_unlock (&job_list.lock);
+#else
+		run_job (job);
+#endif /* HAVE_PTHREAD_H */
+
+		/* A piece that turns out not to begin at a file
+		 * boundary after all (because the line it starts with
+		 * belongs to a hunk, say) is done again, from where
+		 * the piece before it stopped. */
+		if (i && job->text != job[-1].stopped) {
+			free_output (job);
+			job->text = job[-1].stopped;
+			job->linenum = job[-1].linenum;
+			job->filecount = job[-1].filecount;
+			run_job (job);
+		}
+
+		if (job->output) {
+			struct stats_timer timer;
+
+			STATS_START (&timer);
+			fwrite (job->output, job->output_size, 1, stdout);
+			STATS_STOP (&timer, STATS_OUTPUT);
+			free_output (job);
+		}
+		job->done = 0;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	for (n = 0; n < nthreads; n++)
+		pthread_join (threads[n], NULL);
+	xfree (threads);
+	pthread_cond_destroy (&job_list.done);
+	pthread_mutex_destroy (&job_list.lock);
+#endif /* HAVE_PTHREAD_H */
+}
+
+/* Run the jobs in job_list, starting the line and file numbers where
+ * the given job has got to. */
+static void run_all_jobs (struct job *first)
+{
+	/* Line and file numbers carry on from one input to the next.
+	 * If they make a difference to the output, each job counts its
+	 * own before it is filtered (see number_job()). */
+	job_list.count_first = numbering || number_files || files;
+	job_list.linenum = first->linenum;
+	job_list.filecount = first->filecount;
+	run_jobs ();
+	xfree (job_list.jobs);
+}
+
+static void filterdiff_files (char **names, unsigned long count, char format)
+{
+	struct job first;
+	unsigned long i;
+
+	init_job (&first, NULL);
+	job_list.jobs = xmalloc (count * sizeof (struct job));
+	job_list.count = count;
+	job_list.format = format;
+	for (i = 0; i < count; i++)
+		init_job (&job_list.jobs[i], names[i]);
+
+	run_all_jobs (&first);
+}
+
+/* Return the start of the first line after p that looks like the
+ * beginning of a file's diff, or NULL if there isn't one.  This is
+ * only a guess, which run_jobs() checks. */
+static const char *find_file_start (const char *p, const char *end)
+{
+	const char *prev = NULL;
+
+	p = memchr (p, '\n', end - p);
+	while (p && ++p < end) {
+		const char *next = memchr (p, '\n', end - p);
+		const char *after = next ? memchr (next + 1, '\n',
+						   end - next - 1) : NULL;
+
+		if (!strncmp (p, "diff ", 5))
+			return p;
+
+		/* A unified or context diff without a "diff" line, but
+		 * not one belonging to the extended header just before
+		 * it, nor lines that are plainly part of a hunk. */
+		if (after && prev && strncmp (prev, "diff ", 5) &&
+		    strncmp (prev, "index ", 6) && strncmp (prev, "@@ ", 3) &&
+		    ((!strncmp (p, "--- ", 4) &&
+		      !strncmp (next + 1, "+++ ", 4) &&
+		      !strncmp (after + 1, "@@ ", 3)) ||
+		     (!strncmp (p, "*** ", 4) &&
+		      !strncmp (next + 1, "--- ", 4) &&
+		      !strncmp (after + 1, "***************", 15))))
+			return p;
+
+		prev = p;
+		p = next;
+	}
+
+	return NULL;
+}
+
+/* Filter a patch held in memory, then release it.  With -j, a large
+ * patch is cut up at file boundaries so that the pieces can be
+ * filtered at the same time. */
+static int filterdiff_split (struct job *job, struct filebuf *buf)
+{
+	const char *p = buf->data, *end = buf->data + buf->size;
+	size_t size = buf->size / (jobs * 4);
+
+	if (jobs < 2 || buf->size < 2 * MIN_PIECE_SIZE)
+		return filterdiff_buf (job, buf);
+
+	if (size < MIN_PIECE_SIZE)
+		size = MIN_PIECE_SIZE;
+
+	job_list.jobs = xmalloc ((buf->size / size + 1) *
+				 sizeof (struct job));
+	job_list.count = 0;
+	job_list.split = buf;
+	while (p) {
+		struct job *piece = &job_list.jobs[job_list.count++];
+
+		init_job (piece, job->patchname);
+		piece->text = p;
+		if ((size_t) (end - p) > size)
+			p = piece->stop = find_file_start (p + size, end);
+		else
+			p = NULL;
+	}
+
+	run_all_jobs (job);
+	job_list.split = NULL;
+	filebuf_free (buf);
+	return 0;
+}
+
+/* Write an index for the named patch, recording where filterdiff()
+ * finds each file and hunk in it. */
+static void write_index (const char *name)
+{
+	struct job job;
+	struct filebuf buf;
+	struct patch_reader reader;
+	struct stat st;
+	FILE *f = xopen (name, "rbm");
+
+	if (fstat (fileno (f), &st))
+		error (EXIT_FAILURE, errno, "%s", name);
+	if (!S_ISREG (st.st_mode))
+		error (EXIT_FAILURE, 0, "%s: can only index regular files",
+		       name);
+
+	filebuf_read (&buf, f);
+	fclose (f);
+
+	init_job (&job, name);
+	job.out = fopen ("/dev/null", "w");
+	if (!job.out)
+		error (EXIT_FAILURE, errno, "/dev/null");
+	job.index = pidx_new ();
+
+	patch_reader_init (&reader, buf.data, buf.size);
+	filterdiff (&job, &reader);
+	pidx_write (job.index, name, &st, buf.data, buf.size,
+		    job.linenum - 1);
+
+	pidx_free (job.index);
+	fclose (job.out);
+	filebuf_free (&buf);
+}
+
+/* Does the pattern mean the same as a plain string? */
+static int
+is_literal (const char *pattern)
+{
+	int extended = egrepping || perl_regexp;
+	const char *special;
+
+#ifdef HAVE_PCRE2POSIX_H
+	/* Basic regexes have PCRE syntax too. */
+	extended = 1;
+#endif /* HAVE_PCRE2POSIX_H */
+	special = extended ? "\\^$.[]|()?*+{}" : "\\^$.[]*";
+
+	return !pattern[strcspn (pattern, special)];
+}
+
+/* Return the end of the bracket expression that p is just inside, or
+ * NULL if it doesn't end.  "]" first is literal, and so is anything in
+ * "[:...:]", "[=...=]" or "[. ... .]". */
+static const char *
+skip_bracket (const char *p)
+{
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	while (*p != ']') {
+		if (!*p)
+			return NULL;
+		if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+			char end = p[1];
+			p += 2;
+			while (*p && (*p != end || p[1] != ']'))
+				p++;
+			if (!*p)
+				return NULL;
+			p++;
+		}
+		p++;
+	}
+
+	return p + 1;
+}
+
+/* Can the regex be put in a group and joined up with others without
+ * changing what it matches?  Not if it refers back to a group by
+ * number, or its parentheses don't balance.  Basic regexes can only
+ * be joined with the GNU "\|" extension. */
+static int
+can_join (const char *pattern)
+{
+	const char *p = pattern;
+	int depth = 0;
+
+#ifdef HAVE_PCRE2POSIX_H
+	return 0;
+#endif /* HAVE_PCRE2POSIX_H */
+#ifndef __GLIBC__
+	if (!egrepping)
+		return 0;
+#endif /* __GLIBC__ */
+
+	while (*p) {
+		switch (*p++) {
+		case '\\':
+			if (!*p || isdigit ((unsigned char) *p))
+				return 0;
+			if (!egrepping && *p == '(')
+				depth++;
+			else if (!egrepping && *p == ')' && !depth--)
+				return 0;
+			p++;
+			break;
+		case '(':
+			if (egrepping)
+				depth++;
+			break;
+		case ')':
+			if (egrepping && !depth--)
+				return 0;
+			break;
+		case '[':
+			p = skip_bracket (p);
+			if (!p)
+				return 0;
+			break;
+		}
+	}
+
+	return !depth;
+}
+
+/* Work out a string that is part of any text the regex matches, so
+ * that text without it need not be given to regexec(): the longest run
+ * of ordinary characters outside any group or bracket expression,
+ * leaving out any that are repeated.  If the regex has alternatives at
+ * the top level there may be no such string.  Store it in best, which
+ * has room for the pattern, and return its length (0 for none). */
+static size_t
+required_string (const char *pattern, int extended, char *best)
+{
+	const char *quoted = extended ? ".*[]^$\\(){}|+?" : ".*[]^$\\";
+	const char *p = pattern;
+	char *run;
+	size_t len = 0, best_len = 0;
+	int depth = 0;
+
+#ifdef HAVE_PCRE2POSIX_H
+	/* The patterns have PCRE syntax, which isn't worked out here. */
+	return 0;
+#endif /* HAVE_PCRE2POSIX_H */
+	run = xmalloc_as (ALLOC_REGEX, strlen (pattern) + 1);
+
+	for (;;) {
+		char c = *p++;
+		int literal = 0, open = 0, close = 0, alternative = 0;
+		int interval = 0, repeat = 0;
+
+		if (c == '\\') {
+			c = *p++;
+			if (!c)
+				goto none;
+			if (strchr (quoted, c))
+				literal = 1;
+			else if (!extended && c == '(')
+				open = 1;
+			else if (!extended && c == ')')
+				close = 1;
+			else if (!extended && c == '|')
+				alternative = 1;
+			else if (!extended && c == '{')
+				interval = 1;
+			else
+				/* "\+", "\?", back-references, "\<" and
+				 * so on. */
+				repeat = 1;
+		} else if (c == '[') {
+			p = skip_bracket (p);
+			if (!p)
+				goto none;
+		} else if (extended && c == '(')
+			open = 1;
+		else if (extended && c == ')')
+			close = 1;
+		else if (extended && c == '|')
+			alternative = 1;
+		else if (extended && c == '{')
+			interval = 1;
+		else if (c == '*' || (extended && (c == '+' || c == '?')))
+			repeat = 1;
+		else if (c && c != '.' && c != '^' && c != '$')
+			literal = 1;
+
+		/* Whatever is in a group is left out. */
+		if (depth) {
+			if (!c)
+				goto none;
+			if (open)
+				depth++;
+			else if (close)
+				depth--;
+			continue;
+		}
+
+		if (alternative)
+			goto none;
+
+		if (literal) {
+			run[len++] = c;
+			continue;
+		}
+
+		if (open)
+			depth = 1;
+		else if (interval) {
+			p = strstr (p, extended ? "}" : "\\}");
+			if (!p)
+				goto none;
+			p += extended ? 1 : 2;
+		}
+
+		/* A repeat (or interval) could leave out the character
+		 * just before it. */
+		if ((repeat || interval) && len)
+			len--;
+
+		if (len > best_len) {
+			memcpy (best, run, len);
+			best_len = len;
+		}
+		len = 0;
+
+		if (!c)
+			break;
+	}
+
+	xfree_as (ALLOC_REGEX, run);
+	return best_len;
+
+none:
+	xfree_as (ALLOC_REGEX, run);
+	return 0;
+}
+
+/* Add to set the string that any match of the regex must contain,
+ * and return set; or if there isn't one, free set and return NULL. */
+static struct literals *
+add_required (struct literals *set, const char *pattern, int extended)
+{
+	char *best = xmalloc_as (ALLOC_REGEX, strlen (pattern) + 1);
+	size_t len = required_string (pattern, extended, best);
+
+	if (len)
+		literals_add (set, best, len);
+	else {
+		literals_free (set);
+		set = NULL;
+	}
+
+	xfree_as (ALLOC_REGEX, best);
+	return set;
+}
+
+/* Compile a regex, to be tried only on text that has one of the
+ * strings in required in it (or on any text if that is NULL). */
+static int
+compile_regex (const char *pattern, int cflags, struct literals *required)
+{
+	int err;
+
+	regex = xrealloc_as (ALLOC_REGEX, regex,
+			     (num_regex + 1) * sizeof (regex[0]));
+	prefilter = xrealloc_as (ALLOC_REGEX, prefilter,
+				 (num_regex + 1) * sizeof (prefilter[0]));
+	err = regcomp (&regex[num_regex], pattern, REG_NOSUB | cflags);
+	if (err) {
+		if (required)
+			literals_free (required);
+		return err;
+	}
+
+	if (required)
+		literals_compile (required);
+	prefilter[num_regex++] = required;
+	return 0;
+}
+
+/* Compile the patterns that add_pattern() put aside.  If there are
+ * several, they become a single regex which matches wherever any one
+ * of them would, so that each line is only looked at once. */
+static void
+join_patterns (void)
+{
+	int extended = alternatives_egrepping;
+	struct literals *required;
+	size_t i, len = 0;
+	char *joined, *p;
+	int err = 1;
+
+	if (num_alternatives > 1) {
+		for (i = 0; i < num_alternatives; i++)
+			len += strlen (alternatives[i]) + 6;
+
+		p = joined = xmalloc_as (ALLOC_REGEX, len + 1);
+		for (i = 0; i < num_alternatives; i++)
+			p += sprintf (p, extended ? "%s(%s)" : "%s\\(%s\\)",
+				      i ? (extended ? "|" : "\\|") : "",
+				      alternatives[i]);
+
+		/* Any line it matches has in it the string needed by
+		 * one of the alternatives, if they all need one. */
+		required = literals_new ();
+		for (i = 0; required && i < num_alternatives; i++)
+			required = add_required (required, alternatives[i],
+						 extended);
+
+		err = compile_regex (joined, extended, required);
+		xfree_as (ALLOC_REGEX, joined);
+	}
 
-	return f;
+	/* Fall back to trying them one by one. */
+	for (i = 0; i < num_alternatives; i++) {
+		if (err)
+			compile_regex (alternatives[i], extended,
+				       add_required (literals_new (),
+						     alternatives[i],
+						     extended));
+		xfree_as (ALLOC_REGEX, alternatives[i]);
+	}
+
+	xfree_as (ALLOC_REGEX, alternatives);
+	alternatives = NULL;
+	num_alternatives = 0;
+}
+
+/* Add a pattern to look for.  Patterns with nothing special about
+ * them are searched for directly rather than with regexec(). */
+static void
+add_pattern (const char *pattern)
+{
+	int err, joinable;
+
+	if (fixed_strings || is_literal (pattern)) {
+		if (!fixed)
+			fixed = literals_new ();
+		literals_add (fixed, pattern, strlen (pattern));
+		return;
+	}
+
+#ifdef HAVE_PCRE2_H
+	if (perl_regexp) {
+		pcre2_code *code;
+		PCRE2_SIZE offset;
+
+		code = pcre2_compile ((PCRE2_SPTR) pattern,
+				      PCRE2_ZERO_TERMINATED, 0, &err, &offset,
+				      NULL);
+		if (!code) {
+			PCRE2_UCHAR errstr[300];
+			pcre2_get_error_message (err, errstr, sizeof (errstr));
+			error (EXIT_FAILURE, 0, "%s at offset %lu",
+			       (char *) errstr, (unsigned long) offset);
+		}
+
+		/* Without JIT support, pcre2_match() interprets the
+		 * pattern instead. */
+		pcre2_jit_compile (code, PCRE2_JIT_COMPLETE);
+		pcre = xrealloc_as (ALLOC_REGEX, pcre,
+				    (num_pcre + 1) * sizeof (pcre[0]));
+		pcre[num_pcre++] = code;
+		return;
+	}
+#endif /* HAVE_PCRE2_H */
+
+	joinable = can_join (pattern);
+	err = compile_regex (pattern, egrepping,
+			     joinable ? NULL :
+			     add_required (literals_new (), pattern, egrepping));
+	if (err) {
+		char errstr[300];
+		regerror (err, &regex[num_regex], errstr, sizeof (errstr));
+		error (EXIT_FAILURE, 0, "%s", errstr);
+		exit (1);
+	}
+
+	if (joinable) {
+		regfree (&regex[--num_regex]);
+
+		/* -E may come between one -f and the next. */
+		if (num_alternatives && alternatives_egrepping != egrepping)
+			join_patterns ();
+		alternatives_egrepping = egrepping;
+		alternatives = xrealloc_as (ALLOC_REGEX, alternatives,
+					    (num_alternatives + 1) *
+					    sizeof (alternatives[0]));
+		alternatives[num_alternatives++] =
+			xstrdup_as (ALLOC_REGEX, pattern);
+	}
 }
 
 static int
@@ -1422,7 +2851,6 @@ read_regex_file (const char *file)
 	char *line = NULL;
 	size_t linelen = 0;
 	ssize_t got;
-	int err;
 
 	if (!f)
 		error (EXIT_FAILURE, errno, "cannot open %s", file);
@@ -1431,16 +2859,7 @@ read_regex_file (const char *file)
 		if (line[--got] == '\n')
 			line[got] = '\0';
 
-		regex = xrealloc (regex, ++num_regex * sizeof (regex[0]));
-		err = regcomp (&regex[num_regex - 1], line,
-			       REG_NOSUB | egrepping);
-		if (err) {
-			char errstr[300];
-			regerror (err, &regex[num_regex - 1], errstr,
-				  sizeof (errstr));
-			error (EXIT_FAILURE, 0, "%s", errstr);
-			exit (1);
-		}
+		add_pattern (line);
 	}
 
 	free (line);
@@ -1450,12 +2869,15 @@ read_regex_file (const char *file)
 int main (int argc, char *argv[])
 {
 	int i;
-	FILE *f = stdin;
+	struct job job;
+	struct filebuf buf;
 	char format = '\0';
 	int regex_file_specified = 0;
 	int have_switches = 0;
 
+	init_job (&job, "(standard input)");
 	setlocale (LC_TIME, "C");
+	stats_init (0);
 	determine_mode_from_name (argv[0]);
 	while (1) {
 		static struct option long_options[] = {
@@ -1489,16 +2911,21 @@ int main (int argc, char *argv[])
 			{"include-from-file", 1, 0, 'I'},
 			{"exclude-from-file", 1, 0, 'X'},
 			{"decompress", 0, 0, 'z'},
+			{"jobs", 1, 0, 'j'},
 			{"line-number", 0, 0, 'n'},
 			{"strip-match", 1, 0, 'p'},
 			{"status", 0, 0, 's'},
 			{"extended-regexp", 0, 0, 'E'},
+			{"perl-regexp", 0, 0, 'P'},
 			{"empty-files-as-removed", 0, 0, 'E'},
 			{"file", 1, 0, 'f'},
+			{"fixed-strings", 0, 0, 1000 + 'x'},
+			{"build-index", 0, 0, 1000 + 'b'},
+			{"stats", 0, 0, 1000 + 's'},
 			{0, 0, 0, 0}
 		};
 		char *end;
-		int c = getopt_long (argc, argv, "vp:i:I:x:X:zns#:F:Ef:HhN",
+		int c = getopt_long (argc, argv, "vp:i:I:x:X:zj:ns#:F:EPf:HhN",
 				     long_options, NULL);
 		if (c == -1)
 			break;
@@ -1521,6 +2948,21 @@ int main (int argc, char *argv[])
 				empty_files_as_absent = 1;
 			else syntax (1);
 			break;
+		case 'P':
+			if (mode != mode_grep)
+				syntax (1);
+#ifdef HAVE_PCRE2_H
+			perl_regexp = 1;
+#else
+			error (EXIT_FAILURE, 0,
+			       "-P is not supported: built without PCRE2");
+#endif /* HAVE_PCRE2_H */
+			break;
+		case 1000 + 'x':
+			if (mode == mode_grep)
+				fixed_strings = 1;
+			else syntax (1);
+			break;
 		case 'f':
 			if (mode == mode_grep) {
 				regex_file_specified = 1;
@@ -1568,6 +3010,11 @@ int main (int argc, char *argv[])
 		case 'z':
 			unzip = 1;
 			break;
+		case 'j':
+			jobs = strtoul (optarg, &end, 0);
+			if (optarg == end || !jobs)
+				syntax (1);
+			break;
 		case 'n':
 			numbering = 1;
 			break;
@@ -1665,6 +3112,14 @@ int main (int argc, char *argv[])
 		case 1000 + 'c':
 			clean_comments = 1;
 			break;
+		case 1000 + 'b':
+			if (mode != mode_list)
+				syntax (1);
+			build_index = 1;
+			break;
+		case 1000 + 's':
+			stats_init (1);
+			break;
 		default:
 			syntax(1);
 		}
@@ -1709,23 +3164,16 @@ int main (int argc, char *argv[])
 		       "--clean options simultaneously");
 
 	if (mode == mode_grep && !regex_file_specified) {
-		int err;
-
 		if (optind == argc)
 			syntax (1);
 
-		regex = xrealloc (regex, ++num_regex * sizeof (regex[0]));
-		err = regcomp (&regex[num_regex - 1], argv[optind++],
-			       REG_NOSUB | egrepping);
-		if (err) {
-			char errstr[300];
-			regerror (err, &regex[num_regex - 1], errstr,
-				  sizeof (errstr));
-			error (EXIT_FAILURE, 0, "%s", errstr);
-			exit (1);
-		}
+		add_pattern (argv[optind++]);
 	}
 
+	if (fixed)
+		literals_compile (fixed);
+	join_patterns ();
+
 	if (number_lines != None ||
 	    output_matching != output_none) {
 		if (print_patchnames == 1)
@@ -1739,21 +3187,52 @@ int main (int argc, char *argv[])
 			print_patchnames = 0;
 	}
 
+	if (build_index) {
+		if (optind == argc)
+			error (EXIT_FAILURE, 0,
+			       "--build-index needs patch files to index");
+		if (unzip || format)
+			error (EXIT_FAILURE, 0, "--build-index can't be used "
+			       "with -z or --format");
+		for (i = optind; i < argc; i++)
+			write_index (argv[i]);
+		return 0;
+	}
+
+	/* Hunks that are printed just as they are can be copied straight
+	 * from the patch. */
+	copy_hunks = (mode == mode_filter && number_lines == None &&
+		      !annotating && !clean_comments && !removing_timestamp &&
+		      !prefix_to_add && !old_prefix_to_add &&
+		      !new_prefix_to_add && !strip_components);
+
+	/* An index records where the files and hunks are in the patch as
+	 * it is on disk.  It is good enough for listing, and for going
+	 * straight to the files and hunks that are wanted unless the
+	 * lines between files are wanted too. */
+	use_index = !unzip && !format &&
+		((mode == mode_list && !show_status && !verbose) ||
+		 ((files || copy_hunks) &&
+		  !(mode == mode_filter && (pat_exclude || verbose) &&
+		    !clean_comments)));
+
+	job.out = stdout;
 	if (optind == argc) {
-		f = convert_format (stdin, format);
-		filterdiff (f, "(standard input)");
-		fclose (f);
+		read_patch (&buf, NULL, format);
+		filterdiff_split (&job, &buf);
+	} else if (jobs > 1 && optind + 1 < argc) {
+		filterdiff_files (argv + optind, argc - optind, format);
 	} else {
 		for (i = optind; i < argc; i++) {
-			if (unzip) {
-				f = xopen_unzip (argv[i], "rb");
-			} else {
-				f = xopen(argv[i], "rbm");
-			}
+			struct pidx *idx;
 
-			f = convert_format (f, format);
-			filterdiff (f, argv[i]);
-			fclose (f);
+			job.patchname = argv[i];
+			read_patch (&buf, argv[i], format);
+			idx = open_index (&job, &buf);
+			if (idx)
+				filterdiff_indexed (&job, &buf, idx);
+			else
+				filterdiff_split (&job, &buf);
 		}
 	}
 
@@ -24,9 +24,6 @@
 #include "config.h"
 #endif
 
-#ifdef HAVE_ALLOCA_H
-# include <alloca.h>
-#endif /* HAVE_ALLOCA_H */
 #include <assert.h>
 #ifdef HAVE_ERROR_H
 # include <error.h>
@@ -43,21 +40,21 @@
 #ifdef HAVE_SYS_TYPES_H
 # include <sys/types.h>
 #endif /* HAVE_SYS_TYPES_H */
-#ifdef HAVE_SYS_WAIT_H
-# include <sys/wait.h>
-#endif /* HAVE_SYS_WAIT_H */
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
 
 #include "util.h"
 #include "diff.h"
+#include "textdiff.h"
+#include "pidx.h"
+#include "probes.h"
+#include "stats.h"
 
 #ifndef DIFF
 #define DIFF "diff"
 #endif
 
-#ifndef PATCH
-#define PATCH "patch"
-#endif
-
 /* This can be invoked as interdiff, combinediff, or flipdiff. */
 static enum {
 	mode_inter,
@@ -68,40 +65,66 @@ static int flipdiff_inplace = 0;
 
 struct file_list {
 	char *file;
+	const char *key;		/* file, stripped */
+	unsigned long hash;
 	long pos;
-	struct file_list *next;
+	struct file_list *next;		/* in the order added */
+	struct file_list *chain;	/* in the same hash bucket */
+};
+
+/* The files in a patch, in order, indexed by stripped name. */
+struct file_table {
+	struct file_list *head;
 	struct file_list *tail;
+	struct file_list **buckets;
+	size_t nbuckets;
+	size_t count;
+	struct arena pool;		/* the entries and their names */
 };
 
 struct lines {
 	char *line;
 	size_t length;
 	unsigned long n;
-	struct lines *next;
-	struct lines *prev;
 };
 
+/* The lines we know about in a file, in line number order.  They are
+ * kept in an array with a gap at the last place a line was added or
+ * removed, so that working down the file moves each line only once.
+ * The lines after the gap have shift added to their numbers, which
+ * makes renumbering them cheap. */
 struct lines_info {
 	char *unline;
 	unsigned long first_offset;
 	unsigned long min_context;
-	struct lines *head;
-	struct lines *tail;
+	struct lines *lines;
+	unsigned long count;		/* lines before the gap */
+	unsigned long after;		/* lines after it, at the end */
+	unsigned long allocated;
+	long shift;
+	struct arena text;		/* where the lines are stored */
 };
 
+#define LINES_INFO_INIT \
+	{ NULL, 0, 0, NULL, 0, 0, 0, 0, ARENA_INIT (ALLOC_LINES) }
+
 static int human_readable = 1;
 static char diff_opts[4];
+static int diff_flags;
 static unsigned int max_context_real = 3, max_context = 3;
 static int context_specified = 0;
 static int ignore_components = 0;
 static int unzip = 0;
 static int no_revert_omitted = 0;
 static int debug = 0;
+static unsigned int jobs = 1;
 
 static struct patlist *pat_drop_context = NULL;
 
-static struct file_list *files_done = NULL;
-static struct file_list *files_in_patch2 = NULL;
+#define FILE_TABLE_INIT { NULL, NULL, NULL, 0, 0, ARENA_INIT (ALLOC_HEADER) }
+
+static struct file_table files_done = FILE_TABLE_INIT;
+static struct file_table files_in_patch2 = FILE_TABLE_INIT;
 
 /* checks whether file needs processing and sets context */
 static int
@@ -115,105 +138,210 @@ check_filename (const char *fn)
 	return 1;
 }
 
+static unsigned long
+hash_name (const char *name)
+{
+	/* FNV-1a */
+	unsigned long h = 2166136261UL;
+	while (*name) {
+		h ^= (unsigned char) *name++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static struct file_list *
+find_in_table (const struct file_table *table, const char *key,
+	       unsigned long hash)
+{
+	struct file_list *at;
+
+	if (!table->nbuckets)
+		return NULL;
+
+	for (at = table->buckets[hash % table->nbuckets]; at; at = at->chain)
+		if (at->hash == hash && !strcmp (at->key, key))
+			return at;
+	return NULL;
+}
+
 static void
-add_to_list (struct file_list **list, const char *file, long pos)
+grow_table (struct file_table *table)
+{
+	size_t n = table->nbuckets ? 2 * table->nbuckets : 64;
+	struct file_list **buckets = xmalloc_as (ALLOC_HEADER,
+						 n * sizeof *buckets);
+	struct file_list *at, *next;
+	size_t i;
+
+	memset (buckets, 0, n * sizeof *buckets);
+	for (i = 0; i < table->nbuckets; i++)
+		for (at = table->buckets[i]; at; at = next) {
+			next = at->chain;
+			at->chain = buckets[at->hash % n];
+			buckets[at->hash % n] = at;
+		}
+
+	xfree_as (ALLOC_HEADER, table->buckets);
+	table->buckets = buckets;
+	table->nbuckets = n;
+}
+
+static void
+add_to_list (struct file_table *table, const char *file, long pos)
 {
 	struct file_list *make;
-	make = xmalloc (sizeof *make);
+	make = arena_alloc (&table->pool, sizeof *make);
 	make->next = NULL;
-	make->tail = NULL;
-	make->file = xstrdup (file);
+	make->chain = NULL;
+	make->file = arena_strndup (&table->pool, file, strlen (file));
+	make->key = stripped (make->file, ignore_components);
+	make->hash = hash_name (make->key);
 	make->pos = pos;
 
-	if (*list) {
-		(*list)->tail->next = make;
-		(*list)->tail = make;
-	} else {
-		make->tail = make;
-		*list = make;
-	}
+	if (table->tail)
+		table->tail->next = make;
+	else
+		table->head = make;
+	table->tail = make;
+
+	/* Lookups find the first file added with a given name, so
+	 * later ones are only kept in order. */
+	if (find_in_table (table, make->key, make->hash))
+		return;
+
+	if (table->count >= table->nbuckets)
+		grow_table (table);
+
+	make->chain = table->buckets[make->hash % table->nbuckets];
+	table->buckets[make->hash % table->nbuckets] = make;
+	table->count++;
 }
 
 static long
-file_in_list (struct file_list *list, const char *file)
+file_in_list (const struct file_table *table, const char *file)
 {
+	struct file_list *at;
+
 	file = stripped (file, ignore_components);
-	while (list) {
-		if (!strcmp (stripped (list->file, ignore_components), file))
-			return list->pos;
-		list = list->next;
+	at = find_in_table (table, file, hash_name (file));
+	return at ? at->pos : -1;
+}
+
+static void
+free_list (struct file_table *table)
+{
+	arena_free (&table->pool);
+	xfree_as (ALLOC_HEADER, table->buckets);
+	table->head = table->tail = NULL;
+	table->buckets = NULL;
+	table->nbuckets = table->count = 0;
+}
+
+/* The ith line, counting the ones after the gap as following on. */
+static struct lines *
+line_at (struct lines_info *lines, unsigned long i)
+{
+	if (i < lines->count)
+		return &lines->lines[i];
+	return &lines->lines[lines->allocated - lines->after +
+			     (i - lines->count)];
+}
+
+static unsigned long
+line_number (struct lines_info *lines, unsigned long i)
+{
+	if (i < lines->count)
+		return lines->lines[i].n;
+	return line_at (lines, i)->n + lines->shift;
+}
+
+/* Returns the index of the first line numbered n or more. */
+static unsigned long
+find_line (struct lines_info *lines, unsigned long n)
+{
+	unsigned long lo = 0, hi = lines->count + lines->after;
+
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+		if (line_number (lines, mid) < n)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return -1;
+
+	return lo;
 }
 
+/* Move the gap so that the ith line is the first one after it. */
 static void
-free_list (struct file_list *list)
+move_gap (struct lines_info *lines, unsigned long i)
 {
-	struct file_list *next;
-	for (; list; list = next) {
-		next = list->next;
-		free (list->file);
-		free (list);
+	struct lines *after = lines->lines + lines->allocated - lines->after;
+	unsigned long k, j;
+
+	if (i < lines->count) {
+		k = lines->count - i;
+		after -= k;
+		memmove (after, lines->lines + i, k * sizeof *after);
+		for (j = 0; j < k; j++)
+			after[j].n -= lines->shift;
+		lines->count -= k;
+		lines->after += k;
+	} else if (i > lines->count) {
+		k = i - lines->count;
+		for (j = 0; j < k; j++)
+			after[j].n += lines->shift;
+		memmove (lines->lines + lines->count, after, k * sizeof *after);
+		lines->count += k;
+		lines->after -= k;
 	}
 }
 
+/* Put all the lines before the gap, so that they can be walked
+ * through as lines->lines[0..count). */
 static void
-insert_line_before (struct lines_info *lines,
-		    struct lines *at, struct lines *make)
+close_gap (struct lines_info *lines)
 {
-	make->next = at;
-	make->prev = at->prev;
-	if (at->prev)
-		at->prev->next = make;
-	else
-		lines->head = make;
-	at->prev = make;
+	move_gap (lines, lines->count + lines->after);
 }
 
-/* Returns 1 is there is a conflict. */
-static int
-add_line (struct lines_info *lines, const char *line, size_t length,
-	  unsigned long n)
+static void
+insert_at (struct lines_info *lines, unsigned long i,
+	   const char *line, size_t length, unsigned long n)
 {
 	struct lines *make;
-	struct lines *at;
-	
-	make = xmalloc (sizeof *make);
-	make->n = n;
-	make->line = xmalloc (length + 1);
-	memcpy (make->line, line, length);
-	make->line[length] = '\0';
-	make->length = length;
 
-	if (!lines->tail) {
-		/* New */
-		make->prev = NULL;
-		make->next = NULL;
-		lines->head = make;
-		lines->tail = make;
-		return 0;
-	}
-	if (lines->tail->n < n) {
-		/* End */
-		lines->tail->next = make;
-		make->next = NULL;
-		make->prev = lines->tail;
-		lines->tail = make;
-		return 0;
+	move_gap (lines, i);
+	if (lines->count + lines->after == lines->allocated) {
+		unsigned long old = lines->allocated;
+		lines->allocated = old ? old * 2 : 64;
+		lines->lines = xrealloc_as (ALLOC_LINES, lines->lines,
+					    lines->allocated *
+					    sizeof (struct lines));
+		memmove (lines->lines + lines->allocated - lines->after,
+			 lines->lines + old - lines->after,
+			 lines->after * sizeof (struct lines));
 	}
 
-	if (!lines->head)
-		error (EXIT_FAILURE, 0, "List corrupted: no head");
+	make = &lines->lines[lines->count++];
+	make->n = n;
+	make->line = arena_strndup (&lines->text, line, length);
+	make->length = length;
+}
+
+/* Returns 1 is there is a conflict. */
+static int
+add_line (struct lines_info *lines, const char *line, size_t length,
+	  unsigned long n)
+{
+	unsigned long total = lines->count + lines->after;
+	unsigned long i = total;
 
-	at = lines->head;
-	while (at) {
-		if (n < at->n) {
-			insert_line_before (lines, at, make);
-			return 0;
-		}
-		if (n == at->n) {
-			free (make->line);
-			free (make);
+	if (total && line_number (lines, total - 1) >= n) {
+		i = find_line (lines, n);
+		if (line_number (lines, i) == n) {
+			struct lines *at = line_at (lines, i);
 			if (at->length == length &&
 			    !memcmp (at->line, line, length))
 				/* Already there. */
@@ -226,80 +354,69 @@ add_line (struct lines_info *lines, const char *line, size_t length,
 				return 1;
 			return memcmp (at->line, line, length);
 		}
-		make->prev = at;
-		at = at->next;
 	}
 
-	if (!at)
-		error (EXIT_FAILURE, 0, "List corrupted: ordering");
-
-	return 1;
+	insert_at (lines, i, line, length, n);
+	return 0;
 }
 
 static void
 merge_lines (struct lines_info *lines1, struct lines_info *lines2)
 {
-	struct lines *at, *at_prev, *make;
-
-
-	/* 
-	 * Note: we don't care about the tail member here - not needed
-	 * anymore.
-	 */
+	struct lines *merged;
+	unsigned long size, i = 0, j = 0, k = 0;
 
 	if (lines2->first_offset < lines1->first_offset)
 		lines1->first_offset = lines2->first_offset;
 
-	if (!lines1->head) {
+	close_gap (lines1);
+	close_gap (lines2);
+	arena_adopt (&lines1->text, &lines2->text);
+
+	if (!lines1->count) {
 		/* first list empty - only take second */
-		lines1->head = lines2->head;
+		xfree_as (ALLOC_LINES, lines1->lines);
+		lines1->lines = lines2->lines;
+		lines1->count = lines2->count;
+		lines1->allocated = lines2->allocated;
+		lines2->lines = NULL;
+		lines2->count = lines2->allocated = 0;
 		return;
 	}
 
 	/* merge lines in one pass */
-	at = lines1->head;
-	make = lines2->head;
-	while (at) {
-		while (make) {
-			if (make->n > at->n)
-				break;
-
-			if (make->n < at->n) {
-				struct lines *next = make->next;
-
-				insert_line_before (lines1, at, make);
-				make = next;
-				continue;
-			}
-
-			make = make->next; /* line number equal - first wins */
-		}
-		at_prev = at;
-		at = at->next;
+	size = lines1->count + lines2->count;
+	merged = xmalloc_as (ALLOC_LINES, size * sizeof *merged);
+	while (i < lines1->count || j < lines2->count) {
+		if (j == lines2->count ||
+		    (i < lines1->count &&
+		     lines1->lines[i].n <= lines2->lines[j].n)) {
+			if (j < lines2->count &&
+			    lines1->lines[i].n == lines2->lines[j].n)
+				j++; /* line number equal - first wins */
+			merged[k++] = lines1->lines[i++];
+		} else
+			merged[k++] = lines2->lines[j++];
 	}
 
-	/* append the rest of list 2 to list 1 */
-	if (make)
-		at_prev->next = make;
-}
-
-static void
-free_lines (struct lines *list)
-{
-        struct lines *next;
-	for (; list; list = next) {
-		next = list->next;
-		free (list->line);
-		free (list);
-	}
+	xfree_as (ALLOC_LINES, lines1->lines);
+	lines1->lines = merged;
+	lines1->count = k;
+	lines1->allocated = size;
+	xfree_as (ALLOC_LINES, lines2->lines);
+	lines2->lines = NULL;
+	lines2->count = lines2->allocated = 0;
 }
 
 static void
 clear_lines_info (struct lines_info *info)
 {
-        free_lines (info->head);
-        info->tail = info->head = NULL;
-        free (info->unline);
+	xfree_as (ALLOC_LINES, info->lines);
+	info->lines = NULL;
+	info->count = info->after = info->allocated = 0;
+	info->shift = 0;
+	arena_free (&info->text);
+        xfree_as (ALLOC_LINES, info->unline);
         info->unline = NULL;
 }
 
@@ -310,32 +427,34 @@ whitespace_damage (const char *which)
 }
 
 
-static struct lines *
-create_orig (FILE *f, struct lines_info *file,
+static void
+create_orig (struct patch_reader *f, struct lines_info *file,
 	     int reverted, int *clash)
 {
 	unsigned long linenum;
-	char *line = NULL, first_char;
-	size_t linelen = 0;
+	const char *line = NULL;
+	char first_char;
 	int last_was_add;
-	long pos = ftell (f);
+	size_t pos = patch_tell (f);
 	unsigned long min_context = (unsigned long) -1;
 
+	PROBE1 (create__orig__start, reverted);
 	do {
-		if (getline (&line, &linelen, f) == -1)
+		if (patch_getline (f, &line) == -1)
 			break;
 	} while (strncmp (line, "@@ ", 3));
 
-	while (!feof (f)) {
+	while (!patch_eof (f)) {
 		/* Find next hunk */
 		unsigned long orig_lines, new_lines, newline;
 		int file_is_removed = 0;
 		unsigned long context;
 		int leading_context;
-		char *p, *q;
+		const char *p;
+		char *q;
 
 		if (strncmp (line, "@@", 2)) {
-			fseek (f, pos, SEEK_SET);
+			patch_seek (f, pos);
 			break;
 		}
 
@@ -347,8 +466,8 @@ create_orig (FILE *f, struct lines_info *file,
 			new_lines = new_num_lines (line);
 		}
 
-		p = strchr (line, reverted ? '+' : '-');
-		if (!p)
+		p = line + strcspn (line, reverted ? "+\n" : "-\n");
+		if (*p == '\n' || !*p)
 			break;
 
 		p++;
@@ -375,8 +494,8 @@ create_orig (FILE *f, struct lines_info *file,
 		newline = 1;
 		while (orig_lines || new_lines || newline) {
 			ssize_t got;
-			pos = ftell (f);
-			got = getline (&line, &linelen, f);
+			pos = patch_tell (f);
+			got = patch_getline (f, &line);
 			if (got == -1)
 				break;
 
@@ -422,12 +541,13 @@ create_orig (FILE *f, struct lines_info *file,
 				leading_context = 0;
 				newline = 0;
 				if (!file_is_removed && !last_was_add) {
-					struct lines *at, *prev = NULL;
-					for (at = file->head; at; at = at->next)
-						prev = at;
-					if (!prev)
+					unsigned long total;
+					struct lines *prev;
+					total = file->count + file->after;
+					if (!total)
 						error (EXIT_FAILURE, 0,
 						       "Garbled patch");
+					prev = line_at (file, total - 1);
 					if (prev->length >= 1 &&
 					    prev->line[prev->length-1] == '\n')
 						prev->length--;
@@ -439,8 +559,8 @@ create_orig (FILE *f, struct lines_info *file,
 		}
 
 		if (!newline) {
-			pos = ftell (f);
-			if (getline (&line, &linelen, f) == -1)
+			pos = patch_tell (f);
+			if (patch_getline (f, &line) == -1)
 				break;
 		}
 
@@ -448,11 +568,8 @@ create_orig (FILE *f, struct lines_info *file,
 			min_context = context;
 	}
 
-	if (line)
-		free (line);
-
 	file->min_context = min_context;
-	return file->head;
+	PROBE1 (create__orig__end, file->count + file->after);
 }
 
 static void
@@ -460,17 +577,21 @@ construct_unline (struct lines_info *file_info)
 {
 	char *un;
 	struct lines *at;
+	unsigned long n;
 	size_t i;
 
 	if (file_info->unline)
 		/* Already done. */
 		return;
 
-	un = file_info->unline = xmalloc (7);
+	close_gap (file_info);
+	un = file_info->unline = xmalloc_as (ALLOC_LINES, 7);
 
 	/* First pass: construct a small line not in the file. */
-	for (i = 0, at = file_info->head; at && i < 5; i++, at = at->next) {
-		size_t j = strlen (at->line) - 1;
+	for (i = 0; i < file_info->count && i < 5; i++) {
+		size_t j;
+		at = &file_info->lines[i];
+		j = strlen (at->line) - 1;
 		if (i < j)
 			j = i;
 		un[i] = at->line[j] + 1;
@@ -484,11 +605,11 @@ construct_unline (struct lines_info *file_info)
 
 	for (i = 4; i > 0; i--) {
 		/* Is it unique yet? */
-		for (at = file_info->head; at; at = at->next) {
-			if (!strcmp (at->line, un))
+		for (n = 0; n < file_info->count; n++) {
+			if (!strcmp (file_info->lines[n].line, un))
 				break;
 		}
-		if (!at)
+		if (n == file_info->count)
 			/* Yes! */
 			break;
 
@@ -499,14 +620,15 @@ construct_unline (struct lines_info *file_info)
 	if (i == 0) {
 		/* Okay, we'll do it the hard way, and generate a long line. */
 		size_t maxlength = 0;
-		for (at = file_info->head; at; at = at->next) {
-			size_t len = strlen (at->line);
+		for (n = 0; n < file_info->count; n++) {
+			size_t len = strlen (file_info->lines[n].line);
 			if (len > maxlength)
 				maxlength = len;
 		}
 
-		free (un);
-		un = file_info->unline = xmalloc (maxlength + 3);
+		xfree_as (ALLOC_LINES, un);
+		un = file_info->unline = xmalloc_as (ALLOC_LINES,
+						     maxlength + 3);
 		for (i = 0; i < maxlength; i++)
 			un[i] = '!';
 		un[i++] = '\n';
@@ -514,51 +636,115 @@ construct_unline (struct lines_info *file_info)
 	}
 }
 
-static int
-write_file (struct lines_info *file_info, int fd)
+/* A file as an array of lines.  The lines are not owned: they point
+ * into a lines_info, its unline, or the patch being applied. */
+struct file_image {
+	struct text_line *lines;
+	unsigned long count;
+	unsigned long allocated;
+};
+
+static void
+image_add (struct file_image *image, const char *line, size_t length)
 {
-	unsigned long linenum;
-	struct lines *at;
-	FILE *fout = fdopen (fd, "w");
+	if (image->count == image->allocated) {
+		image->allocated = image->allocated ? image->allocated * 2 : 64;
+		image->lines = xrealloc_as (ALLOC_LINES, image->lines,
+					    image->allocated *
+					    sizeof (struct text_line));
+	}
+
+	image->lines[image->count].line = line;
+	image->lines[image->count].length = length;
+	image->count++;
+}
+
+static void
+free_image (struct file_image *image)
+{
+	xfree_as (ALLOC_LINES, image->lines);
+	image->lines = NULL;
+	image->count = image->allocated = 0;
+}
+
+/* Lay out the reconstructed file, filling the lines we never saw
+ * with the unline. */
+static void
+render_file (struct lines_info *file_info, struct file_image *image)
+{
+	unsigned long linenum, n;
+	size_t unlinelen;
 
 	construct_unline (file_info);
+	close_gap (file_info);
+	unlinelen = strlen (file_info->unline);
 	for (linenum = 1; linenum < file_info->first_offset; linenum++)
-		fputs (file_info->unline, fout);
+		image_add (image, file_info->unline, unlinelen);
 
-	for (at = file_info->head; at; at = at->next) {
+	for (n = 0; n < file_info->count; n++) {
+		struct lines *at = &file_info->lines[n];
 		unsigned long i = at->n - linenum;
 		while (i--) {
-			fprintf (fout, "%s", file_info->unline);
+			image_add (image, file_info->unline, unlinelen);
 			linenum++;
 		}
-		fwrite (at->line, at->length, 1, fout);
+		image_add (image, at->line, at->length);
 		linenum++;
 	}
-	fclose (fout);
-	return 0;
+}
+
+/* Make the image look the way it would to anything reading it back
+ * from a file: a line that has lost its newline (which happens when
+ * the patches disagree about the end of the file) runs on into the
+ * next one, or vanishes if that was all there was to it.  If there is
+ * such a line, the whole file is copied into buf (which is otherwise
+ * left untouched) and the image is made to point there instead. */
+static void
+join_image_lines (struct file_image *image, struct filebuf *buf)
+{
+	unsigned long i;
+	size_t start, end;
+
+	for (i = 0; i < image->count; i++) {
+		const struct text_line *l = &image->lines[i];
+		if (!l->length || (i + 1 < image->count &&
+				   l->line[l->length - 1] != '\n'))
+			break;
+	}
+
+	if (i == image->count)
+		return;
+
+	filebuf_init (buf);
+	for (i = 0; i < image->count; i++)
+		filebuf_append (buf, image->lines[i].line,
+				image->lines[i].length);
+
+	image->count = 0;
+	for (start = 0; start < buf->size; start = end) {
+		const char *nl = memchr (buf->data + start, '\n',
+					 buf->size - start);
+		end = nl ? (size_t) (nl - buf->data) + 1 : buf->size;
+		image_add (image, buf->data + start, end - start);
+	}
 }
 
 static int
-do_output_patch1_only (FILE *p1, FILE *out, int not_reverted)
+do_output_patch1_only (struct patch_reader *p1, FILE *out, int not_reverted)
 {
-	char *line;
-	char *oldname;
+	const char *line;
+	const char *oldname;
 	char first_char;
-	size_t linelen;
-	ssize_t got;
-	long pos;
+	ssize_t got, oldlen;
+	size_t pos;
 
-	oldname = NULL;
-	linelen = 0;
-	if (getline (&oldname, &linelen, p1) < 0)
+	if ((oldlen = patch_getline (p1, &oldname)) < 0)
 		error (EXIT_FAILURE, errno, "Bad patch #1");
 
 	if (strncmp (oldname, "--- ", 4))
 		error (EXIT_FAILURE, 0, "Bad patch #1");
 
-	line = NULL;
-	linelen = 0;
-	if (getline (&line, &linelen, p1) < 0)
+	if ((got = patch_getline (p1, &line)) < 0)
 		error (EXIT_FAILURE, errno, "Bad patch #1");
 
 	if (strncmp (line, "+++ ", 4))
@@ -568,18 +754,19 @@ do_output_patch1_only (FILE *p1, FILE *out, int not_reverted)
 		/* Combinediff: copy patch */
 		if (human_readable && mode != mode_flip)
 			fprintf (out, "unchanged:\n");
-		fputs (oldname, out);
-		fputs (line, out);
+		fwrite (oldname, (size_t) oldlen, 1, out);
+		fwrite (line, (size_t) got, 1, out);
 	} else if (!no_revert_omitted) {
 		if (human_readable)
 			fprintf (out, "reverted:\n");
-		fprintf (out, "--- %s", line + 4);
-		fprintf (out, "+++ %s", oldname + 4);
+		fputs ("--- ", out);
+		fwrite (line + 4, (size_t) got - 4, 1, out);
+		fputs ("+++ ", out);
+		fwrite (oldname + 4, (size_t) oldlen - 4, 1, out);
 	}
-	free (oldname);
 
-	pos = ftell (p1);
-	got = getline (&line, &linelen, p1);
+	pos = patch_tell (p1);
+	got = patch_getline (p1, &line);
 	if (got < 0)
 		error (EXIT_FAILURE, errno, "Bad patch #1");
 
@@ -587,22 +774,21 @@ do_output_patch1_only (FILE *p1, FILE *out, int not_reverted)
 		unsigned long orig_lines;
 		unsigned long new_lines;
 		unsigned long newline;
-		char *d1, *d2, *p;
-		size_t h;
+		const char *d1, *d2, *p;
+		size_t h1, h2;
 
 		if (strncmp (line, "@@ ", 3)) {
-			fseek (p1, pos, SEEK_SET);
+			patch_seek (p1, pos);
 			break;
 		}
 
-		p = line + 3;
-		h = strcspn (p, " \t");
-		d1 = xstrndup (p, h);
-		p += h;
+		p = d1 = line + 3;
+		h1 = strcspn (p, " \t\n");
+		p += h1;
 		p += strspn (p, " \t");
-		h = strcspn (p, " \t");
-		d2 = xstrndup (p, h);
-		if (!*d1 || !*d2)
+		d2 = p;
+		h2 = strcspn (p, " \t\n");
+		if (!h1 || !h2)
 			error (EXIT_FAILURE, 0, "Bad patch #1");
 
 		if (not_reverted) {
@@ -613,20 +799,17 @@ do_output_patch1_only (FILE *p1, FILE *out, int not_reverted)
 		} else {
 			/* Interdiff: revert patch */
 			if (!no_revert_omitted)
-				fprintf (out, "@@ -%s +%s @@\n",
-					 d2 + 1, d1 + 1);
+				fprintf (out, "@@ -%.*s +%.*s @@\n",
+					 (int) h2 - 1, d2 + 1,
+					 (int) h1 - 1, d1 + 1);
 			orig_lines = orig_num_lines (d1);
 			new_lines = new_num_lines (d2);
 		}
-		
-
-		free (d1);
-		free (d2);
 
 		newline = 1;
 		while (orig_lines || new_lines || newline) {
-			pos = ftell (p1);
-			got = getline (&line, &linelen, p1);
+			pos = patch_tell (p1);
+			got = patch_getline (p1, &line);
 			if (got == -1)
 				break;
 
@@ -676,175 +859,365 @@ do_output_patch1_only (FILE *p1, FILE *out, int not_reverted)
 		}
 
 		if (!newline) {
-			pos = ftell (p1);
-			if (getline (&line, &linelen, p1) == -1)
+			pos = patch_tell (p1);
+			if (patch_getline (p1, &line) == -1)
 				break;
 		}
 	}
 
-	if (line)
-		free (line);
-
 	return 0;
 }
 
 static int
-output_patch1_only (FILE *p1, FILE *out, int not_reverted)
+output_patch1_only (struct patch_reader *p1, FILE *out, int not_reverted,
+		    unsigned int context)
 {
-	const char *tmpdir;
-	unsigned int tmplen;
-	const char tail1[] = "/interdiff-1.XXXXXX";
-	const char tail2[] = "/interdiff-2.XXXXXX";
-	char *tmpp1, *tmpp2;
-	char options[100];
-	int tmpp1fd, tmpp2fd;
-	long pos;
-	char *oldname = NULL, *newname = NULL;
-	size_t oldnamelen = 0, newnamelen = 0;
-	struct lines_info file_orig = { NULL, 0, 0, NULL, NULL };
-	struct lines_info file_new = { NULL, 0, 0, NULL, NULL };
-	pid_t child;
-	FILE *in;
-	int diff_is_empty = 1;
-	unsigned int use_context = max_context;
-
-	if (diff_opts[0] == '\0' && !context_specified)
-		return do_output_patch1_only (p1, out, not_reverted);
+	size_t pos;
+	const char *oldname, *newname;
+	ssize_t oldlen, newlen;
+	struct lines_info file_orig = LINES_INFO_INIT;
+	struct lines_info file_new = LINES_INFO_INIT;
+	struct file_image image_orig = { NULL, 0, 0 };
+	struct file_image image_new = { NULL, 0, 0 };
+	struct filebuf joined_orig = { NULL, 0, NULL, 0, 0 };
+	struct filebuf joined_new = { NULL, 0, NULL, 0, 0 };
+	struct filebuf diff;
+	unsigned int use_context = context;
+	struct stats_timer timer;
+	int ret;
+
+	if (diff_opts[0] == '\0' && !context_specified) {
+		STATS_START (&timer);
+		ret = do_output_patch1_only (p1, out, not_reverted);
+		STATS_STOP (&timer, STATS_OUTPUT);
+		return ret;
+	}
 
 	/* We want to redo the diff using the supplied options. */
-	tmpdir = getenv ("TMPDIR");
-	if (!tmpdir)
-		tmpdir = P_tmpdir;
-
-	tmplen = strlen (tmpdir);
-	tmpp1 = alloca (tmplen + sizeof (tail1));
-	memcpy (tmpp1, tmpdir, tmplen);
-	memcpy (tmpp1 + tmplen, tail1, sizeof (tail1));
-	tmpp2 = alloca (tmplen + sizeof (tail2));
-	memcpy (tmpp2, tmpdir, tmplen);
-	memcpy (tmpp2 + tmplen, tail2, sizeof (tail2));
-
-	tmpp1fd = xmkstemp (tmpp1);
-	tmpp2fd = xmkstemp (tmpp2);
-
-	pos = ftell (p1);
+	pos = patch_tell (p1);
 	do {
-		if (oldname) {
-			free (oldname);
-			oldname = NULL;
-			oldnamelen = 0;
-		}
-		if (getline (&oldname, &oldnamelen, p1) < 0)
+		if ((oldlen = patch_getline (p1, &oldname)) < 0)
 			error (EXIT_FAILURE, errno, "Bad patch #1");
 
 	} while (strncmp (oldname, "--- ", 4));
-	oldname[strlen (oldname) - 1] = '\0';
+	oldlen--;
 
-	if (getline (&newname, &newnamelen, p1) < 0)
+	if ((newlen = patch_getline (p1, &newname)) < 0)
 		error (EXIT_FAILURE, errno, "Bad patch #1");
 	if (strncmp (newname, "+++ ", 4))
 		error (EXIT_FAILURE, errno, "Bad patch #1");
-	newname[strlen (newname) - 1] = '\0';
+	newlen--;
 
 	/* Recreate the original and modified state. */
-	fseek (p1, pos, SEEK_SET);
+	STATS_START (&timer);
+	patch_seek (p1, pos);
 	create_orig (p1, &file_orig, !not_reverted, NULL);
-	fseek (p1, pos, SEEK_SET);
+	patch_seek (p1, pos);
 	create_orig (p1, &file_new, not_reverted, NULL);
 
 	/* Decide how much context to use. */
 	if (file_orig.min_context < use_context)
 		use_context = file_orig.min_context;
 
-	if (use_context == 3)
-		sprintf(options, "-%su", diff_opts);
-	else
-		sprintf (options, "-%sU%d", diff_opts, use_context);
+	render_file (&file_orig, &image_orig);
+	xfree_as (ALLOC_LINES, file_new.unline);
+	file_new.unline = xstrdup_as (ALLOC_LINES, file_orig.unline);
+	render_file (&file_new, &image_new);
+	join_image_lines (&image_orig, &joined_orig);
+	join_image_lines (&image_new, &joined_new);
+	STATS_STOP (&timer, STATS_RECONSTRUCT);
+
+	filebuf_init (&diff);
+	STATS_START (&timer);
+	ret = textdiff (image_orig.lines, image_orig.count,
+			image_new.lines, image_new.count,
+			diff_flags, use_context, &diff);
+	STATS_STOP (&timer, STATS_DIFF);
+	if (ret) {
+		STATS_START (&timer);
+		if (not_reverted) {
+			fprintf (out, "--- %.*s\n", (int) oldlen - 4, oldname + 4);
+			fprintf (out, "+++ %.*s\n", (int) newlen - 4, newname + 4);
+		} else {
+			fprintf (out, "--- %.*s\n", (int) newlen - 4, newname + 4);
+			fprintf (out, "+++ %.*s\n", (int) oldlen - 4, oldname + 4);
+		}
+		fwrite (diff.data, diff.size, 1, out);
+		STATS_STOP (&timer, STATS_OUTPUT);
+	}
 
-	/* Write it out. */
-	write_file (&file_orig, tmpp1fd);
-        free (file_new.unline);
-	file_new.unline = xstrdup (file_orig.unline);
-	write_file (&file_new, tmpp2fd);
+	filebuf_free (&diff);
+	free_image (&image_orig);
+	free_image (&image_new);
+	filebuf_free (&joined_orig);
+	filebuf_free (&joined_new);
 	clear_lines_info (&file_orig);
 	clear_lines_info (&file_new);
+	return 0;
+}
 
-	fflush (NULL);
-	in = xpipe (DIFF, &child, "r", DIFF, options, tmpp1, tmpp2, NULL);
+/* One hunk, as read from the patch: each line is ' ', '-' or '+'
+ * followed by its text (without the prefix). */
+struct hunk {
+	unsigned long orig_offset, orig_count;
+	unsigned long new_offset, new_count;
+	unsigned long prefix_context, suffix_context;
+	struct hunk_line {
+		char type;
+		const char *line;
+		size_t length;
+	} *lines;
+	unsigned long count;
+	unsigned long allocated;
+};
 
-	/* Eat the first line */
-	for (;;) {
-		int ch = fgetc (in);
-		if (ch == EOF || ch == '\n')
-			break;
-		diff_is_empty = 0;
-	}
+/* Does the hunk's pre-image match the image at line where (counting
+ * from 0), ignoring prefix_fuzz lines at the start and suffix_fuzz
+ * lines at the end? */
+static int
+hunk_matches (const struct hunk *hunk, const struct file_image *image,
+	      long where, long prefix_fuzz, long suffix_fuzz)
+{
+	unsigned long i;
+	long k = 0;
 
-	/* Eat the second line */
-	for (;;) {
-		int ch = fgetc (in);
-		if (ch == EOF || ch == '\n')
-			break;
+	for (i = 0; i < hunk->count; i++) {
+		const struct hunk_line *l = &hunk->lines[i];
+
+		if (l->type != ' ' && l->type != '-')
+			continue;
+
+		if (k >= prefix_fuzz &&
+		    k < (long) hunk->orig_count - suffix_fuzz) {
+			const struct text_line *il;
+			il = &image->lines[where + k];
+			if (il->length != l->length ||
+			    memcmp (il->line, l->line, l->length))
+				return 0;
+		}
+
+		k++;
 	}
 
-	if (!diff_is_empty) {
-		char *line = NULL;
-		size_t linelen = 0;
-		if (not_reverted) {
-			fprintf (out, "--- %s\n", oldname + 4);
-			fprintf (out, "+++ %s\n", newname + 4);
-		} else {
-			fprintf (out, "--- %s\n", newname + 4);
-			fprintf (out, "+++ %s\n", oldname + 4);
+	return 1;
+}
+
+/* Find where the hunk applies, the way patch(1) does: search outwards
+ * from where it says it goes (adjusted by *offset, the drift seen in
+ * earlier hunks), ignoring up to fuzz lines of context.  A hunk with
+ * less leading than trailing context can only apply at the start of
+ * the file, and vice versa.  Lines before from have been written out
+ * already.  Returns the line (counting from 0), or -1. */
+static long
+locate_hunk (const struct hunk *hunk, const struct file_image *image,
+	     unsigned long from, long fuzz, long *offset)
+{
+	long pat_lines = hunk->orig_count;
+	long input_lines = image->count;
+	long prefix_context = hunk->prefix_context;
+	long suffix_context = hunk->suffix_context;
+	long context = (prefix_context < suffix_context ?
+			suffix_context : prefix_context);
+	long prefix_fuzz = fuzz + prefix_context - context;
+	long suffix_fuzz = fuzz + suffix_context - context;
+	long first = hunk->orig_count ? hunk->orig_offset - 1 :
+		hunk->orig_offset;
+	long guess = first + *offset;
+	long min_where = (long) from - (prefix_context - prefix_fuzz);
+	long max_where = input_lines - (pat_lines - suffix_fuzz);
+	long distance;
+
+	if (!pat_lines)
+		/* Nothing to match. */
+		return guess;
+
+	if (min_where < 0)
+		min_where = 0;
+
+	if (prefix_fuzz < 0 && first == 0) {
+		/* Can only match the start of the file. */
+		if (suffix_fuzz < 0 && (pat_lines != input_lines ||
+					(long) from > prefix_context))
+			return -1;
+
+		if ((long) from <= prefix_context && max_where >= 0 &&
+		    hunk_matches (hunk, image, 0, 0,
+				  suffix_fuzz < 0 ? 0 : suffix_fuzz)) {
+			*offset -= guess;
+			return 0;
 		}
-		for (;;) {
-			ssize_t got = getline (&line, &linelen, in);
-			if (got < 0)
-				break;
-			fwrite (line, (size_t) got, 1, out);
+
+		return -1;
+	} else if (prefix_fuzz < 0)
+		prefix_fuzz = 0;
+
+	if (suffix_fuzz < 0) {
+		/* Can only match the end of the file. */
+		long where = input_lines - pat_lines;
+		if (where >= min_where &&
+		    hunk_matches (hunk, image, where, prefix_fuzz, 0)) {
+			*offset += where - guess;
+			return where;
 		}
-                free (line);
+
+		return -1;
 	}
 
-	fclose (in);
-	waitpid (child, NULL, 0);
-	if (debug)
-		printf ("reconstructed orig1=%s orig2=%s\n", tmpp1, tmpp2);
-	else {
-		unlink (tmpp1);
-		unlink (tmpp2);
+	for (distance = 0;
+	     guess + distance <= max_where || guess - distance >= min_where;
+	     distance++) {
+		if (guess + distance >= min_where &&
+		    guess + distance <= max_where &&
+		    hunk_matches (hunk, image, guess + distance,
+				  prefix_fuzz, suffix_fuzz)) {
+			*offset += distance;
+			return guess + distance;
+		}
+
+		if (distance && guess - distance >= min_where &&
+		    guess - distance <= max_where &&
+		    hunk_matches (hunk, image, guess - distance,
+				  prefix_fuzz, suffix_fuzz)) {
+			*offset -= distance;
+			return guess - distance;
+		}
 	}
-	free (oldname);
-	free (newname);
+
+	return -1;
+}
+
+/* Copy lines from the image up to (not including) line to. */
+static int
+copy_till (const struct file_image *image, unsigned long *from,
+	   unsigned long to, struct file_image *out)
+{
+	if (*from > to)
+		/* Misordered hunks. */
+		return 1;
+
+	for (; *from < to; ++*from)
+		image_add (out, image->lines[*from].line,
+			   image->lines[*from].length);
 	return 0;
 }
 
+/* Turn the hunk around, as for patch -R. */
+static void
+swap_hunk (struct hunk *hunk)
+{
+	unsigned long i, tmp;
+
+	tmp = hunk->orig_offset;
+	hunk->orig_offset = hunk->new_offset;
+	hunk->new_offset = tmp;
+	tmp = hunk->orig_count;
+	hunk->orig_count = hunk->new_count;
+	hunk->new_count = tmp;
+	for (i = 0; i < hunk->count; i++) {
+		if (hunk->lines[i].type == '+')
+			hunk->lines[i].type = '-';
+		else if (hunk->lines[i].type == '-')
+			hunk->lines[i].type = '+';
+	}
+}
+
+/* Apply one hunk (reversed if asked) to the image, having copied
+ * lines up to *from into out already.  Returns non-zero if it doesn't
+ * fit. */
 static int
-apply_patch (FILE *patch, const char *file, int reverted)
+apply_hunk (struct hunk *hunk, int reverted, int first_hunk,
+	    const struct file_image *image, unsigned long *from,
+	    long *offset, struct file_image *out)
 {
-	const char *basename;
-	unsigned long orig_lines, new_lines;
-	size_t linelen;
-	char *line;
-	pid_t child;
-	int status;
-	FILE *w;
+	unsigned long i, at;
+	long fuzz, max_fuzz, where = -1;
+
+	if (reverted)
+		swap_hunk (hunk);
+
+	/* Count the context lines before the first change and after
+	 * the last one. */
+	hunk->prefix_context = hunk->suffix_context = 0;
+	for (i = 0; i < hunk->count && hunk->lines[i].type == ' '; i++)
+		hunk->prefix_context++;
+	for (i = hunk->count; i > 0 && hunk->lines[i - 1].type == ' '; i--)
+		hunk->suffix_context++;
+
+	max_fuzz = hunk->prefix_context < hunk->suffix_context ?
+		hunk->suffix_context : hunk->prefix_context;
+	if (max_fuzz > 2)
+		max_fuzz = 2;
+
+	for (fuzz = 0; where < 0 && fuzz <= max_fuzz; fuzz++) {
+		where = locate_hunk (hunk, image, *from, fuzz, offset);
+		if (where < 0 && first_hunk) {
+			/* If it fits the other way round, patch(1)
+			 * would have asked whether to reverse it, and
+			 * the answer would have been no. */
+			long swapped_offset = *offset;
+			long swapped;
+
+			swap_hunk (hunk);
+			swapped = locate_hunk (hunk, image, *from, fuzz,
+					       &swapped_offset);
+			swap_hunk (hunk);
+			if (swapped >= 0)
+				return 1;
+		}
+	}
 
-	basename = strrchr (file, '/');
-	if (basename)
-	    basename++;
-	else
-	    basename = file;
+	if (where < 0)
+		return 1;
 
-	w = xpipe(PATCH, &child, "w", PATCH,
-		  reverted ? "-Rsp0" : "-sp0", file, NULL);
+	/* Context lines are left to be copied from the file, not the
+	 * patch, in case they were fuzzy. */
+	at = where;
+	for (i = 0; i < hunk->count; i++) {
+		const struct hunk_line *l = &hunk->lines[i];
+		switch (l->type) {
+		case ' ':
+			at++;
+			break;
+		case '-':
+			if (copy_till (image, from, at, out))
+				return 1;
+			++*from;
+			at++;
+			break;
+		case '+':
+			if (copy_till (image, from, at, out))
+				return 1;
+			image_add (out, l->line, l->length);
+			break;
+		}
+	}
+
+	return 0;
+}
 
-	fprintf (w, "--- %s\n+++ %s\n", basename, basename);
-	line = NULL;
-	linelen = 0;
+/* Apply the hunks for one file from patch (reversed if asked) to the
+ * reconstructed file, and put the result in out.  This does the job
+ * patch(1) used to, without leaving the process.  Returns non-zero if
+ * any hunk fails to apply. */
+static int
+apply_patch (struct patch_reader *patch, struct lines_info *file,
+	     int reverted, struct file_image *out)
+{
+	struct file_image image = { NULL, 0, 0 };
+	struct hunk hunk = { 0, 0, 0, 0, 0, 0, NULL, 0, 0 };
+	unsigned long orig_lines, new_lines;
+	unsigned long from = 0;
+	unsigned long n_hunks = 0;
+	long offset = 0;
+	int in_hunk = 0;
+	int failed = 0;
+	const char *line;
+
+	PROBE1 (apply__patch__start, reverted);
+	render_file (file, &image);
 	orig_lines = new_lines = 0;
 	for (;;) {
-		ssize_t got = getline (&line, &linelen, patch);
+		ssize_t got = patch_getline (patch, &line);
 		if (got == -1)
 			break;
 
@@ -858,41 +1231,102 @@ apply_patch (FILE *patch, const char *file, int reverted)
 				continue;
 		}
 
-		fwrite (line, (size_t) got, 1, w);
-
 		if (!strncmp (line, "@@ ", 3)) {
-			orig_lines = orig_num_lines (line);
-			new_lines = new_num_lines (line);
+			if (in_hunk && !failed)
+				failed = apply_hunk (&hunk, reverted,
+						     n_hunks == 1, &image,
+						     &from, &offset, out);
+			n_hunks++;
+
+			if (read_atatline (line, &hunk.orig_offset,
+					   &orig_lines, &hunk.new_offset,
+					   &new_lines))
+				error (EXIT_FAILURE, 0,
+				       "line not understood: %.*s",
+				       (int) strcspn (line, "\n"), line);
+			hunk.orig_count = orig_lines;
+			hunk.new_count = new_lines;
+			hunk.count = 0;
+			in_hunk = 1;
 			continue;
 		}
 
+		if (!in_hunk)
+			continue;
+
+		if (line[0] == '\\') {
+			/* The line before has no newline at the end. */
+			if (hunk.count) {
+				struct hunk_line *l;
+				l = &hunk.lines[hunk.count - 1];
+				if (l->length && l->line[l->length - 1] == '\n')
+					l->length--;
+			}
+			continue;
+		}
+
+		if (!orig_lines && !new_lines)
+			/* Not part of the hunk. */
+			continue;
+
 		if (orig_lines && line[0] != '+')
 			orig_lines--;
 		if (new_lines && line[0] != '-')
 			new_lines--;
+
+		if (hunk.count == hunk.allocated) {
+			hunk.allocated = hunk.allocated ?
+				hunk.allocated * 2 : 16;
+			hunk.lines = xrealloc_as (ALLOC_HUNKS, hunk.lines,
+						  hunk.allocated *
+						  sizeof (struct hunk_line));
+		}
+
+		hunk.lines[hunk.count].type = line[0];
+		hunk.lines[hunk.count].line = line + 1;
+		hunk.lines[hunk.count].length = (size_t) got - 1;
+		hunk.count++;
 	}
-	fclose (w);
-	waitpid (child, &status, 0);
 
-	if (line)
-		free (line);
+	if (in_hunk && !failed)
+		failed = apply_hunk (&hunk, reverted, n_hunks == 1, &image,
+				     &from, &offset, out);
+
+	/* Copy the rest of the file. */
+	for (; from < image.count; from++)
+		image_add (out, image.lines[from].line,
+			   image.lines[from].length);
 
-	return WEXITSTATUS (status);
+	xfree_as (ALLOC_HUNKS, hunk.lines);
+	free_image (&image);
+	PROBE2 (apply__patch__end, failed, out->count);
+	return failed;
 }
 
+/* Is this diff line (after its first character) the unline? */
 static int
-trim_context (FILE *f /* positioned at start of @@ line */,
+is_unline (const char *line, ssize_t got, const char *unline)
+{
+	size_t len = strlen (unline);
+
+	return got > 0 && (size_t) got - 1 == len &&
+		!memcmp (line + 1, unline, len);
+}
+
+static int
+trim_context (struct patch_reader *in /* positioned at start of @@ line */,
 	      const char *unline /* drop this line */,
 	      FILE *out /* where to send output */)
 {
 	/* For each hunk, trim the context so that the number of
 	 * pre-context lines does not exceed the number of
 	 * post-context lines.  See the fuzz1 test case. */
-	char *line = NULL;
-	size_t linelen;
+	const char *line;
+	ssize_t got;
 
+	PROBE (trim__context__start);
 	for (;;) {
-		fpos_t pos;
+		size_t pos;
 		unsigned long pre = 0, pre_seen = 0, post = 0;
 		unsigned long strip_pre = 0, strip_post = 0;
 		unsigned long orig_offset, new_offset;
@@ -901,25 +1335,25 @@ trim_context (FILE *f /* positioned at start of @@ line */,
 		unsigned long total_count = 0;
 
 		/* Read @@ line. */
-		if (getline (&line, &linelen, f) < 0)
+		if ((got = patch_getline (in, &line)) < 0)
 			break;
 
 		if (line[0] == '\\') {
 			/* Pass '\' lines through unaltered. */
-			fputs (line, out);
+			fwrite (line, (size_t) got, 1, out);
 			continue;
 		}
 
 		if (read_atatline (line, &orig_offset, &orig_count,
 				   &new_offset, &new_count))
-			error (EXIT_FAILURE, 0, "Line not understood: %s",
-			       line);
+			error (EXIT_FAILURE, 0, "Line not understood: %.*s",
+			       (int) got, line);
 
 		orig_orig_count = new_orig_count = orig_count;
 		orig_new_count = new_new_count = new_count;
-		fgetpos (f, &pos);
+		pos = patch_tell (in);
 		while (orig_count || new_count) {
-			if (getline (&line, &linelen, f) < 0)
+			if ((got = patch_getline (in, &line)) < 0)
 				break;
 
 			total_count++;
@@ -931,12 +1365,12 @@ trim_context (FILE *f /* positioned at start of @@ line */,
 				if (new_count) new_count--;
 				if (!pre_seen) {
 					pre++;
-					if (!strcmp (line + 1, unline))
+					if (is_unline (line, got, unline))
 						strip_pre = pre;
 				} else {
 					post++;
 					if (strip_post ||
-					    !strcmp (line + 1, unline))
+					    is_unline (line, got, unline))
 						strip_post++;
 				}
 				break;
@@ -973,7 +1407,7 @@ trim_context (FILE *f /* positioned at start of @@ line */,
 		if (debug)
 			printf ("Trim: %lu,%lu\n", strip_pre, strip_post);
 
-		fsetpos (f, &pos);
+		patch_seek (in, pos);
 		fprintf (out, "@@ -%lu", orig_offset);
 		if (new_orig_count != 1)
 			fprintf (out, ",%lu", new_orig_count);
@@ -983,7 +1417,7 @@ trim_context (FILE *f /* positioned at start of @@ line */,
 		fprintf (out, " @@\n");
 
 		while (total_count--) {
-			ssize_t got = getline (&line, &linelen, f);
+			got = patch_getline (in, &line);
 			assert (got > 0);
 
 			if (strip_pre) {
@@ -998,7 +1432,7 @@ trim_context (FILE *f /* positioned at start of @@ line */,
 		}
 	}
 
-	free (line);
+	PROBE (trim__context__end);
 	return 0;
 
  split_hunk:
@@ -1008,137 +1442,106 @@ trim_context (FILE *f /* positioned at start of @@ line */,
 }
 
 static int
-output_delta (FILE *p1, FILE *p2, FILE *out)
+output_delta (struct patch_reader *p1, struct patch_reader *p2,
+	      unsigned int context, FILE *out)
 {
-	const char *tmpdir = getenv ("TMPDIR");
-	unsigned int tmplen;
-	const char tail1[] = "/interdiff-1.XXXXXX";
-	const char tail2[] = "/interdiff-2.XXXXXX";
-	char *tmpp1, *tmpp2;
-	int tmpp1fd, tmpp2fd;
-	struct lines_info file = { NULL, 0, 0, NULL, NULL };
-	struct lines_info file2 = { NULL, 0, 0, NULL, NULL };
-	char *oldname = NULL, *newname = NULL;
-	pid_t child;
-	FILE *in;
-	size_t namelen;
-	long pos1 = ftell (p1), pos2 = ftell (p2);
-	long pristine1, pristine2;
-	long start1, start2;
+	struct lines_info file = LINES_INFO_INIT;
+	struct lines_info file2 = LINES_INFO_INIT;
+	struct file_image image1 = { NULL, 0, 0 };
+	struct file_image image2 = { NULL, 0, 0 };
+	struct filebuf joined1 = { NULL, 0, NULL, 0 };
+	struct filebuf joined2 = { NULL, 0, NULL, 0 };
+	struct filebuf diff;
+	struct patch_reader in;
+	const char *oldname, *newname;
+	ssize_t oldlen, newlen;
+	size_t pos1 = patch_tell (p1), pos2 = patch_tell (p2);
+	size_t pristine1, pristine2;
+	size_t start1, start2;
 	char options[100];
-	int diff_is_empty = 1;
+	int diff_is_empty;
+	struct stats_timer timer;
 
-	pristine1 = ftell (p1);
-	pristine2 = ftell (p2);
+	pristine1 = patch_tell (p1);
+	pristine2 = patch_tell (p2);
 
-	if (!tmpdir)
-		tmpdir = P_tmpdir;
-
-	tmplen = strlen (tmpdir);
-	tmpp1 = alloca (tmplen + sizeof (tail1));
-	memcpy (tmpp1, tmpdir, tmplen);
-	memcpy (tmpp1 + tmplen, tail1, sizeof (tail1));
-	tmpp2 = alloca (tmplen + sizeof (tail2));
-	memcpy (tmpp2, tmpdir, tmplen);
-	memcpy (tmpp2 + tmplen, tail2, sizeof (tail2));
-
-	if (max_context == 3)
+	if (context == 3)
 		sprintf(options, "-%su", diff_opts);
 	else
-		sprintf (options, "-%sU%d", diff_opts, max_context);
-
-	tmpp1fd = xmkstemp (tmpp1);
-	tmpp2fd = xmkstemp (tmpp2);
+		sprintf (options, "-%sU%d", diff_opts, context);
 
 	do {
-		if (oldname) {
-			free (oldname);
-			oldname = NULL;
-		}
-		if (getline (&oldname, &namelen, p1) < 0)
+		if ((oldlen = patch_getline (p1, &oldname)) < 0)
 			error (EXIT_FAILURE, errno, "Bad patch #1");
 
 	} while (strncmp (oldname, "+++ ", 4));
-	oldname[strlen (oldname) - 1] = '\0';
+	oldlen--;
 
 	do {
-		if (newname) {
-			free (newname);
-			newname = NULL;
-		}
-		if (getline (&newname, &namelen, p2) < 0)
+		if ((newlen = patch_getline (p2, &newname)) < 0)
 			error (EXIT_FAILURE, errno, "Bad patch #2");
 
 	} while (strncmp (newname, "+++ ", 4));
-	newname[strlen (newname) - 1] = '\0';
+	newlen--;
 
-	start1 = ftell (p1);
-	start2 = ftell (p2);
-	fseek (p1, pos1, SEEK_SET);
-	fseek (p2, pos2, SEEK_SET);
+	start1 = patch_tell (p1);
+	start2 = patch_tell (p2);
+	STATS_START (&timer);
+	patch_seek (p1, pos1);
+	patch_seek (p2, pos2);
 	create_orig (p2, &file, 0, NULL);
-	fseek (p1, pos1, SEEK_SET);
-	fseek (p2, pos2, SEEK_SET);
+	patch_seek (p1, pos1);
+	patch_seek (p2, pos2);
 	create_orig (p1, &file2, mode == mode_combine, NULL);
 	merge_lines(&file, &file2);
-	pos1 = ftell (p1);
-
-	/* Write it out. */
-	write_file (&file, tmpp1fd);
-	write_file (&file, tmpp2fd);
+	pos1 = patch_tell (p1);
+	STATS_STOP (&timer, STATS_RECONSTRUCT);
 
-	fseek (p1, start1, SEEK_SET);
-	fseek (p2, start2, SEEK_SET);
+	patch_seek (p1, start1);
+	patch_seek (p2, start2);
 
-	if (apply_patch (p1, tmpp1, mode == mode_combine))
+	STATS_START (&timer);
+	if (apply_patch (p1, &file, mode == mode_combine, &image1))
 		error (EXIT_FAILURE, 0,
 		       "Error applying patch1 to reconstructed file");
 
-	if (apply_patch (p2, tmpp2, 0))
+	if (apply_patch (p2, &file, 0, &image2))
 		error (EXIT_FAILURE, 0,
 		       "Error applying patch2 to reconstructed file");
 
-	fseek (p1, pos1, SEEK_SET);
+	join_image_lines (&image1, &joined1);
+	join_image_lines (&image2, &joined2);
+	STATS_STOP (&timer, STATS_APPLY);
 
-	fflush (NULL);
+	filebuf_init (&diff);
+	STATS_START (&timer);
+	diff_is_empty = !textdiff (image1.lines, image1.count,
+				   image2.lines, image2.count,
+				   diff_flags, context, &diff);
+	STATS_STOP (&timer, STATS_DIFF);
+	free_image (&image1);
+	free_image (&image2);
+	filebuf_free (&joined1);
+	filebuf_free (&joined2);
 
-	in = xpipe(DIFF, &child, "r", DIFF, options, tmpp1, tmpp2, NULL);
-	
-	/* Eat the first line */
-	for (;;) {
-		int ch = fgetc (in);
-		if (ch == EOF || ch == '\n')
-			break;
-		diff_is_empty = 0;
-	}
-
-	/* Eat the second line */
-	for (;;) {
-		int ch = fgetc (in);
-		if (ch == EOF || ch == '\n')
-			break;
-	}
+	patch_seek (p1, pos1);
 
 	if (!diff_is_empty) {
-		/* ANOTHER temporary file!  This is to catch the case
-		 * where we just don't have enough context to generate
-		 * a proper interdiff. */
-		FILE *tmpdiff = xtmpfile ();
-		char *line = NULL;
-		size_t linelen;
-		for (;;) {
-			ssize_t got = getline (&line, &linelen, in);
-			if (got < 0)
-				break;
-			fwrite (line, (size_t) got, 1, tmpdiff);
-			if (*line != ' ' && !strcmp (line + 1, file.unline)) {
+		const char *line;
+		ssize_t got;
+
+		/* Catch the case where we just don't have enough
+		 * context to generate a proper interdiff. */
+		patch_reader_init (&in, diff.data, diff.size);
+		while ((got = patch_getline (&in, &line)) >= 0) {
+			if (*line != ' ' && is_unline (line, got, file.unline)) {
 				/* Uh-oh.  We're trying to output a
 				 * line that made up (we never saw the
 				 * original).  As long as this is at
 				 * the end of a hunk we can safely
 				 * drop it (done in trim_context
 				 * later). */
-				got = getline (&line, &linelen, in);
+				got = patch_getline (&in, &line);
 				if (got < 0)
 					continue;
 				else if (strncmp (line, "@@ ", 3)) {
@@ -1146,117 +1549,315 @@ output_delta (FILE *p1, FILE *p2, FILE *out)
 					 * Evasive action: just revert the
 					 * original and copy the new
 					 * version. */
-					fclose (tmpdiff);
-					free (line);
+					filebuf_free (&diff);
+					clear_lines_info (&file);
 					goto evasive_action;
 				}
-				fwrite (line, (size_t) got, 1, tmpdiff);
 			}
 		}
-		free (line);
 
 		/* First character */
-		if (human_readable) {
-			char *p, *q, c, d;
-			c = d = '\0'; /* shut gcc up */
-			p = strchr (oldname + 4, '\t');
-			if (p) {
-				c = *p;
-				*p = '\0';
-			}
-			q = strchr (newname + 4, '\t');
-			if (q) {
-				d = *q;
-				*q = '\0';
-			}
-			fprintf (out, DIFF " %s %s %s\n", options, oldname + 4,
+		STATS_START (&timer);
+		if (human_readable)
+			fprintf (out, DIFF " %s %.*s %.*s\n", options,
+				 (int) strcspn (oldname + 4, "\t\n"),
+				 oldname + 4,
+				 (int) strcspn (newname + 4, "\t\n"),
 				 newname + 4);
-			if (p) *p = c;
-			if (q) *q = d;
-		}
-		fprintf (out, "--- %s\n", oldname + 4);
-		fprintf (out, "+++ %s\n", newname + 4);
-		rewind (tmpdiff);
-		trim_context (tmpdiff, file.unline, out);
-		fclose (tmpdiff);
+		fprintf (out, "--- %.*s\n", (int) oldlen - 4, oldname + 4);
+		fprintf (out, "+++ %.*s\n", (int) newlen - 4, newname + 4);
+		patch_seek (&in, 0);
+		trim_context (&in, file.unline, out);
+		STATS_STOP (&timer, STATS_OUTPUT);
 	}
 
-	fclose (in);
-	waitpid (child, NULL, 0);
-	if (debug)
-		printf ("reconstructed orig1=%s orig2=%s\n", tmpp1, tmpp2);
-	else {
-		unlink (tmpp1);
-		unlink (tmpp2);
-	}
-	free (oldname);
-	free (newname);
+	filebuf_free (&diff);
 	clear_lines_info (&file);
 	return 0;
 
  evasive_action:
-	if (debug)
-		printf ("reconstructed orig1=%s orig2=%s\n", tmpp1, tmpp2);
-	else {
-		unlink (tmpp1);
-		unlink (tmpp2);
-	}
 	if (human_readable)
 		fprintf (out, "%s impossible; taking evasive action\n",
 			 (mode == mode_combine) ? "merge" : "interdiff");
-	fseek (p1, pristine1, SEEK_SET);
-	fseek (p2, pristine2, SEEK_SET);
-	output_patch1_only (p1, out, mode == mode_combine);
-	output_patch1_only (p2, out, 1);
+	patch_seek (p1, pristine1);
+	patch_seek (p2, pristine2);
+	output_patch1_only (p1, out, mode == mode_combine, context);
+	output_patch1_only (p2, out, 1, context);
 	return 0;
 }
 
+/*
+ * With -j, files are handed out to a pool of worker threads.  Each
+ * file is independent of the others, so each worker just needs its
+ * own readers over the patches and somewhere of its own to put the
+ * output; the main thread prints the outputs in the order the files
+ * were queued, so the result is the same as without -j.
+ */
+struct file_task {
+	size_t pos;		/* the file in patch1 (or patch2) */
+	long pos2;		/* the same file in patch2, or -1 */
+	int in_patch2;		/* pos is in patch2: see copy_residue */
+	unsigned int context;
+	char *output;
+	size_t output_size;
+	int done;
+};
+
+struct task_list {
+	struct file_task *tasks;
+	unsigned long count;
+	unsigned long allocated;
+	unsigned long next;	/* the next one to hand out */
+	const struct patch_reader *p1, *p2;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+#endif /* HAVE_PTHREAD_H */
+};
+
+static struct task_list tasks;
+
+static void
+add_task (size_t pos, long pos2, int in_patch2)
+{
+	struct file_task *task;
+
+	if (tasks.count == tasks.allocated) {
+		tasks.allocated = tasks.allocated ? tasks.allocated * 2 : 64;
+		tasks.tasks = xrealloc (tasks.tasks, tasks.allocated *
+					sizeof (struct file_task));
+	}
+
+	task = &tasks.tasks[tasks.count++];
+	task->pos = pos;
+	task->pos2 = pos2;
+	task->in_patch2 = in_patch2;
+	task->context = max_context;
+	task->output = NULL;
+	task->output_size = 0;
+	task->done = 0;
+}
+
+static void
+run_task (struct file_task *task)
+{
+	struct patch_reader p1 = *tasks.p1, p2 = *tasks.p2;
+	FILE *out;
+
+#ifdef HAVE_OPEN_MEMSTREAM
+	out = open_memstream (&task->output, &task->output_size);
+	if (!out)
+		error (EXIT_FAILURE, errno, "open_memstream");
+#else
+	out = xtmpfile ();
+#endif /* HAVE_OPEN_MEMSTREAM */
+
+	if (task->in_patch2) {
+		patch_seek (&p2, task->pos);
+		if (human_readable)
+			fprintf (out, "only in patch2:\n");
+		output_patch1_only (&p2, out, 1, task->context);
+	} else if (task->pos2 == -1) {
+		patch_seek (&p1, task->pos);
+		output_patch1_only (&p1, out, mode != mode_inter,
+				    task->context);
+	} else {
+		patch_seek (&p1, task->pos);
+		patch_seek (&p2, task->pos2);
+		output_delta (&p1, &p2, task->context, out);
+	}
+
+#ifndef HAVE_OPEN_MEMSTREAM
+	task->output_size = ftell (out);
+	task->output = xmalloc_as (ALLOC_IO, task->output_size + 1);
+	rewind (out);
+	if (fread (task->output, 1, task->output_size, out) !=
+	    task->output_size)
+		error (EXIT_FAILURE, errno, "error reading temporary file");
+	STATS_ADD (STATS_TMPFILE_BYTES, task->output_size);
+#endif /* HAVE_OPEN_MEMSTREAM */
+	fclose (out);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+task_worker (void *unused)
+{
+	for (;;) {
+		struct file_task *task;
+
+		pthread_mutex_lock (&tasks.lock);
+		if (tasks.next == tasks.count) {
+			pthread_mutex_unlock (&tasks.lock);
+			break;
+		}
+		task = &tasks.tasks[tasks.next++];
+		pthread_mutex_unlock (&tasks.lock);
+
+		run_task (task);
+
+		pthread_mutex_lock (&tasks.lock);
+		task->done = 1;
+		pthread_cond_broadcast (&tasks.done);
+		pthread_mutex_unlock (&tasks.lock);
+	}
+
+	return NULL;
+}
+#endif /* HAVE_PTHREAD_H */
+
+/* Process the queued files and print their output in order. */
+static void
+run_tasks (const struct patch_reader *p1, const struct patch_reader *p2,
+	   FILE *out)
+{
+	struct stats_timer timer;
+	unsigned long i;
+#ifdef HAVE_PTHREAD_H
+	unsigned long nthreads = jobs < tasks.count ? jobs : tasks.count;
+	pthread_t *threads = xmalloc ((nthreads + 1) * sizeof (pthread_t));
+	unsigned long n;
+#endif /* HAVE_PTHREAD_H */
+
+	tasks.p1 = p1;
+	tasks.p2 = p2;
+	tasks.next = 0;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init (&tasks.lock, NULL);
+	pthread_cond_init (&tasks.done, NULL);
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create (&threads[n], NULL, task_worker, NULL))
+			error (EXIT_FAILURE, 0, "cannot create thread");
+#endif /* HAVE_PTHREAD_H */
+
+	for (i = 0; i < tasks.count; i++) {
+		struct file_task *task = &tasks.tasks[i];
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock (&tasks.lock);
+		while (!task->done)
+			pthread_cond_wait (&tasks.done, &tasks.lock);
+		pthread_mutex_unlock (&tasks.lock);
+#else
+		run_task (task);
+#endif /* HAVE_PTHREAD_H */
+
+		STATS_START (&timer);
+		fwrite (task->output, task->output_size, 1, out);
+		STATS_STOP (&timer, STATS_OUTPUT);
+#ifdef HAVE_OPEN_MEMSTREAM
+		free (task->output);	/* from open_memstream() */
+#else
+		xfree_as (ALLOC_IO, task->output);
+#endif /* HAVE_OPEN_MEMSTREAM */
+	}
+
+#ifdef HAVE_PTHREAD_H
+	for (n = 0; n < nthreads; n++)
+		pthread_join (threads[n], NULL);
+	xfree (threads);
+	pthread_cond_destroy (&tasks.done);
+	pthread_mutex_destroy (&tasks.lock);
+#endif /* HAVE_PTHREAD_H */
+
+	xfree (tasks.tasks);
+	tasks.tasks = NULL;
+	tasks.count = tasks.allocated = 0;
+}
+
 static int
-copy_residue (FILE *p2, FILE *out)
+copy_residue (struct patch_reader *p2, FILE *out)
 {
 	struct file_list *at;
 
-	for (at = files_in_patch2; at; at = at->next) {
+	for (at = files_in_patch2.head; at; at = at->next) {
 
-		if (file_in_list (files_done, at->file) != -1)
+		if (file_in_list (&files_done, at->file) != -1)
 			continue;
 
 		/* check if we need to process it and init context */
 		if (!check_filename(at->file))
 			continue;
 
-		fseek (p2, at->pos, SEEK_SET);
+		if (jobs > 1 && mode != mode_flip) {
+			add_task (at->pos, -1, 1);
+			continue;
+		}
+
+		patch_seek (p2, at->pos);
 		if (human_readable && mode != mode_flip)
 			fprintf (out, "only in patch2:\n");
 
-		output_patch1_only (p2, out, 1);
+		output_patch1_only (p2, out, 1, max_context);
 	}
 
 	return 0;
 }
 
+/* Use patch2's index file, if it has an up-to-date one that only
+ * lists unified diffs, to find the files in it.  Returns 0 if there
+ * is no such index. */
 static int
-index_patch2 (FILE *p2)
+index_patch2_from_file (struct patch_reader *p2, const char *patch2)
 {
-	char *line = NULL;
-	size_t linelen = 0;
+	struct pidx *idx = pidx_open (patch2, p2->data, p2->size);
+	struct pidx_file file;
+	unsigned long i;
+
+	if (!idx)
+		return 0;
+
+	for (i = 0; i < idx->num_files; i++) {
+		pidx_get_file (idx, i, &file);
+		if (file.context) {
+			/* Leave it to the search to complain. */
+			pidx_close (idx);
+			return 0;
+		}
+	}
+
+	STATS_ADD (STATS_FILES, idx->num_files);
+	STATS_ADD (STATS_HUNKS, idx->num_hunks);
+
+	/* Only files with at least one hunk are indexed. */
+	for (i = 0; i < idx->num_files; i++) {
+		pidx_get_file (idx, i, &file);
+		if (file.num_hunks)
+			add_to_list (&files_in_patch2, file.name, file.names);
+	}
+
+	pidx_close (idx);
+	return 1;
+}
+
+static int
+index_patch2 (struct patch_reader *p2, const char *patch2)
+{
+	struct patch_parser parser;
+	struct patch_record rec, hunk;
 	int is_context = 0;
 	int file_is_empty = 1;
 
+	if (!unzip && index_patch2_from_file (p2, patch2))
+		return p2->size && !files_in_patch2.head;
+
 	/* Index patch2 */
-	while (!feof (p2)) {
-		unsigned long skip;
+	patch_parser_init (&parser, p2);
+	while (patch_next_record (&parser, &rec) != PATCH_EOF) {
 		char *names[2];
-		char *p, *end;
-		long pos = ftell (p2);
-
-		if (getline (&line, &linelen, p2) == -1)
-			break;
+		size_t next;
 
 		file_is_empty = 0;
 
-		if (strncmp (line, "--- ", 4)) {
-			is_context = !strncmp (line, "*** ", 4);
+		if (rec.type != PATCH_FILE) {
+			if (rec.type != PATCH_OTHER)
+				is_context = 0;
+			else if (strncmp (rec.line, "--- ", 4))
+				is_context = !strncmp (rec.line, "*** ", 4);
+			else if (is_context)
+				error (EXIT_FAILURE, 0,
+				       "I don't understand context diffs yet.");
 			continue;
 		}
 
@@ -1264,63 +1865,24 @@ index_patch2 (FILE *p2)
 			error (EXIT_FAILURE, 0,
 			       "I don't understand context diffs yet.");
 
-		names[0] = filename_from_header (line + 4);
-
-		if (getline (&line, &linelen, p2) == -1) {
-			free (names[0]);
-			break;
-		}
-
-		if (strncmp (line, "+++ ", 4)) {
-			free (names[0]);
+		/* Only files with at least one hunk are indexed.  The
+		 * parser skips the hunk bodies for us. */
+		next = patch_tell (p2);
+		if (patch_next_record (&parser, &hunk) != PATCH_HUNK) {
+			patch_seek (p2, next);
+			patch_parser_reset (&parser);
 			continue;
 		}
 
-		names[1] = filename_from_header (line + 4);
-
-		if (getline (&line, &linelen, p2) == -1) {
-			free (names[0]);
-			free (names[1]);
-			break;
-		}
-
-		if (strncmp (line, "@@ ", 3))
-			goto try_next;
-
-		p = strchr (line + 3, '+');
-		if (!p)
-			goto try_next;
-		p = strchr (p, ',');
-		if (p) {
-			/* Like '@@ -1,3 +1,3 @@' */
-			p++;
-			skip = strtoul (p, &end, 10);
-			if (p == end)
-				goto try_next;
-		} else
-			/* Like '@@ -1 +1 @@' */
-			skip = 1;
-
-		add_to_list (&files_in_patch2, best_name (2, names), pos);
-
-		while (skip--) {
-			if (getline (&line, &linelen, p2) == -1)
-				break;
-
-			if (line[0] == '-')
-				/* Doesn't count towards skip count */
-				skip++;
-		}
-
-	try_next:
-		free (names[0]);
-		free (names[1]);
+		names[0] = filename_from_header (rec.line + 4);
+		names[1] = filename_from_header (rec.line2 + 4);
+		add_to_list (&files_in_patch2, best_name (2, names),
+			     rec.offset);
+		xfree_as (ALLOC_HEADER, names[0]);
+		xfree_as (ALLOC_HEADER, names[1]);
 	}
 
-	if (line)
-		free (line);
-
-	if (file_is_empty || files_in_patch2)
+	if (file_is_empty || files_in_patch2.head)
 		return 0;
 	else
 		return 1;
@@ -1354,8 +1916,8 @@ add_offset (unsigned long line, long offset,
 {
 	if (*num_offsets == *allocated) {
 		*allocated *= 2;
-		offsets = xrealloc (offsets,
-				    *allocated * sizeof (struct offset));
+		offsets = xrealloc_as (ALLOC_HUNKS, offsets,
+				       *allocated * sizeof (struct offset));
 	}
 	offsets[*num_offsets].line = line;
 	offsets[*num_offsets].offset = offset;
@@ -1368,7 +1930,7 @@ add_offset (unsigned long line, long offset,
 static void
 free_offsets (struct offset *offsets)
 {
-	free (offsets);
+	xfree_as (ALLOC_HUNKS, offsets);
 }
 
 static int
@@ -1424,17 +1986,9 @@ static int
 insert_line (struct lines_info *lines, const char *line, size_t length,
 	     unsigned long n)
 {
-	struct lines *at;
-
 	/* Renumber subsequent lines. */
-	for (at = lines->head; at; at = at->next)
-		if (n <= at->n)
-			break;
-
-	while (at) {
-		at->n++;
-		at = at->next;
-	}
+	move_gap (lines, find_line (lines, n));
+	lines->shift++;
 
 	/* Insert the line. */
 	if (debug)
@@ -1444,121 +1998,81 @@ insert_line (struct lines_info *lines, const char *line, size_t length,
 }
 
 static void
-remove_line (struct lines_info *lines, const char *line,
+remove_line (struct lines_info *lines, const char *line, size_t length,
 	     unsigned long n)
 {
-	struct lines *at, *kill = NULL;
+	unsigned long kill = find_line (lines, n);
+	struct lines *at;
 
-	/* Renumber subsequent lines. */
-	for (at = lines->head; at; at = at->next)
-		if (n <= at->n)
-			break;
+	if (kill == lines->count + lines->after ||
+	    line_number (lines, kill) != n)
+		error (EXIT_FAILURE, 0, "Garbled patch");
 
-	if (at && n == at->n) {
-		kill = at;
-		if (strcmp (at->line, line) && kill->prev) {
-			kill = kill->prev;
-			if (debug)
-				printf ("Not removing from %lu: %s", n,
-					at->line);
-		}
-	}
-
-	at = kill;
-	while (at) {
-		at->n--;
-		at = at->next;
+	at = line_at (lines, kill);
+	if ((at->length != length || memcmp (at->line, line, length)) &&
+	    kill > 0) {
+		kill--;
+		if (debug)
+			printf ("Not removing from %lu: %s", n, at->line);
 	}
 
 	/* Remove the line. */
 	if (debug)
-		printf ("Remove from %lu: %s", n, kill->line);
-
-	if (kill->prev)
-		kill->prev->next = kill->next;
-
-	if (kill->next)
-		kill->next->prev = kill->prev;
-
-	if (lines->head == kill)
-		lines->head = kill->next;
+		printf ("Remove from %lu: %s", n, line_at (lines, kill)->line);
 
-	if (lines->tail == kill)
-		lines->tail = kill->prev;
-
-	free (kill->line);
-	free (kill);
+	/* Renumber subsequent lines. */
+	move_gap (lines, kill + 1);
+	lines->count--;
+	lines->shift--;
 }
 
 static int
-take_diff (const char *f1, const char *f2, char *headers[2],
-	   const char *unline, FILE *out)
+take_diff (const struct file_image *image1, const struct file_image *image2,
+	   char *headers[2], const char *unline, FILE *out)
 {
-	char options[100];
-	pid_t child;
-	int diff_is_empty = 1;
-	FILE *in;
-
-	if (max_context == 3)
-		sprintf (options, "-%su", diff_opts);
-	else
-		sprintf (options, "-%sU%d", diff_opts, max_context);
-
-	if (debug)
-		printf ("+ " DIFF " %s %s %s\n", options, f1, f2);
-
-	in = xpipe (DIFF, &child, "r", DIFF, options, f1, f2, NULL);
-
-	/* Eat the first line */
-	for (;;) {
-		int ch = fgetc (in);
-		if (ch == EOF || ch == '\n')
-			break;
-		diff_is_empty = 0;
-	}
-
-	/* Eat the second line */
-	for (;;) {
-		int ch = fgetc (in);
-		if (ch == EOF || ch == '\n')
-			break;
-	}
+	struct filebuf diff;
+	struct stats_timer timer;
+	int ret;
 
-	if (!diff_is_empty) {
-		FILE *tmpdiff = xtmpfile ();
-		while (!feof (in)) {
-			int ch = fgetc (in);
-			if (ch != EOF)
-				fputc (ch, tmpdiff);
-		}
-		rewind (tmpdiff);
+	PROBE2 (take__diff__start, image1->count, image2->count);
+	filebuf_init (&diff);
+	STATS_START (&timer);
+	ret = textdiff (image1->lines, image1->count,
+			image2->lines, image2->count,
+			diff_flags, max_context, &diff);
+	STATS_STOP (&timer, STATS_DIFF);
+	if (ret) {
+		struct patch_reader in;
+
+		STATS_START (&timer);
+		patch_reader_init (&in, diff.data, diff.size);
 		fputs (headers[0], out);
 		fputs (headers[1], out);
-		trim_context (tmpdiff, unline, out);
-		fclose (tmpdiff);
+		trim_context (&in, unline, out);
+		STATS_STOP (&timer, STATS_OUTPUT);
 	}
 
-	fclose (in);
-	waitpid (child, NULL, 0);
+	filebuf_free (&diff);
+	PROBE1 (take__diff__end, ret);
 	return 0;
 }
 
 static int
-flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
+flipdiff (struct patch_reader *p1, struct patch_reader *p2,
+	  FILE *flip1, FILE *flip2)
 {
-	char *line = NULL;
-	size_t linelen = 0;
-	const char tail1[] = "/flipdiff-1.XXXXXX";
-	const char tail2[] = "/flipdiff-2.XXXXXX";
-	const char tail3[] = "/flipdiff-3.XXXXXX";
-	char *tmpdir = getenv ("TMPDIR");
+	const char *line;
+	ssize_t got;
 	char *header1[2], *header2[2];
-	unsigned int tmplen;
-	char *tmpp1, *tmpp2, *tmpp3;
-	int tmpfd;
-	FILE *f;
-	fpos_t at1, at2;
-	struct lines_info intermediate = { NULL, 0, 0, NULL, NULL };
+	size_t at1, at2;
+	struct lines_info intermediate = LINES_INFO_INIT;
+	struct file_image start = { NULL, 0, 0 };
+	struct file_image middle = { NULL, 0, 0 };
+	struct file_image end = { NULL, 0, 0 };
+	struct filebuf joined[3] = {
+		{ NULL, 0, NULL, 0 }, { NULL, 0, NULL, 0 }, { NULL, 0, NULL, 0 }
+	};
+	struct lines_info end_lines;
 	struct offset *offsets = NULL;
 	unsigned long offset_alloc = 100;
 	unsigned long num_offsets = 0;
@@ -1568,46 +2082,29 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 	int saw_first_offset;
 	int clash = 0;
 	unsigned long orig_lines, new_lines;
+	struct stats_timer timer;
 
 	/* Read headers. */
-	header1[0] = header1[1] = NULL;
-	linelen = 0;
-	getline (&header1[0], &linelen, p1);
-	linelen = 0;
-	getline (&header1[1], &linelen, p1);
-
-	header2[0] = header2[1] = NULL;
-	linelen = 0;
-	getline (&header2[0], &linelen, p2);
-	linelen = 0;
-	getline (&header2[1], &linelen, p2);
-	linelen = 0;
-
-	fgetpos (p1, &at1);
-	fgetpos (p2, &at2);
-
-	/* Generate temporary file name templates. */
-	if (!tmpdir)
-		tmpdir = P_tmpdir;
-
-	tmplen = strlen (tmpdir);
-	tmpp1 = alloca (tmplen + sizeof (tail1));
-	memcpy (tmpp1, tmpdir, tmplen);
-	memcpy (tmpp1 + tmplen, tail1, sizeof (tail1));
-
-	tmpp2 = alloca (tmplen + sizeof (tail2));
-	memcpy (tmpp2, tmpdir, tmplen);
-	memcpy (tmpp2 + tmplen, tail2, sizeof (tail2));
-
-	tmpp3 = alloca (tmplen + sizeof (tail3));
-	memcpy (tmpp3, tmpdir, tmplen);
-	memcpy (tmpp3 + tmplen, tail3, sizeof (tail3));
+	got = patch_getline (p1, &line);
+	header1[0] = xstrndup_as (ALLOC_HEADER, line, got < 0 ? 0 : got);
+	got = patch_getline (p1, &line);
+	header1[1] = xstrndup_as (ALLOC_HEADER, line, got < 0 ? 0 : got);
+
+	got = patch_getline (p2, &line);
+	header2[0] = xstrndup_as (ALLOC_HEADER, line, got < 0 ? 0 : got);
+	got = patch_getline (p2, &line);
+	header2[1] = xstrndup_as (ALLOC_HEADER, line, got < 0 ? 0 : got);
+
+	at1 = patch_tell (p1);
+	at2 = patch_tell (p2);
 
 	/* Reconstruct the file after patch1. */
+	STATS_START (&timer);
 	create_orig (p1, &intermediate, 1, NULL);
 
 	/* Reconstruct the file before patch2. */
 	create_orig (p2, &intermediate, 0, &clash);
+	STATS_STOP (&timer, STATS_RECONSTRUCT);
 
 	/* If any of the lines grokked from the patches mis-matched, we are
 	 * likely to run into problems. */
@@ -1616,31 +2113,33 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 		       "re-generate them first", clash,
 		       clash == 1 ? "" : "s");
 
-	/* Now we have all the context we're going to get.  Write out
-	 * the file and apply patch1 in reverse, so we end up with the
-	 * file as it should look before applying patches. */
-	tmpfd = xmkstemp (tmpp1);
-	write_file (&intermediate, tmpfd);
-	fsetpos (p1, &at1);
-	if (apply_patch (p1, tmpp1, 1))
+	/* Now we have all the context we're going to get.  Apply
+	 * patch1 in reverse, so we end up with the file as it should
+	 * look before applying patches. */
+	patch_seek (p1, at1);
+	STATS_START (&timer);
+	if (apply_patch (p1, &intermediate, 1, &start))
 		error (EXIT_FAILURE, 0,
 		       "Error reconstructing original file");
 
-	/* Write it out again and apply patch2, so we end up with the
-	 * file as it should look after both patches. */
-	tmpfd = xmkstemp (tmpp3);
-	write_file (&intermediate, tmpfd);
-	fsetpos (p2, &at2);
-	if (apply_patch (p2, tmpp3, 0))
+	/* And apply patch2, so we end up with the file as it should
+	 * look after both patches. */
+	patch_seek (p2, at2);
+	if (apply_patch (p2, &intermediate, 0, &end))
 		error (EXIT_FAILURE, 0,
 		       "Error reconstructing final file");
+	STATS_STOP (&timer, STATS_APPLY);
+
+	join_image_lines (&start, &joined[0]);
+	join_image_lines (&end, &joined[2]);
 
 	/* Examine patch2 to figure out offsets. */
-	fsetpos (p2, &at2);
-	offsets = xmalloc (offset_alloc * sizeof (struct offset));
+	patch_seek (p2, at2);
+	offsets = xmalloc_as (ALLOC_HUNKS,
+			      offset_alloc * sizeof (struct offset));
 	orig_lines = new_lines = 0;
 	for (;;) {
-		if (getline (&line, &linelen, p2) == -1) {
+		if (patch_getline (p2, &line) == -1) {
 			if (this_offset) {
 				offsets = add_offset (first_linenum,
 						      this_offset,
@@ -1668,7 +2167,8 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 			if (read_atatline (line, &linenum, &orig_lines,
 					   NULL, &new_lines))
 				error (EXIT_FAILURE, 0,
-				       "line not understood: %s", line);
+				       "line not understood: %.*s",
+				       (int) strcspn (line, "\n"), line);
 
 			continue;
 		}
@@ -1725,24 +2225,24 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 			linenum++;
 	}
 
-	/* Now read the temporary file we wrote (and patched) back
-	 * into memory, into our 'intermediate' structure, in order to
-	 * modify it (ourselves!) using patch1. */
-	free_lines (intermediate.head);
-	intermediate.head = intermediate.tail = NULL;
-	f = fopen (tmpp3, "r");
-	if (!f)
-	    error (EXIT_FAILURE, errno, "error opening temporary file");
+	/* Now load the patched file into our 'intermediate'
+	 * structure, in order to modify it (ourselves!) using patch1.
+	 * The start and end images point into the old lines and
+	 * unline, so keep those until the diffs have been taken. */
+	end_lines = intermediate;
+	intermediate.lines = NULL;
+	intermediate.count = intermediate.after = intermediate.allocated = 0;
+	intermediate.shift = 0;
+	intermediate.text.blocks = NULL;
+	intermediate.text.next = NULL;
+	intermediate.text.left = 0;
+	intermediate.unline = xstrdup_as (ALLOC_LINES, end_lines.unline);
 
-	linenum = 0;
 	saw_first_offset = 0;
-	while (!feof (f)) {
-		ssize_t got;
-		linenum++;
-		got = getline (&line, &linelen, f);
-		if (got == -1)
-			break;
-		if (!strcmp (line, intermediate.unline)) {
+	for (linenum = 1; linenum <= end.count; linenum++) {
+		const struct text_line *l = &end.lines[linenum - 1];
+		if (l->length == strlen (end_lines.unline) &&
+		    !memcmp (l->line, end_lines.unline, l->length)) {
 			if (!saw_first_offset)
 				intermediate.first_offset = linenum + 1;
 			continue;
@@ -1753,23 +2253,22 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 			intermediate.first_offset = linenum;
 		}
 
-		add_line (&intermediate, line, (size_t) got, linenum);
+		add_line (&intermediate, l->line, l->length, linenum);
 	}
 
 	/* Modify it according to patch1, making sure to adjust for
 	 * offsets introduced in patch2. */
-	fsetpos (p1, &at1);
+	patch_seek (p1, at1);
 	this_offset = 0;
 	orig_lines = new_lines = 0;
 	for (;;) {
-		ssize_t got;
-		fgetpos (p1, &at1);
-		got = getline (&line, &linelen, p1);
+		at1 = patch_tell (p1);
+		got = patch_getline (p1, &line);
 		if (got == -1)
 			break;
 
 		if (!orig_lines && !new_lines && strncmp (line, "@@ ", 3)) {
-			fsetpos (p1, &at1);
+			patch_seek (p1, at1);
 			break;
 		}
 
@@ -1777,7 +2276,8 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 			if (read_atatline (line, NULL, &orig_lines,
 					   &linenum, &new_lines))
 				error (EXIT_FAILURE, 0,
-				       "line not understood: %s", line);
+				       "line not understood: %.*s",
+				       (int) strcspn (line, "\n"), line);
 
 			continue;
 		}
@@ -1797,7 +2297,8 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 				at += offset_at_line (linenum, offsets,
 						      num_offsets);
 				at += this_offset;
-				remove_line (&intermediate, line + 1, at);
+				remove_line (&intermediate, line + 1,
+					     (size_t) got - 1, at);
 				this_offset--;
 			}
 		} else if (line[0] == '-') {
@@ -1817,26 +2318,31 @@ flipdiff (FILE *p1, FILE *p2, FILE *flip1, FILE *flip2)
 			linenum++;
 	}
 
-	tmpfd = xmkstemp (tmpp2);
-	write_file (&intermediate, tmpfd);
+	render_file (&intermediate, &middle);
+	join_image_lines (&middle, &joined[1]);
 
-	/* Now tmpp1 is the start point, tmpp3 is the end point, and
-	 * tmpp2 is the mid-point once the diffs have been flipped.
-	 * So just take diffs and we're done. */
-	take_diff (tmpp1, tmpp2, header2, intermediate.unline, flip1);
-	take_diff (tmpp2, tmpp3, header1, intermediate.unline, flip2);
+	/* Now we have the start point, the end point, and the
+	 * mid-point once the diffs have been flipped.  So just take
+	 * diffs and we're done. */
+	take_diff (&start, &middle, header2, intermediate.unline, flip1);
+	take_diff (&middle, &end, header1, intermediate.unline, flip2);
 
-	free (line);
+	xfree_as (ALLOC_HEADER, header1[0]);
+	xfree_as (ALLOC_HEADER, header1[1]);
+	xfree_as (ALLOC_HEADER, header2[0]);
+	xfree_as (ALLOC_HEADER, header2[1]);
 	free_offsets (offsets);
-	fclose (f);
+	free_image (&start);
+	free_image (&middle);
+	free_image (&end);
+	filebuf_free (&joined[0]);
+	filebuf_free (&joined[1]);
+	filebuf_free (&joined[2]);
+	clear_lines_info (&intermediate);
+	clear_lines_info (&end_lines);
 
 	if (debug)
 		printf ("flipped\n");
-	else {
-		unlink (tmpp1);
-		unlink (tmpp2);
-		unlink (tmpp3);
-	}
 
 	return 0;
 }
@@ -1861,42 +2367,46 @@ no_patch (const char *f)
 }
 
 static int
-interdiff (FILE *p1, FILE *p2, const char *patch1, const char *patch2)
+interdiff (struct patch_reader *p1, struct patch_reader *p2,
+	   const char *patch1, const char *patch2)
 {
-	char *line = NULL;
-	size_t linelen = 0;
+	struct patch_parser parser;
+	struct patch_record rec;
 	int is_context = 0;
 	int patch_found = 0;
 	int file_is_empty = 1;
 	FILE *flip1 = NULL, *flip2 = NULL;
+	struct stats_timer timer;
+	int empty;
 
 	if (mode == mode_flip) {
 		flip1 = xtmpfile ();
 		flip2 = xtmpfile ();
 	}
 
-	if (index_patch2 (p2))
+	STATS_START (&timer);
+	empty = index_patch2 (p2, patch2);
+	STATS_STOP (&timer, STATS_PARSE);
+	if (empty)
 		no_patch (patch2);
 
 	/* Search for next file to patch */
-	while (!feof (p1)) {
+	patch_parser_init (&parser, p1);
+	while (patch_next_record (&parser, &rec) != PATCH_EOF) {
 		char *names[2];
 		char *p;
-		long pos, start_pos = ftell (p1);
-
-		if (line) {
-			free (line);
-			line = NULL;
-			linelen = 0;
-		}
-
-		if (getline (&line, &linelen, p1) == -1)
-			break;
+		long pos;
 
 		file_is_empty = 0;
 
-		if (strncmp (line, "--- ", 4)) {
-			is_context = !strncmp (line, "*** ", 4);
+		if (rec.type != PATCH_FILE) {
+			if (rec.type != PATCH_OTHER)
+				is_context = 0;
+			else if (strncmp (rec.line, "--- ", 4))
+				is_context = !strncmp (rec.line, "*** ", 4);
+			else if (is_context)
+				error (EXIT_FAILURE, 0,
+				       "I don't understand context diffs yet.");
 			continue;
 		}
 
@@ -1904,19 +2414,12 @@ interdiff (FILE *p1, FILE *p2, const char *patch1, const char *patch2)
 			error (EXIT_FAILURE, 0,
 			       "I don't understand context diffs yet.");
 
-		names[0] = filename_from_header (line + 4);
-
-		if (getline (&line, &linelen, p1) == -1)
-			break;
-
-		if (strncmp (line, "+++ ", 4))
-			continue;
+		names[0] = filename_from_header (rec.line + 4);
+		names[1] = filename_from_header (rec.line2 + 4);
 
-		names[1] = filename_from_header (line + 4);
-
-		p = xstrdup (best_name (2, names));
-		free (names[0]);
-		free (names[1]);
+		p = xstrdup_as (ALLOC_HEADER, best_name (2, names));
+		xfree_as (ALLOC_HEADER, names[0]);
+		xfree_as (ALLOC_HEADER, names[1]);
 		patch_found = 1;
 		
 		/* check if we need to process it and init context */
@@ -1925,28 +2428,46 @@ interdiff (FILE *p1, FILE *p2, const char *patch1, const char *patch2)
 			continue;
 		}
 
-		fseek (p1, start_pos, SEEK_SET);
-		pos = file_in_list (files_in_patch2, p);
-		if (pos == -1) {
-			output_patch1_only (p1,
-					    mode == mode_flip ? flip2 : stdout,
-					    mode != mode_inter);
+		pos = file_in_list (&files_in_patch2, p);
+		if (jobs > 1 && mode != mode_flip) {
+			/* Leave it to a worker thread.  The parser
+			 * skips the hunks for us. */
+			add_task (rec.offset, pos, 0);
 		} else {
-			fseek (p2, pos, SEEK_SET);
-			if (mode == mode_flip)
-				flipdiff (p1, p2, flip1, flip2);
-			else
-				output_delta (p1, p2, stdout);
+			size_t hunks = patch_tell (p1);
+
+			patch_seek (p1, rec.offset);
+			if (pos == -1) {
+				output_patch1_only (p1,
+						    mode == mode_flip ?
+						    flip2 : stdout,
+						    mode != mode_inter,
+						    max_context);
+			} else {
+				patch_seek (p2, pos);
+				if (mode == mode_flip)
+					flipdiff (p1, p2, flip1, flip2);
+				else
+					output_delta (p1, p2, max_context,
+						      stdout);
+			}
+
+			/* Go back and have the parser step over the
+			 * file's hunks, as it does for the workers, so
+			 * that they are counted the same way. */
+			patch_seek (p1, hunks);
 		}
 
 		add_to_list (&files_done, p, 0);
-                free (p);
+                xfree_as (ALLOC_HEADER, p);
 	}
 
 	if (!file_is_empty && !patch_found)
 		no_patch (patch1);
 
 	copy_residue (p2, mode == mode_flip ? flip1 : stdout);
+	if (tasks.count)
+		run_tasks (p1, p2, stdout);
 
 	if (mode == mode_flip) {
 		/* Now we flipped the two patches, show them. */
@@ -1969,13 +2490,11 @@ interdiff (FILE *p1, FILE *p2, const char *patch1, const char *patch2)
 	}
 
 	if (flip1)
-		fclose (flip1);
+		xtmpclose (flip1);
 	if (flip2)
-		fclose (flip2);
-	free_list (files_in_patch2);
-	free_list (files_done);
-	if (line)
-		free (line);
+		xtmpclose (flip2);
+	free_list (&files_in_patch2);
+	free_list (&files_done);
 	return 0;
 }
 
@@ -2003,7 +2522,9 @@ syntax (int err)
 "  -d PAT, --drop-context=PAT\n"
 "                  drop context on matching files\n"
 "  -z, --decompress\n"
-"                  decompress .gz and .bz2 files\n"
+"                  decompress gzip, bzip2, xz and zstd files\n"
+"  -j N, --jobs=N\n"
+"                  process up to N files at once\n"
 "  --interpolate   run as 'interdiff'\n"
 "  --combine       run as 'combinediff'\n"
 "  --flip          run as 'flipdiff'\n"
@@ -2011,7 +2532,9 @@ syntax (int err)
 "                  (interdiff) When a patch from patch1 is not in patch2,\n"
 "                  don't revert it\n"
 "  --in-place      (flipdiff) Write the output to the original input\n"
-"                  files\n";
+"                  files\n"
+"  --stats         report what was read and where the time went on\n"
+"                  standard error\n";
 
 	fprintf (err ? stderr : stdout, syntax_str, progname, progname);
 	exit (err);
@@ -2060,11 +2583,15 @@ get_mode_from_name (const char *argv0)
 int
 main (int argc, char *argv[])
 {
-	FILE *p1, *p2;
+	FILE *f1, *f2;
+	struct filebuf buf1, buf2;
+	struct patch_reader p1, p2;
+	struct stats_timer timer;
 	int num_diff_opts = 0;
 	int ret;
 
 	get_mode_from_name (argv[0]);
+	stats_init (0);
 	diff_opts[0] = '\0';
 	for (;;) {
 		static struct option long_options[] = {
@@ -2085,10 +2612,12 @@ main (int argc, char *argv[])
 			{"ignore-all-space", 0, 0, 'w'},
 			{"decompress", 0, 0, 'z'},
 			{"quiet", 0, 0, 'q'},
+			{"jobs", 1, 0, 'j'},
+			{"stats", 0, 0, 1000 + 'S'},
 			{0, 0, 0, 0}
 		};
 		char *end;
-		int c = getopt_long (argc, argv, "BU:bd:hip:qwz",
+		int c = getopt_long (argc, argv, "BU:bd:hij:p:qwz",
 				     long_options, NULL);
 		if (c == -1)
 			break;
@@ -2114,6 +2643,11 @@ main (int argc, char *argv[])
 			if (optarg == end)
 				syntax (1);
 			break;
+		case 'j':
+			jobs = strtoul (optarg, &end, 0);
+			if (optarg == end || !jobs)
+				syntax (1);
+			break;
 		case 'q':
 			human_readable = 0;
 			break;
@@ -2131,6 +2665,20 @@ main (int argc, char *argv[])
 				diff_opts[num_diff_opts++] = c;
 				diff_opts[num_diff_opts] = '\0';
 			}
+			switch (c) {
+			case 'B':
+				diff_flags |= TEXTDIFF_IGNORE_BLANK_LINES;
+				break;
+			case 'b':
+				diff_flags |= TEXTDIFF_IGNORE_SPACE_CHANGE;
+				break;
+			case 'i':
+				diff_flags |= TEXTDIFF_IGNORE_CASE;
+				break;
+			case 'w':
+				diff_flags |= TEXTDIFF_IGNORE_ALL_SPACE;
+				break;
+			}
 			break;
 		case 1000 + 'I':
 			set_interdiff ();
@@ -2152,6 +2700,9 @@ main (int argc, char *argv[])
 		case 1000 + 'D':
 			debug = 1;
 			break;
+		case 1000 + 'S':
+			stats_init (1);
+			break;
 		default:
 			syntax(1);
 		}
@@ -2164,23 +2715,40 @@ main (int argc, char *argv[])
 	if (optind + 2 != argc)
 		syntax (1);
 	
+	STATS_START (&timer);
 	if (unzip) {
-		p1 = xopen_unzip (argv[optind], "rb");
-		p2 = xopen_unzip (argv[optind + 1], "rb");
+		filebuf_read_unzip (&buf1, argv[optind]);
+		filebuf_read_unzip (&buf2, argv[optind + 1]);
 	} else {
 		if (strcmp (argv[optind], "-") == 0 && strcmp(argv[optind+1], "-") == 0)
 			error (EXIT_FAILURE, 0, "only one input file can come from stdin");
-		p1 = strcmp (argv[optind], "-") == 0 ? stdin : xopen (argv[optind], "rbm");
-		p2 = strcmp (argv[optind+1], "-") == 0 ? stdin : xopen (argv[optind + 1], "rbm");
+		f1 = strcmp (argv[optind], "-") == 0 ? stdin : xopen (argv[optind], "rbm");
+		f2 = strcmp (argv[optind+1], "-") == 0 ? stdin : xopen (argv[optind + 1], "rbm");
+		filebuf_read (&buf1, f1);
+		if (f1 != stdin)
+			fclose (f1);
+		filebuf_read (&buf2, f2);
+		if (f2 != stdin)
+			fclose (f2);
+	}
+	STATS_STOP (&timer, STATS_READ);
+	if (stats_enabled) {
+		stats_input (buf1.data, buf1.size);
+		stats_input (buf2.data, buf2.size);
 	}
 
-	p1 = convert_to_unified (p1, "rb", 1);
-	p2 = convert_to_unified (p2, "rb", 1);
+	/* Both patches are held in memory in unified format. */
+	STATS_START (&timer);
+	convert_to_unified (&buf1);
+	convert_to_unified (&buf2);
+	STATS_STOP (&timer, STATS_CONVERT);
+	patch_reader_init (&p1, buf1.data, buf1.size);
+	patch_reader_init (&p2, buf2.data, buf2.size);
 
-	ret = interdiff (p1, p2, argv[optind], argv[optind + 1]);
+	ret = interdiff (&p1, &p2, argv[optind], argv[optind + 1]);
 
-	fclose (p1);
-	fclose (p2);
+	filebuf_free (&buf1);
+	filebuf_free (&buf2);
 	patlist_free (&pat_drop_context);
 	return ret;
 }
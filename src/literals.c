@@ -0,0 +1,216 @@
+/*
+ * literals.c - search text for any of a set of fixed strings
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * A single string is looked for with memmem(), which the C library
+ * already does about as fast as it can be done.  Several strings are
+ * looked for all at once by an Aho-Corasick automaton, turned into a
+ * table with a row for each state and a column for each class of
+ * bytes (the bytes that occur in none of the strings are all one
+ * class), so that each byte of text costs one lookup.  Bytes that
+ * cannot start a match are skipped over quickly.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "literals.h"
+
+struct literal {
+	char *s;
+	size_t len;
+};
+
+struct literals {
+	struct literal *strings;
+	unsigned long count;
+	unsigned long allocated;
+	int empty;			/* the empty string is one of them */
+
+	unsigned short classes[256];	/* byte -> column */
+	unsigned char starts[256];	/* can this byte begin a match? */
+	unsigned int nclasses;
+	unsigned int *delta;		/* state x class -> state */
+	size_t *out;			/* length of a match ending here */
+};
+
+struct literals *literals_new (void)
+{
+	struct literals *set = xmalloc_as (ALLOC_REGEX, sizeof *set);
+	memset (set, 0, sizeof *set);
+	return set;
+}
+
+void literals_add (struct literals *set, const char *s, size_t len)
+{
+	if (!len) {
+		set->empty = 1;
+		return;
+	}
+
+	if (set->count == set->allocated) {
+		set->allocated = set->allocated ? 2 * set->allocated : 16;
+		set->strings = xrealloc_as (ALLOC_REGEX, set->strings,
+					    set->allocated *
+					    sizeof *set->strings);
+	}
+
+	set->strings[set->count].s = xstrndup_as (ALLOC_REGEX, s, len);
+	set->strings[set->count].len = len;
+	set->count++;
+}
+
+void literals_compile (struct literals *set)
+{
+	unsigned long i, nstates = 1, head, tail;
+	unsigned int *fail, *queue, state, c;
+	size_t total = 0, j;
+
+	if (set->empty || !set->count)
+		return;
+#ifdef HAVE_MEMMEM
+	if (set->count == 1)
+		return;
+#endif /* HAVE_MEMMEM */
+
+	/* Number the byte classes. */
+	set->nclasses = 1;
+	for (i = 0; i < set->count; i++) {
+		const unsigned char *s = (unsigned char *) set->strings[i].s;
+		for (j = 0; j < set->strings[i].len; j++)
+			if (!set->classes[s[j]])
+				set->classes[s[j]] = set->nclasses++;
+		set->starts[s[0]] = 1;
+		total += set->strings[i].len;
+	}
+
+	/* Build the trie of the strings. */
+	set->delta = xmalloc_as (ALLOC_REGEX, (total + 1) * set->nclasses *
+				 sizeof *set->delta);
+	memset (set->delta, 0, (total + 1) * set->nclasses *
+		sizeof *set->delta);
+	set->out = xmalloc_as (ALLOC_REGEX, (total + 1) * sizeof *set->out);
+	memset (set->out, 0, (total + 1) * sizeof *set->out);
+	for (i = 0; i < set->count; i++) {
+		const unsigned char *s = (unsigned char *) set->strings[i].s;
+		state = 0;
+		for (j = 0; j < set->strings[i].len; j++) {
+			unsigned int *next = &set->delta[(size_t) state *
+							 set->nclasses +
+							 set->classes[s[j]]];
+			if (!*next)
+				*next = nstates++;
+			state = *next;
+		}
+
+		if (!set->out[state])
+			set->out[state] = set->strings[i].len;
+	}
+
+	/* Work out where to go on a mismatch, breadth first, and fill
+	 * in the rest of the table from that.  Until a state has been
+	 * dealt with, the only transitions out of it are its children
+	 * in the trie. */
+	fail = xmalloc_as (ALLOC_REGEX, nstates * sizeof *fail);
+	queue = xmalloc_as (ALLOC_REGEX, nstates * sizeof *queue);
+	head = tail = 0;
+	for (c = 0; c < set->nclasses; c++) {
+		state = set->delta[c];
+		if (state) {
+			fail[state] = 0;
+			queue[tail++] = state;
+		}
+	}
+
+	while (head < tail) {
+		unsigned int from = queue[head++];
+		unsigned int *row = &set->delta[(size_t) from *
+						set->nclasses];
+		unsigned int *fail_row = &set->delta[(size_t) fail[from] *
+						     set->nclasses];
+
+		if (!set->out[from])
+			set->out[from] = set->out[fail[from]];
+
+		for (c = 0; c < set->nclasses; c++) {
+			if (row[c]) {
+				fail[row[c]] = fail_row[c];
+				queue[tail++] = row[c];
+			} else
+				row[c] = fail_row[c];
+		}
+	}
+
+	xfree_as (ALLOC_REGEX, queue);
+	xfree_as (ALLOC_REGEX, fail);
+}
+
+const char *literals_find (const struct literals *set, const char *text,
+			   size_t len)
+{
+	const unsigned char *p = (const unsigned char *) text;
+	const unsigned char *end = p + len;
+	unsigned int state = 0;
+
+	if (set->empty)
+		return text;
+
+	if (!set->delta) {
+		if (!set->count)
+			return NULL;
+#ifdef HAVE_MEMMEM
+		return memmem (text, len, set->strings[0].s,
+			       set->strings[0].len);
+#endif /* HAVE_MEMMEM */
+	}
+
+	while (p < end) {
+		if (!state) {
+			while (!set->starts[*p])
+				if (++p == end)
+					return NULL;
+		}
+
+		state = set->delta[(size_t) state * set->nclasses +
+				   set->classes[*p++]];
+		if (set->out[state])
+			return (const char *) p - set->out[state];
+	}
+
+	return NULL;
+}
+
+void literals_free (struct literals *set)
+{
+	unsigned long i;
+
+	for (i = 0; i < set->count; i++)
+		xfree_as (ALLOC_REGEX, set->strings[i].s);
+	xfree_as (ALLOC_REGEX, set->strings);
+	xfree_as (ALLOC_REGEX, set->delta);
+	xfree_as (ALLOC_REGEX, set->out);
+	xfree_as (ALLOC_REGEX, set);
+}
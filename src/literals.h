@@ -0,0 +1,36 @@
+/*
+ * literals.h - search text for any of a set of fixed strings - header
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+struct literals;
+
+struct literals *literals_new (void);
+void literals_add (struct literals *set, const char *s, size_t len);
+
+/* Get ready to search: call this after the last literals_add() and
+ * before the first literals_find().  After that the set can be
+ * searched from several threads at once. */
+void literals_compile (struct literals *set);
+
+/* Return the start of the first match to end in the len bytes of
+ * text, or NULL if none of the strings occurs there. */
+const char *literals_find (const struct literals *set, const char *text,
+			   size_t len);
+
+void literals_free (struct literals *set);
@@ -0,0 +1,422 @@
+/*
+ * pidx.c - index of where each file's diff is in a patch
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * An index file is a header, then a record for each file, then one
+ * for each hunk, then the files' names, each followed by a NUL byte.
+ * Every other value is stored as 8 bytes, least significant first, so
+ * the records can be read straight out of the mapped file by number.
+ *
+ * The header records the patch's size and modification time, and a
+ * hash of its first and last 64KiB.  An index that doesn't agree with
+ * the patch about all of these is not used.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#ifdef HAVE_ERROR_H
+# include <error.h>
+#endif /* HAVE_ERROR_H */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif /* HAVE_SYS_TYPES_H */
+#include <sys/stat.h>
+
+#include "util.h"
+#include "pidx.h"
+
+#define PIDX_MAGIC "PATCHIDX"
+#define PIDX_VERSION 2
+
+/* How much of each end of the patch is hashed. */
+#define HASH_SAMPLE (64 * 1024)
+
+enum {
+	HEAD_MAGIC,
+	HEAD_VERSION,
+	HEAD_SIZE,
+	HEAD_MTIME,
+	HEAD_MTIME_NSEC,
+	HEAD_HASH,
+	HEAD_LINES,
+	HEAD_FILES,
+	HEAD_HUNKS,
+	HEAD_NAMES,		/* size of the names */
+	HEAD_FIELDS
+};
+
+enum {
+	FILE_OFFSET,
+	FILE_LINENUM,
+	FILE_NAMES,
+	FILE_END,
+	FILE_CONTEXT,
+	FILE_FIRST_HUNK,
+	FILE_HUNKS,
+	FILE_NAME,		/* where its name is among the names */
+	FILE_FIELDS
+};
+
+enum {
+	HUNK_OFFSET,
+	HUNK_LINENUM,
+	HUNK_ORIG_OFFSET,
+	HUNK_ORIG_COUNT,
+	HUNK_NEW_OFFSET,
+	HUNK_NEW_COUNT,
+	HUNK_FIELDS
+};
+
+struct pidx_builder {
+	struct filebuf files;
+	struct filebuf hunks;
+	struct filebuf names;
+	unsigned long num_files;
+	unsigned long num_hunks;
+};
+
+static unsigned long long get_field (const char *record, int field)
+{
+	const unsigned char *p = (const unsigned char *) record + 8 * field;
+	unsigned long long value = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		value = (value << 8) | p[i];
+
+	return value;
+}
+
+static void set_field (char *record, int field, unsigned long long value)
+{
+	char *p = record + 8 * field;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		p[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/* FNV-1a, over as much of each end of the patch as is sampled. */
+static unsigned long long patch_hash (const char *data, size_t size)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	size_t head = size < HASH_SAMPLE ? size : HASH_SAMPLE;
+	size_t tail = size - head < HASH_SAMPLE ? head : size - HASH_SAMPLE;
+	size_t i;
+
+	for (i = 0; i < head; i++)
+		hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+	for (i = tail; i < size; i++)
+		hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+static unsigned long long mtime_nsec (const struct stat *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	return st->st_mtim.tv_nsec;
+#else
+	return 0;
+#endif /* HAVE_STRUCT_STAT_ST_MTIM */
+}
+
+static char *index_name (const char *patchname)
+{
+	size_t len = strlen (patchname);
+	char *name = xmalloc (len + sizeof (".pidx"));
+
+	memcpy (name, patchname, len);
+	strcpy (name + len, ".pidx");
+	return name;
+}
+
+/* Check that everything the records point to is where it should be,
+ * so that a damaged index can do no worse than be ignored. */
+static int records_valid (const struct pidx *idx, size_t size,
+			  size_t names_size)
+{
+	unsigned long i, hunk = 0;
+	unsigned long long last = 0;
+
+	if (names_size && idx->names[names_size - 1] != '\0')
+		return 0;
+
+	for (i = 0; i < idx->num_files; i++) {
+		const char *r = idx->files + 8 * FILE_FIELDS * i;
+		unsigned long long offset = get_field (r, FILE_OFFSET);
+		unsigned long long names = get_field (r, FILE_NAMES);
+		unsigned long long end = get_field (r, FILE_END);
+		unsigned long long first = get_field (r, FILE_FIRST_HUNK);
+		unsigned long long count = get_field (r, FILE_HUNKS);
+
+		if (offset < last || names < offset || names >= size ||
+		    end <= names || end > size ||
+		    get_field (r, FILE_NAME) >= names_size ||
+		    first != hunk || count > idx->num_hunks - hunk)
+			return 0;
+
+		/* Its hunks come in order, between its header and its
+		 * end. */
+		last = names;
+		for (; hunk < first + count; hunk++) {
+			const char *h = idx->hunks + 8 * HUNK_FIELDS * hunk;
+			unsigned long long at = get_field (h, HUNK_OFFSET);
+
+			if (at <= last || at >= end)
+				return 0;
+			last = at;
+		}
+
+		last = end;
+	}
+
+	return hunk == idx->num_hunks;
+}
+
+int pidx_matches (const struct pidx *idx, const struct stat *st)
+{
+	const char *head = idx->buf.data;
+
+	return (get_field (head, HEAD_SIZE) ==
+		(unsigned long long) st->st_size &&
+		get_field (head, HEAD_MTIME) ==
+		(unsigned long long) st->st_mtime &&
+		get_field (head, HEAD_MTIME_NSEC) == mtime_nsec (st));
+}
+
+static int index_valid (struct pidx *idx, const struct stat *st,
+			const char *data, size_t size)
+{
+	const char *head = idx->buf.data;
+	unsigned long long files, hunks, names;
+
+	if (idx->buf.size < 8 * HEAD_FIELDS ||
+	    memcmp (head, PIDX_MAGIC, 8) ||
+	    get_field (head, HEAD_VERSION) != PIDX_VERSION ||
+	    get_field (head, HEAD_SIZE) != size ||
+	    !pidx_matches (idx, st) ||
+	    get_field (head, HEAD_HASH) != patch_hash (data, size))
+		return 0;
+
+	/* Make sure the sizes add up before relying on them. */
+	files = get_field (head, HEAD_FILES);
+	hunks = get_field (head, HEAD_HUNKS);
+	names = get_field (head, HEAD_NAMES);
+	if (files > idx->buf.size / (8 * FILE_FIELDS) ||
+	    hunks > idx->buf.size / (8 * HUNK_FIELDS) ||
+	    idx->buf.size != (8 * HEAD_FIELDS + 8 * FILE_FIELDS * files +
+			      8 * HUNK_FIELDS * hunks + names))
+		return 0;
+
+	idx->lines = get_field (head, HEAD_LINES);
+	idx->num_files = files;
+	idx->num_hunks = hunks;
+	idx->files = head + 8 * HEAD_FIELDS;
+	idx->hunks = idx->files + 8 * FILE_FIELDS * files;
+	idx->names = idx->hunks + 8 * HUNK_FIELDS * hunks;
+	return records_valid (idx, size, names);
+}
+
+struct pidx *pidx_open (const char *patchname, const char *data,
+			size_t size)
+{
+	struct pidx *idx;
+	struct stat st;
+	char *name;
+	FILE *f;
+
+	if (stat (patchname, &st) || !S_ISREG (st.st_mode))
+		return NULL;
+
+	name = index_name (patchname);
+	f = fopen (name, "rb");
+	xfree (name);
+	if (!f)
+		return NULL;
+
+	idx = xmalloc (sizeof (struct pidx));
+	filebuf_read (&idx->buf, f);
+	fclose (f);
+
+	if (!index_valid (idx, &st, data, size)) {
+		pidx_close (idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+void pidx_get_file (const struct pidx *idx, unsigned long n,
+		    struct pidx_file *file)
+{
+	const char *r = idx->files + 8 * FILE_FIELDS * n;
+
+	file->offset = get_field (r, FILE_OFFSET);
+	file->linenum = get_field (r, FILE_LINENUM);
+	file->names = get_field (r, FILE_NAMES);
+	file->end = get_field (r, FILE_END);
+	file->context = get_field (r, FILE_CONTEXT);
+	file->first_hunk = get_field (r, FILE_FIRST_HUNK);
+	file->num_hunks = get_field (r, FILE_HUNKS);
+	file->name = idx->names + get_field (r, FILE_NAME);
+}
+
+void pidx_get_hunk (const struct pidx *idx, unsigned long n,
+		    struct pidx_hunk *hunk)
+{
+	const char *r = idx->hunks + 8 * HUNK_FIELDS * n;
+
+	hunk->offset = get_field (r, HUNK_OFFSET);
+	hunk->linenum = get_field (r, HUNK_LINENUM);
+	hunk->orig_offset = get_field (r, HUNK_ORIG_OFFSET);
+	hunk->orig_count = get_field (r, HUNK_ORIG_COUNT);
+	hunk->new_offset = get_field (r, HUNK_NEW_OFFSET);
+	hunk->new_count = get_field (r, HUNK_NEW_COUNT);
+}
+
+void pidx_close (struct pidx *idx)
+{
+	filebuf_free (&idx->buf);
+	xfree (idx);
+}
+
+struct pidx_builder *pidx_new (void)
+{
+	struct pidx_builder *b = xmalloc (sizeof (struct pidx_builder));
+
+	filebuf_init (&b->files);
+	filebuf_init (&b->hunks);
+	filebuf_init (&b->names);
+	b->num_files = 0;
+	b->num_hunks = 0;
+	return b;
+}
+
+void pidx_add_file (struct pidx_builder *b, const struct pidx_file *file)
+{
+	char r[8 * FILE_FIELDS];
+
+	set_field (r, FILE_OFFSET, file->offset);
+	set_field (r, FILE_LINENUM, file->linenum);
+	set_field (r, FILE_NAMES, file->names);
+	set_field (r, FILE_END, file->names + 1);
+	set_field (r, FILE_CONTEXT, file->context);
+	set_field (r, FILE_FIRST_HUNK, b->num_hunks);
+	set_field (r, FILE_HUNKS, 0);
+	set_field (r, FILE_NAME, b->names.size);
+	filebuf_append (&b->files, r, sizeof (r));
+	filebuf_append (&b->names, file->name, strlen (file->name) + 1);
+	b->num_files++;
+}
+
+void pidx_add_hunk (struct pidx_builder *b, const struct pidx_hunk *hunk)
+{
+	char r[8 * HUNK_FIELDS];
+	char *file;
+
+	if (!b->num_files)
+		return;
+
+	set_field (r, HUNK_OFFSET, hunk->offset);
+	set_field (r, HUNK_LINENUM, hunk->linenum);
+	set_field (r, HUNK_ORIG_OFFSET, hunk->orig_offset);
+	set_field (r, HUNK_ORIG_COUNT, hunk->orig_count);
+	set_field (r, HUNK_NEW_OFFSET, hunk->new_offset);
+	set_field (r, HUNK_NEW_COUNT, hunk->new_count);
+	filebuf_append (&b->hunks, r, sizeof (r));
+	b->num_hunks++;
+
+	file = b->files.data + 8 * FILE_FIELDS * (b->num_files - 1);
+	set_field (file, FILE_HUNKS, get_field (file, FILE_HUNKS) + 1);
+}
+
+void pidx_end_file (struct pidx_builder *b, size_t end)
+{
+	if (b->num_files)
+		set_field (b->files.data + 8 * FILE_FIELDS * (b->num_files - 1),
+			   FILE_END, end);
+}
+
+void pidx_write (struct pidx_builder *b, const char *patchname,
+		 const struct stat *st, const char *data, size_t size,
+		 unsigned long lines)
+{
+	char head[8 * HEAD_FIELDS];
+	char *name = index_name (patchname);
+	char *tmpname = xmalloc (strlen (name) + 32);
+	FILE *f;
+
+	memcpy (head, PIDX_MAGIC, 8);
+	set_field (head, HEAD_VERSION, PIDX_VERSION);
+	set_field (head, HEAD_SIZE, size);
+	set_field (head, HEAD_MTIME, st->st_mtime);
+	set_field (head, HEAD_MTIME_NSEC, mtime_nsec (st));
+	set_field (head, HEAD_HASH, patch_hash (data, size));
+	set_field (head, HEAD_LINES, lines);
+	set_field (head, HEAD_FILES, b->num_files);
+	set_field (head, HEAD_HUNKS, b->num_hunks);
+	set_field (head, HEAD_NAMES, b->names.size);
+
+	/* Write it beside the old one and then replace it, so that
+	 * nobody ever sees half an index. */
+	sprintf (tmpname, "%s.%ld", name, (long) getpid ());
+	f = fopen (tmpname, "wb");
+	if (!f)
+		error (EXIT_FAILURE, errno, "%s", tmpname);
+
+	fwrite (head, sizeof (head), 1, f);
+	fwrite (b->files.data, 1, b->files.size, f);
+	fwrite (b->hunks.data, 1, b->hunks.size, f);
+	fwrite (b->names.data, 1, b->names.size, f);
+	if (ferror (f) | fclose (f)) {
+		int err = errno;
+		unlink (tmpname);
+		error (EXIT_FAILURE, err, "%s", tmpname);
+	}
+
+	if (rename (tmpname, name)) {
+		int err = errno;
+		unlink (tmpname);
+		error (EXIT_FAILURE, err, "%s", name);
+	}
+
+	xfree (tmpname);
+	xfree (name);
+}
+
+void pidx_free (struct pidx_builder *b)
+{
+	filebuf_free (&b->files);
+	filebuf_free (&b->hunks);
+	filebuf_free (&b->names);
+	xfree (b);
+}
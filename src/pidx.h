@@ -0,0 +1,83 @@
+/*
+ * pidx.h - index of where each file's diff is in a patch - header
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+struct stat;
+
+/* One file's diff.  Offsets are in bytes from the start of the patch,
+ * and line numbers count its first line as line 1. */
+struct pidx_file {
+	size_t offset;		/* the first line of its header */
+	unsigned long linenum;
+	size_t names;		/* the "--- " line ("*** " for context) */
+	size_t end;		/* just after its last hunk */
+	int context;		/* is it a context diff? */
+	unsigned long first_hunk;
+	unsigned long num_hunks;	/* only counted for unified diffs */
+	const char *name;	/* as best_name() chose it */
+};
+
+/* One hunk of a unified diff. */
+struct pidx_hunk {
+	size_t offset;		/* the "@@ " line */
+	unsigned long linenum;
+	unsigned long orig_offset, orig_count;
+	unsigned long new_offset, new_count;
+};
+
+/* An index read from disk. */
+struct pidx {
+	struct filebuf buf;
+	unsigned long lines;	/* how many lines the patch has */
+	unsigned long num_files;
+	unsigned long num_hunks;
+	const char *files;	/* where the records are in buf */
+	const char *hunks;
+	const char *names;
+};
+
+/* The index for the named patch is kept in a file with ".pidx"
+ * added to its name.  Return it if it is there and was made from
+ * exactly these contents, otherwise NULL. */
+struct pidx *pidx_open (const char *patchname, const char *data,
+			size_t size);
+/* Is st the status of the file the index was made from? */
+int pidx_matches (const struct pidx *idx, const struct stat *st);
+void pidx_get_file (const struct pidx *idx, unsigned long n,
+		    struct pidx_file *file);
+void pidx_get_hunk (const struct pidx *idx, unsigned long n,
+		    struct pidx_hunk *hunk);
+void pidx_close (struct pidx *idx);
+
+/* An index being made.  Files and hunks are added in order, each hunk
+ * belonging to the file added last, and each file is ended once its
+ * hunks have been added. */
+struct pidx_builder;
+
+struct pidx_builder *pidx_new (void);
+void pidx_add_file (struct pidx_builder *b, const struct pidx_file *file);
+void pidx_add_hunk (struct pidx_builder *b, const struct pidx_hunk *hunk);
+void pidx_end_file (struct pidx_builder *b, size_t end);
+
+/* Write out the index for the named patch, whose contents are data and
+ * whose status (taken before reading it) is st. */
+void pidx_write (struct pidx_builder *b, const char *patchname,
+		 const struct stat *st, const char *data, size_t size,
+		 unsigned long lines);
+void pidx_free (struct pidx_builder *b);
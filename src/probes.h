@@ -0,0 +1,61 @@
+/*
+ * probes.h - static tracepoints for bpftrace, perf and systemtap
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * Each probe is a single no-op instruction, and a note saying where it
+ * is, so they cost nothing until a tracer attaches, for instance with
+ *
+ *	bpftrace -e 'usdt:/usr/bin/filterdiff:patchutils:file__start
+ *		{ printf ("%s\n", str (arg1)); }'
+ *
+ * They are built in when configure finds a <sys/sdt.h> that puts
+ * them in the .note.stapsdt section, unless it is given
+ * --disable-probes.  Otherwise they compile to nothing, and
+ * their arguments are not evaluated.
+ *
+ * filterdiff (also for files taken from a .pidx index without reading
+ * them):
+ *	file__start (file number, name, line number)
+ *	file__end (file number, name, whether it matched)
+ *	hunk__start (file number, hunk number, line number)
+ *
+ * interdiff:
+ *	create__orig__start (reverted?)
+ *	create__orig__end (lines known)
+ *	apply__patch__start (reverted?)
+ *	apply__patch__end (failed?, lines in the result)
+ *	take__diff__start (lines in the first file, lines in the second)
+ *	take__diff__end (whether they differed)
+ *	trim__context__start ()
+ *	trim__context__end ()
+ */
+
+#ifdef ENABLE_PROBES
+# include <sys/sdt.h>
+# define PROBE(name) DTRACE_PROBE (patchutils, name)
+# define PROBE1(name, a) DTRACE_PROBE1 (patchutils, name, a)
+# define PROBE2(name, a, b) DTRACE_PROBE2 (patchutils, name, a, b)
+# define PROBE3(name, a, b, c) DTRACE_PROBE3 (patchutils, name, a, b, c)
+#else
+# define PROBE(name) do { } while (0)
+# define PROBE1(name, a) do { } while (0)
+# define PROBE2(name, a, b) do { } while (0)
+# define PROBE3(name, a, b, c) do { } while (0)
+#endif /* ENABLE_PROBES */
@@ -43,6 +43,7 @@
 #endif /* HAVE_SYS_WAIT_H */
 
 #include "diff.h"
+#include "stats.h"
 #include "util.h"
 
 #ifndef DIFF
@@ -52,14 +53,16 @@
 struct file_info
 {
 	const char *orig_file;
+	size_t orig_file_len;
 	const char *new_file;
+	size_t new_file_len;
 	int info_written;
 	int info_pending;
 };
 
 struct hunk 
 {
-	fpos_t filepos;
+	size_t filepos;
 	struct file_info *info;
 	unsigned long line_in_diff;
 	unsigned long num_lines;
@@ -71,23 +74,43 @@ struct hunk
 	int discard_offset;
 };
 
+/* Write the '--- '/'+++ ' lines for a group of hunks. */
+static void write_info (struct file_info *info, FILE *out)
+{
+	fwrite (info->orig_file, info->orig_file_len, 1, out);
+	fwrite (info->new_file, info->new_file_len, 1, out);
+	info->info_written = 1;
+}
+
+/* Copy the whole of a temporary file to out. */
+static void copy_file (FILE *in, FILE *out)
+{
+	char buffer[4096];
+	size_t got;
+
+	rewind (in);
+	while ((got = fread (buffer, 1, sizeof (buffer), in)) > 0)
+		fwrite (buffer, 1, got, out);
+}
+
 /* Copy hunk from in to out with no modifications.
  * @@ line has already been read.
  * orig_lines: original line count
  * new_lines: new line count */
-static unsigned long copy_hunk (FILE *in, FILE *out,
+static unsigned long copy_hunk (struct patch_reader *in, FILE *out,
 				unsigned long orig_lines,
 				unsigned long new_lines)
 {
 	int newline = 1;
-	fpos_t pos;
-	char *line = NULL;
-	size_t linelen = 0;
+	size_t pos = patch_tell (in);
+	const char *line;
+	ssize_t got;
 	unsigned long count = 0;
 
 	while (orig_lines || new_lines || newline) {
-		fgetpos (in, &pos);
-		if (getline (&line, &linelen, in) == -1)
+		pos = patch_tell (in);
+		got = patch_getline (in, &line);
+		if (got == -1)
 			break;
 
 		if (!orig_lines && !new_lines &&
@@ -96,7 +119,7 @@ static unsigned long copy_hunk (FILE *in, FILE *out,
 
 		count++;
 
-		fputs (line, out);
+		fwrite (line, (size_t) got, 1, out);
 		switch (line[0]) {
 		case ' ':
 			if (new_lines) new_lines--;
@@ -114,34 +137,35 @@ static unsigned long copy_hunk (FILE *in, FILE *out,
 
 	if (newline)
 		/* Back up a line. */
-		fsetpos (in, &pos);
+		patch_seek (in, pos);
 
 	return count;
 }
 
 /* Copy hunk from in to out, adjusting offsets by line_offset. */
-static unsigned long adjust_offsets_and_copy (long *offset, FILE *in,
+static unsigned long adjust_offsets_and_copy (long *offset,
+					      struct patch_reader *in,
 					      FILE *out)
 {
-	char *line = NULL;
-	size_t linelen = 0;
+	const char *line;
+	ssize_t got;
 	unsigned long orig_offset, orig_lines, new_offset, new_lines;
 	unsigned long count = 0;
-	char *trailing;
+	const char *trailing;
 
-	if (getline (&line, &linelen, in) == -1)
+	if ((got = patch_getline (in, &line)) == -1)
 		goto out;
 	count++;
 
 	if (!strncmp (line, "--- ", 4)) {
 		/* This is the first hunk of a group.  Copy the
 		 * file info. */
-		fputs (line, out);
-		if (getline (&line, &linelen, in) == -1)
+		fwrite (line, (size_t) got, 1, out);
+		if ((got = patch_getline (in, &line)) == -1)
 			goto out;
 		count++;
-		fputs (line, out);
-		if (getline (&line, &linelen, in) == -1)
+		fwrite (line, (size_t) got, 1, out);
+		if ((got = patch_getline (in, &line)) == -1)
 			goto out;
 		count++;
 
@@ -150,10 +174,9 @@ static unsigned long adjust_offsets_and_copy (long *offset, FILE *in,
 	}
 
 	if (read_atatline (line, &orig_offset, &orig_lines,
-			   &new_offset, &new_lines)) {
-		line[strlen (line) - 1] = '\0';
-		error (EXIT_FAILURE, 0, "Line not understood: %s", line);
-	}
+			   &new_offset, &new_lines))
+		error (EXIT_FAILURE, 0, "Line not understood: %.*s",
+		       (int) strcspn (line, "\n"), line);
 
 	/* Find the part after "@@...@@". */
 	trailing = strchr (line, '+');
@@ -169,8 +192,8 @@ static unsigned long adjust_offsets_and_copy (long *offset, FILE *in,
 	fprintf (out, " +%lu", new_offset + *offset);
 	if (new_lines != 1)
 		fprintf (out, ",%lu", new_lines);
-	fprintf (out, " @@%s", trailing);
-	free (line);
+	fputs (" @@", out);
+	fwrite (trailing, (size_t) (line + got - trailing), 1, out);
 
 	/* Copy remaining lines of hunk */
 	count += copy_hunk (in, out, orig_lines, new_lines);
@@ -180,26 +203,25 @@ out:
 }
 
 /* Copy n lines from in to out. */
-static unsigned long copy_lines (FILE *in, FILE *out, unsigned long n)
+static unsigned long copy_lines (struct patch_reader *in, FILE *out,
+				 unsigned long n)
 {
-	char *line = NULL;
-	size_t linelen = 0;
+	const char *line;
+	ssize_t got;
 	unsigned long count = 0;
 	while (n--) {
-		if (getline (&line, &linelen, in) == -1)
+		if ((got = patch_getline (in, &line)) == -1)
 			break;
 		count++;
-		fputs (line, out);
+		fwrite (line, (size_t) got, 1, out);
 	}
-	if (line)
-		free (line);
 	return count;
 }
 
 /* Copy trailing non-diff lines in hunk from in to out.
  * done: number of lines of hunk already copied. */
-static void copy_trailing (struct hunk *hunk, FILE *in, FILE *out,
-			   unsigned long done)
+static void copy_trailing (struct hunk *hunk, struct patch_reader *in,
+			   FILE *out, unsigned long done)
 {
 	if (hunk->next) {
 		/* Copy trailing non-diff text. */
@@ -224,37 +246,37 @@ static void copy_trailing (struct hunk *hunk, FILE *in, FILE *out,
  * line_offset: offset adjustment to apply.
  * is_first: zero unless this is the first hunk in the file. */
 static void copy_to (struct hunk *from, struct hunk *upto,
-		     long *line_offset, FILE *in, FILE *out, int is_first)
+		     long *line_offset, struct patch_reader *in, FILE *out,
+		     int is_first)
 {
 	if (!is_first && from && from->info && !from->info->info_written &&
-	    from->info->info_pending) {
-		fputs (from->info->orig_file, out);
-		fputs (from->info->new_file, out);
-		from->info->info_written = 1;
-	}
+	    from->info->info_pending)
+		write_info (from->info, out);
 
 	if (is_first && from) {
 		/* Copy leading non-diff text. */
-		fseek (in, 0, SEEK_SET);
+		patch_seek (in, 0);
 		copy_lines (in, out, from->line_in_diff - 1);
 	}
 
 	for (; from && from != upto; from = from->next) {
 		unsigned long count;
-		fsetpos (in, &from->filepos);
+		patch_seek (in, from->filepos);
 		count = adjust_offsets_and_copy (line_offset, in, out);
 		copy_trailing (from, in, out, count);
 	}
 }
 
 /* Deal with an added hunk. */
-static long added_hunk (const char *meta, long offset, FILE *modify, FILE *t,
+static long added_hunk (const char *meta, long offset,
+			struct patch_reader *modify, FILE *t,
 			unsigned long morig_count, unsigned long mnew_count)
 {
 	long this_offset = 0;
-	char *line = NULL;
-	size_t linelen = 0;
-	char *p = strchr (meta, '-'), *q;
+	const char *line;
+	ssize_t got;
+	const char *p = meta + strcspn (meta, "-\n");
+	char *q = NULL;
 	unsigned long orig_offset = 0, new_offset;
 	unsigned long orig_count = 0, new_count = 0;
 	FILE *newhunk = xtmpfile ();
@@ -262,20 +284,18 @@ static long added_hunk (const char *meta, long offset, FILE *modify, FILE *t,
 	if (!newhunk)
 		error (EXIT_FAILURE, errno, "Couldn't create temporary file");
 
-	if (p) {
+	if (*p == '-') {
 		p++;
 		orig_offset = strtoul (p, &q, 10);
 	}
 
-	if (!p || p == q) {
-		if (p)
-			p[strlen (p) - 1] = '\0';
+	if (p == q || !q)
 		error (EXIT_FAILURE, 0,
-		       "Hunk addition requires original line: %s", meta);
-	}
+		       "Hunk addition requires original line: %.*s",
+		       (int) strcspn (meta, "\n"), meta);
 
 	while (morig_count || mnew_count) {
-		if (getline (&line, &linelen, modify) == -1)
+		if ((got = patch_getline (modify, &line)) == -1)
 			break;
 
 		if (line[0] != '+')
@@ -302,7 +322,7 @@ static long added_hunk (const char *meta, long offset, FILE *modify, FILE *t,
 			       "Multiple added hunks not supported");
 		}
 
-		fputs (line + 1, newhunk);
+		fwrite (line + 1, (size_t) got - 1, 1, newhunk);
 	}
 
 	new_offset = orig_offset + offset;
@@ -318,50 +338,43 @@ static long added_hunk (const char *meta, long offset, FILE *modify, FILE *t,
 		fprintf (t, ",%lu", new_count);
 	fprintf (t, " @@\n");
 
-	rewind (newhunk);
-	while (copy_lines (newhunk, t, 100));
-	fclose (newhunk);
-
-	if (line)
-		free (line);
+	copy_file (newhunk, t);
+	xtmpclose (newhunk);
 
 	return this_offset;
 }
 
 /* Deal with a removed hunk. */
-static long removed_hunk (const char *meta, FILE *modify, FILE *t,
-			  struct hunk **hunkp, unsigned long morig_count,
+static long removed_hunk (const char *meta, struct patch_reader *modify,
+			  FILE *t, struct hunk **hunkp,
+			  unsigned long morig_count,
 			  unsigned long mnew_count, unsigned long *replaced)
 {
 	struct hunk *hunk = *hunkp;
 	long this_offset = 0;
-	char *line = NULL;
-	size_t linelen = 0;
+	const char *line;
+	ssize_t got;
 	unsigned long orig_offset, new_offset;
 	unsigned long orig_count, new_count;
-	int r;
 
 	*replaced = 0;
 	if (read_atatline (meta, &orig_offset, &orig_count,
 			   &new_offset, &new_count))
 		goto out;
 
-	if (getline (&line, &linelen, modify) == -1)
+	if ((got = patch_getline (modify, &line)) == -1)
 		goto out;
 
 	if (line[0] == '+' && line[1] == '@') {
 		/* Minimally correct modified @@ banners. */
 		unsigned long oo, no;
-		char *trailing;
+		const char *trailing;
 		if (read_atatline (line + 1, &oo, NULL, &no, NULL))
 			goto out;
 
 		/* Display a file name banner. */
-		if (hunk->info && !hunk->info->info_written) {
-			fputs (hunk->info->orig_file, t);
-			fputs (hunk->info->new_file, t);
-			hunk->info->info_written = 1;
-		}
+		if (hunk->info && !hunk->info->info_written)
+			write_info (hunk->info, t);
 
 		trailing = strchr (line + 1, '+');
 		trailing += strcspn (trailing, " \n");
@@ -379,7 +392,8 @@ static long removed_hunk (const char *meta, FILE *modify, FILE *t,
 		fprintf (t, " +%lu", no);
 		if (new_count != 1)
 			fprintf (t, ",%lu", new_count);
-		fprintf (t, " @@%s", trailing);
+		fputs (" @@", t);
+		fwrite (trailing, (size_t) (line + got - trailing), 1, t);
 		goto out;
 	}
 
@@ -408,14 +422,15 @@ static long removed_hunk (const char *meta, FILE *modify, FILE *t,
 				break;
 			default:
 				error (EXIT_FAILURE, 0,
-				       "Garbled input: %s", line + 1);
+				       "Garbled input: %.*s",
+				       (int) got - 1, line + 1);
 			}
 
 			if (!--morig_count)
 				break;
 
-			r = getline (&line, &linelen, modify);
-			assert (r != -1);
+			got = patch_getline (modify, &line);
+			assert (got != -1);
 		}
 
 		if (morig_count) {
@@ -432,16 +447,13 @@ static long removed_hunk (const char *meta, FILE *modify, FILE *t,
 				hunk->info->info_pending = 1;
 			*hunkp = hunk;
 
-			r = getline (&line, &linelen, modify);
-			assert (r != -1);
+			got = patch_getline (modify, &line);
+			assert (got != -1);
 			morig_count--;
 		}
 	}
 
  out:
-	if (line)
-		free (line);
-
 	return this_offset;
 
  only_whole:
@@ -456,7 +468,8 @@ static long removed_hunk (const char *meta, FILE *modify, FILE *t,
  * modify: diff output that applies to this hunk
  * original: original diff */
 static long show_modified_hunk (struct hunk **hunkp, long line_offset,
-				FILE *modify, FILE *original, FILE *out)
+				struct patch_reader *modify,
+				struct patch_reader *original, FILE *out)
 {
 	struct hunk *hunk = *hunkp;
 	long this_offset = 0;
@@ -464,28 +477,27 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 	unsigned long calc_new_offset, calc_new_count;
 	unsigned long orig_offset, orig_count, new_offset, new_count;
 	unsigned long morig_offset, morig_count, mnew_offset, mnew_count;
-	char *line = NULL;
-	size_t linelen = 0;
+	const char *line;
+	ssize_t got;
 	FILE *t = xtmpfile ();
 	int t_written_to = 0;
 	unsigned long i, at = 1;
 	unsigned long replaced, unaltered;
-	char *trailing;
+	const char *trailing;
+	size_t trailing_len;
 	int r;
 
 	if (!t)
 		error (EXIT_FAILURE, errno, "Couldn't open temporary file");
 
-	rewind (modify);
-
-	fsetpos (original, &hunk->filepos);
-	r = getline (&line, &linelen, original);
-	assert (r != -1);
+	patch_seek (original, hunk->filepos);
+	got = patch_getline (original, &line);
+	assert (got != -1);
 	if (hunk->info) {
-		r = getline (&line, &linelen, original);
-		assert (r != -1);
-		r = getline (&line, &linelen, original);
-		assert (r != -1);
+		got = patch_getline (original, &line);
+		assert (got != -1);
+		got = patch_getline (original, &line);
+		assert (got != -1);
 		at += 2;
 	}
 	r = read_atatline (line, &orig_offset, &orig_count,
@@ -500,10 +512,10 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 	if (*trailing == ' ')
 		trailing++;
 	trailing += strspn (trailing, "@");
-	trailing = xstrdup (trailing);
+	trailing_len = line + got - trailing;
 
-	r = getline (&line, &linelen, modify);
-	assert (r != -1);
+	got = patch_getline (modify, &line);
+	assert (got != -1);
 	r = read_atatline (line, &morig_offset, &morig_count,
 			   &mnew_offset, &mnew_count);
 	assert (!r);
@@ -528,9 +540,9 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 		fprintf (stderr, "First %lu lines unaltered\n", unaltered);
 #endif /* DEBUG */
 		for (i = unaltered; i; i--) {
-			r = getline (&line, &linelen, original);
-			assert (r != -1);
-			fputs (line, t);
+			got = patch_getline (original, &line);
+			assert (got != -1);
+			fwrite (line, (size_t) got, 1, t);
 			at++;
 			t_written_to = 1;
 
@@ -548,7 +560,7 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 
 		while (morig_count || mnew_count) {
                         skip_trim = 0;
-			if (getline (&line, &linelen, modify) == -1)
+			if ((got = patch_getline (modify, &line)) == -1)
 				break;
 
 			if (line[0] == '\\' || line[1] == '\\')
@@ -557,7 +569,7 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 				       "issues yet.");
 
 #ifdef DEBUG
-			fprintf (stderr, "Modify using: %s", line);
+			fwrite (line, (size_t) got, 1, stderr);
 #endif /* DEBUG */
 			switch (line[0]) {
 			case '-':
@@ -597,20 +609,23 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 				case '+':
 					this_offset++;
 					calc_new_count++;
-					fputs (line + 1, t);
+					fwrite (line + 1, (size_t) got - 1,
+						1, t);
 					t_written_to = 1;
 					break;
 				case '-':
 					this_offset--;
 					calc_orig_count++;
 					trim = 0;
-					fputs (line + 1, t);
+					fwrite (line + 1, (size_t) got - 1,
+						1, t);
 					t_written_to = 1;
 					break;
 				case ' ':
 					calc_orig_count++;
 					calc_new_count++;
-					fputs (line + 1, t);
+					fwrite (line + 1, (size_t) got - 1,
+						1, t);
 					t_written_to = 1;
 					break;
 				case '@':
@@ -639,8 +654,8 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 #endif /* DEBUG */
 		while (replaced) {
 			replaced--;
-			r = getline (&line, &linelen, original);
-			assert (r != -1);
+			got = patch_getline (original, &line);
+			assert (got != -1);
 			at++;
 			switch (line[0]) {
 			case ' ':
@@ -660,11 +675,8 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 				long loff;
 				FILE *write_to;
 				write_to = t_written_to ? t : out;
-				if (hunk->info && !hunk->info->info_written) {
-					fputs (hunk->info->orig_file, out);
-					fputs (hunk->info->new_file, out);
-					hunk->info->info_written = 1;
-				}
+				if (hunk->info && !hunk->info->info_written)
+					write_info (hunk->info, out);
 				loff = added_hunk (line + 1,
 						   this_offset,
 						   modify, write_to,
@@ -701,9 +713,9 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 
 				while (replaced) {
 					replaced--;
-					r = getline (&line, &linelen,
-						     original);
-					assert (r != -1);
+					got = patch_getline (original,
+							     &line);
+					assert (got != -1);
 					at++;
 					switch (line[0]) {
 					case ' ':
@@ -720,25 +732,25 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 				    "diff output not understood");
 		}
 
-		if (getline (&line, &linelen, modify) == -1)
+		if (patch_getline (modify, &line) == -1)
 			break;
 
 		r = read_atatline (line, &morig_offset, &morig_count,
 				   &mnew_offset, &mnew_count);
 		assert (!r);
 		replaced = morig_count;
-	} while (!feof (modify));
+	} while (!patch_eof (modify));
 
 #ifdef DEBUG
 	fprintf (stderr, "Copy remaining lines of original hunk (%lu,%lu)\n",
 		 orig_count, new_count);
 #endif /* DEBUG */
 	while (orig_count || new_count) {
-		if (getline (&line, &linelen, original) == -1)
+		if ((got = patch_getline (original, &line)) == -1)
 			break;
-		fputs (line, t);
+		fwrite (line, (size_t) got, 1, t);
 #ifdef DEBUG
-		fputs (line, stderr);
+		fwrite (line, (size_t) got, 1, stderr);
 #endif /* DEBUG */
 		at++;
 		switch (line[0]) {
@@ -758,12 +770,8 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 	fprintf (stderr, "Result:\n");
 #endif /* DEBUG */
 
-	if (hunk->info && !hunk->info->info_written) {
-		fputs (hunk->info->orig_file, out);
-		fputs (hunk->info->new_file, out);
-		hunk->info->info_written = 1;
-	}
-	rewind (t);
+	if (hunk->info && !hunk->info->info_written)
+		write_info (hunk->info, out);
 
 	if (calc_orig_count || calc_new_count) {
 		fprintf (out, "@@ -%lu", orig_offset);
@@ -772,17 +780,12 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 		fprintf (out, " +%lu", calc_new_offset + line_offset);
 		if (calc_new_count != 1)
 			fprintf (out, ",%lu", calc_new_count);
-		fprintf (out, " @@%s", trailing);
+		fputs (" @@", out);
+		fwrite (trailing, trailing_len, 1, out);
 	}
 
-	free (trailing);
-	while (getline (&line, &linelen, t) != -1)
-		fputs (line, out);
-
-	if (line)
-		free (line);
-	fclose (modify);
-	fclose (t);
+	copy_file (t, out);
+	xtmpclose (t);
 
 #ifdef DEBUG
 	fprintf (stderr, "Trailing:\n");
@@ -801,69 +804,80 @@ static long show_modified_hunk (struct hunk **hunkp, long line_offset,
 static int rediff (const char *original, const char *edited, FILE *out)
 {
 	pid_t child;
-	FILE *o;
-	FILE *m;
-	FILE *t = NULL;
-	char *line = NULL;
-	size_t linelen = 0;
-	unsigned long linenum = 0;
+	FILE *f;
+	struct filebuf obuf, mbuf;
+	struct patch_reader o, m, modify;
+	struct patch_parser parser;
+	struct patch_record rec;
+	const char *line = "";
+	size_t pos = 0, meta_start = 0;
 	struct hunk *hunks = NULL, **p = &hunks, *last = NULL;
 	struct hunk *current_hunk = NULL;
+	struct arena pool = ARENA_INIT (ALLOC_HUNKS); /* hunks and file info */
 	long line_offset = 0;
+	struct stats_timer timer;
 
 	/* Let's take a look at what hunks are in the original diff. */
-	o = xopen (original, "rbm");
-	while (!feof (o)) {
-		unsigned long o_count, n_count;
+	STATS_START (&timer);
+	f = xopen (original, "rbm");
+	filebuf_read (&obuf, f);
+	fclose (f);
+	STATS_STOP (&timer, STATS_READ);
+	if (stats_enabled)
+		stats_input (obuf.data, obuf.size);
+
+	STATS_START (&timer);
+	patch_reader_init (&o, obuf.data, obuf.size);
+	patch_parser_init (&parser, &o);
+	while (patch_next_record (&parser, &rec) != PATCH_EOF) {
 		struct hunk *newhunk;
-		fpos_t pos;
-
-		/* Search for start of hunk (or file info). */
-		do {
-			fgetpos (o, &pos);
-			if (getline (&line, &linelen, o) == -1)
-				break;
-			linenum++;
 
-			if (!strncmp (line, "*** ", 4))
+		switch (rec.type) {
+		case PATCH_OTHER:
+			if (!strncmp (rec.line, "*** ", 4))
 				error (EXIT_FAILURE, errno,
 				       "Don't know how to handle context "
 				       "format yet.");
-		} while (strncmp (line, "@@ ", 3) &&
-			 strncmp (line, "--- ", 4));
-
-		if (feof (o))
+			/* fall through */
+		case PATCH_LINE:
+			continue;
+		default:
 			break;
+		}
 
+		/* This is the start of a hunk (or file info). */
 		if (last)
-			last->num_lines = linenum - last->line_in_diff + 1;
+			last->num_lines = rec.linenum - last->line_in_diff + 1;
 
-		newhunk = xmalloc (sizeof *newhunk);
-		newhunk->filepos = pos;
-		newhunk->line_in_diff = linenum;
+		newhunk = arena_alloc (&pool, sizeof *newhunk);
+		newhunk->filepos = rec.offset;
+		newhunk->line_in_diff = rec.linenum;
 		newhunk->num_lines = 0;
+		newhunk->discard_offset = 0;
 
-		if (!strncmp (line, "--- ", 4)) {
-			struct file_info *info = xmalloc (sizeof *info);
+		if (rec.type == PATCH_FILE) {
+			struct file_info *info;
+			info = arena_alloc (&pool, sizeof *info);
 			info->info_written = info->info_pending = 0;
-			info->orig_file = xstrdup (line);
-			if (getline (&line, &linelen, o) == -1)
-				error (EXIT_FAILURE, errno,
-				       "Premature end of file");
-			info->new_file = xstrdup (line);
+			info->orig_file = rec.line;
+			info->orig_file_len = rec.length;
+			info->new_file = rec.line2;
+			info->new_file_len = rec.length2;
 			newhunk->info = info;
-			if (getline (&line, &linelen, o) == -1)
+			if (patch_next_record (&parser, &rec) == PATCH_EOF)
 				error (EXIT_FAILURE, errno,
 				       "Premature end of file");
-			linenum += 2;
+			if (rec.type != PATCH_HUNK)
+				error (EXIT_FAILURE, 0,
+				       "Line not understood: %.*s",
+				       (int) strcspn (rec.line, "\n"),
+				       rec.line);
 		} else newhunk->info = NULL;
 
-		read_atatline (line, &newhunk->orig_offset,
-			       &newhunk->orig_count,
-			       &newhunk->new_offset,
-			       &newhunk->new_count);
-		o_count = newhunk->orig_count;
-		n_count = newhunk->new_count;
+		newhunk->orig_offset = rec.orig_offset;
+		newhunk->orig_count = rec.orig_count;
+		newhunk->new_offset = rec.new_offset;
+		newhunk->new_count = rec.new_count;
 
 		newhunk->next = NULL;
 		if (*p)
@@ -879,66 +893,44 @@ static int rediff (const char *original, const char *edited, FILE *out)
 			 newhunk->orig_offset, newhunk->orig_count,
 			 newhunk->new_offset, newhunk->new_count);
 #endif /* DEBUG */
-
-		/* Skip to next hunk. */
-		while (o_count || n_count) {
-			if (getline (&line, &linelen, o) == -1)
-				break;
-
-			linenum++;
-			switch (line[0]) {
-			case ' ':
-				if (n_count) n_count--;
-			case '-':
-				if (o_count) o_count--;
-				break;
-			case '+':
-				if (n_count) n_count--;
-				break;
-			}
-		}
 	}
 
 	if (!hunks)
 		error (EXIT_FAILURE, 0, "Original patch seems empty");
 
-	last->num_lines = linenum - last->line_in_diff + 1;
+	last->num_lines = parser.linenum - last->line_in_diff + 1;
+	STATS_STOP (&timer, STATS_PARSE);
 
 	/* Run diff between original and edited. */
-	t = xpipe (DIFF, &child, "r", DIFF, "-U0",
+	STATS_START (&timer);
+	f = xpipe (DIFF, &child, "r", DIFF, "-U0",
 		   original, edited, NULL);
-	m = xtmpfile ();
-	if (m) {
-		size_t buffer_size = 10000;
-		char *buffer = xmalloc (buffer_size);
-		while (!feof (t)) {
-			size_t got = fread (buffer, 1, buffer_size, t);
-			fwrite (buffer, 1, got, m);
-		}
-		fclose (t);
-		waitpid (child, NULL, 0);
-		rewind (m);
-		free (buffer);
-	} else error (EXIT_FAILURE, errno, "Couldn't create temporary file");
+	filebuf_read (&mbuf, f);
+	fclose (f);
+	waitpid (child, NULL, 0);
+	STATS_STOP (&timer, STATS_DIFF);
+
+	STATS_START (&timer);
+	patch_reader_init (&m, mbuf.data, mbuf.size);
 
 	/* For each hunk in m, identify which hunk in o has been
 	 * touched.  Display unmodified hunks before that one
 	 * (adjusting offsets), then step through the touched hunk
-	 * applying changes as necessary. */
-	*line = '\0';
-	while (!feof (m)) {
+	 * applying changes as necessary.  The meta hunks touching
+	 * any one hunk in o are adjacent in m, and are handed to
+	 * show_modified_hunk() as a reader over just that part. */
+	while (!patch_eof (&m)) {
 		unsigned long orig_line;
 		unsigned long orig_count;
 		struct hunk *which;
-		fpos_t pos;
 
 		while (strncmp (line, "@@ ", 3)) {
-			fgetpos (m, &pos);
-			if (getline (&line, &linelen, m) == -1)
+			pos = patch_tell (&m);
+			if (patch_getline (&m, &line) == -1)
 				break;
 		}
 	
-		if (feof (m))
+		if (patch_eof (&m))
 			break;
 
 		read_atatline (line, &orig_line, &orig_count, NULL, NULL);
@@ -976,53 +968,57 @@ static int rediff (const char *original, const char *edited, FILE *out)
 		 * adjusting offsets as we go. */
 		if (current_hunk != which) {
 			if (current_hunk) {
+				patch_reader_init (&modify,
+						   mbuf.data + meta_start,
+						   pos - meta_start);
 				line_offset += show_modified_hunk
 					(&current_hunk, line_offset,
-					 t, o, out);
+					 &modify, &o, out);
 				current_hunk = current_hunk->next;
 			}
 
 			/* Copy hunks, adjusting offsets. */
 			copy_to (current_hunk ? current_hunk : hunks,
-				 which, &line_offset, o, out,
+				 which, &line_offset, &o, out,
 				 current_hunk == NULL);
 
 			/* This meta hunk is the first pertaining to
 			 * the hunk in the original. */
-			t = xtmpfile ();
+			meta_start = pos;
 		}
 
 		current_hunk = which;
 
-		/* Append the meta hunk to a temporary file. */
-		fputs (line, t);
-		while (!feof (m)) {
-			if (getline (&line, &linelen, m) == -1)
+		/* Skip to the next meta hunk. */
+		while (!patch_eof (&m)) {
+			pos = patch_tell (&m);
+			if (patch_getline (&m, &line) == -1)
 				break;
 			if (!strncmp (line, "@@ ", 3))
 				break;
-			fputs (line, t);
 		}
 	}
 
 	/* Now display the remaining hunks, adjusting offsets. */
 	if (current_hunk) {
+		patch_reader_init (&modify, mbuf.data + meta_start,
+				   mbuf.size - meta_start);
 		line_offset += show_modified_hunk (&current_hunk, line_offset,
-						   t, o, out);
+						   &modify, &o, out);
 		current_hunk = current_hunk->next;
 		if (current_hunk)
-			copy_to (current_hunk, NULL, &line_offset, o, out, 0);
+			copy_to (current_hunk, NULL, &line_offset, &o, out, 0);
 	} else
-		copy_to (hunks, NULL, &line_offset, o, out, 1);
+		copy_to (hunks, NULL, &line_offset, &o, out, 1);
+	STATS_STOP (&timer, STATS_OUTPUT);
 
-	fclose (o);
-	fclose (m);
-	if (line)
-		free (line);
+	arena_free (&pool);
+	filebuf_free (&obuf);
+	filebuf_free (&mbuf);
 
 	return 0;
 }
-static char * syntax_str = "usage: %s ORIGINAL EDITED\n"
+static char * syntax_str = "usage: %s [--stats] ORIGINAL EDITED\n"
                            "       %s EDITED\n";
 
 NORETURN
@@ -1036,11 +1032,13 @@ int main (int argc, char *argv[])
 {
 	/* name to use in error messages */
 	set_progname ("rediff");
+	stats_init (0);
 	
 	while (1) {
 		static struct option long_options[] = {
 	       		{"help", 0, 0, 'h'},
 			{"version", 0, 0, 'v'},
+			{"stats", 0, 0, 1000 + 's'},
 			{0, 0, 0, 0}
 		};
 		int c = getopt_long (argc, argv, "vh",
@@ -1055,6 +1053,9 @@ int main (int argc, char *argv[])
 		case 'h':
 			syntax (0);
 			break;
+		case 1000 + 's':
+			stats_init (1);
+			break;
 		default:
 			syntax(1);
 		}
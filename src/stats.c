@@ -0,0 +1,324 @@
+/*
+ * stats.c - counters and phase timers for --stats
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif /* HAVE_SYS_TYPES_H */
+#include <sys/resource.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#ifdef HAVE_MALLOC_H
+# include <malloc.h>
+#endif /* HAVE_MALLOC_H */
+
+#include "util.h"
+#include "stats.h"
+
+int stats_enabled;
+
+static const char *const counter_names[STATS_COUNTERS] = {
+	"bytes read",
+	"lines read",
+	"files parsed",
+	"hunks parsed",
+	"regex evaluations",
+	"subprocesses",
+	"temp file bytes",
+};
+
+static const char *const phase_names[STATS_PHASES] = {
+	"read",
+	"convert",
+	"parse",
+	"reconstruct",
+	"apply",
+	"diff",
+	"output",
+};
+
+static const char *const alloc_names[ALLOC_KINDS] = {
+	"other",
+	"header",
+	"line store",
+	"hunks",
+	"regex",
+	"I/O buffers",
+};
+
+static struct {
+	unsigned long counters[STATS_COUNTERS];
+	unsigned long allocs[ALLOC_KINDS];
+	unsigned long long alloc_bytes[ALLOC_KINDS];
+	long long in_use[ALLOC_KINDS + 1];	/* the last is the total */
+	long long peak[ALLOC_KINDS + 1];
+	unsigned long runs[STATS_PHASES];
+	double wall[STATS_PHASES], cpu[STATS_PHASES];
+	double start;
+	pid_t pid;		/* not a child that failed to exec */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif /* HAVE_PTHREAD_H */
+} stats
+#ifdef HAVE_PTHREAD_H
+	= { .lock = PTHREAD_MUTEX_INITIALIZER }
+#endif /* HAVE_PTHREAD_H */
+	;
+
+#ifdef HAVE_PTHREAD_H
+# define LOCK() pthread_mutex_lock (&stats.lock)
+# define UNLOCK() pthread_mutex_unlock (&stats.lock)
+#else
+# define LOCK()
+# define UNLOCK()
+#endif /* HAVE_PTHREAD_H */
+
+static double wall_time (void)
+{
+#if defined (HAVE_CLOCK_GETTIME) && defined (CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (!clock_gettime (CLOCK_MONOTONIC, &ts))
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday (&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1e6;
+	}
+}
+
+static double process_cpu_time (void)
+{
+	struct rusage ru;
+
+	getrusage (RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* The CPU time used by this thread, if that can be had, or else by
+ * the whole process. */
+static double cpu_time (void)
+{
+#if defined (HAVE_CLOCK_GETTIME) && defined (CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+
+	if (!clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts))
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+	return process_cpu_time ();
+}
+
+/* Memory that malloc() had handed out and not had back, or -1 if the
+ * C library can't say.  This covers everything, not only the counted
+ * allocations, and most of the programs leave their freeing to
+ * exit(), so it is not a count of leaks. */
+static long long heap_in_use (void)
+{
+#if defined (HAVE_MALLINFO2)
+	struct mallinfo2 mi = mallinfo2 ();
+
+	return (long long) mi.uordblks + mi.hblkhd;
+#elif defined (HAVE_MALLINFO)
+	struct mallinfo mi = mallinfo ();
+
+	return (long long) (unsigned int) mi.uordblks +
+		(unsigned int) mi.hblkhd;
+#else
+	return -1;
+#endif
+}
+
+/* The counted allocations of one kind, or all of them (when kind is
+ * ALLOC_KINDS).  What is in use can only be followed when the size of
+ * a block being freed can be found out. */
+static void report_allocs (const char *name, unsigned long calls,
+			   unsigned long long bytes, int kind)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	fprintf (stderr, "  %-18s %10lu %14llu %14lld %14lld\n", name, calls,
+		 bytes, stats.peak[kind], stats.in_use[kind]);
+#else
+	fprintf (stderr, "  %-18s %10lu %14llu\n", name, calls, bytes);
+#endif /* HAVE_MALLOC_USABLE_SIZE */
+}
+
+static void report_memory (void)
+{
+	unsigned long calls = 0;
+	unsigned long long bytes = 0;
+	struct rusage ru;
+	long long in_use;
+	int i;
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	fprintf (stderr, "  %-18s %10s %14s %14s %14s\n", "allocations",
+		 "calls", "bytes", "peak", "at exit");
+#else
+	fprintf (stderr, "  %-18s %10s %14s\n", "allocations", "calls",
+		 "bytes");
+#endif /* HAVE_MALLOC_USABLE_SIZE */
+	for (i = 0; i < ALLOC_KINDS; i++) {
+		calls += stats.allocs[i];
+		bytes += stats.alloc_bytes[i];
+		if (stats.allocs[i])
+			report_allocs (alloc_names[i], stats.allocs[i],
+				       stats.alloc_bytes[i], i);
+	}
+	report_allocs ("total", calls, bytes, ALLOC_KINDS);
+
+	in_use = heap_in_use ();
+	if (in_use >= 0)
+		fprintf (stderr, "  %-18s %lld (all malloc use, not leaks)\n",
+			 "heap at exit", in_use);
+	if (!getrusage (RUSAGE_SELF, &ru))
+		/* Linux gives this in kilobytes. */
+		fprintf (stderr, "  %-18s %lld (whole process)\n",
+			 "peak resident", (long long) ru.ru_maxrss * 1024);
+}
+
+static void report (void)
+{
+	int i;
+
+	if (getpid () != stats.pid)
+		return;
+
+	fflush (stdout);
+	fprintf (stderr, "%s statistics:\n", progname);
+	for (i = 0; i < STATS_COUNTERS; i++)
+		fprintf (stderr, "  %-18s %lu\n", counter_names[i],
+			 stats.counters[i]);
+
+	report_memory ();
+
+	fprintf (stderr, "  %-18s %10s %10s\n", "phase", "wall (s)",
+		 "CPU (s)");
+	for (i = 0; i < STATS_PHASES; i++)
+		if (stats.runs[i])
+			fprintf (stderr, "  %-18s %10.6f %10.6f\n",
+				 phase_names[i], stats.wall[i], stats.cpu[i]);
+	fprintf (stderr, "  %-18s %10.6f %10.6f\n", "total",
+		 wall_time () - stats.start, process_cpu_time ());
+}
+
+void stats_init (int force)
+{
+	const char *env = getenv ("PATCHUTILS_STATS");
+
+	if (!force && !(env && *env && strcmp (env, "0")))
+		return;
+
+	if (stats_enabled)
+		return;
+
+	stats_enabled = 1;
+	stats.start = wall_time ();
+	stats.pid = getpid ();
+	atexit (report);
+}
+
+void stats_add (enum stats_counter counter, unsigned long n)
+{
+	LOCK ();
+	stats.counters[counter] += n;
+	UNLOCK ();
+}
+
+static void note_in_use (int i, long long n)
+{
+	stats.in_use[i] += n;
+	if (stats.in_use[i] > stats.peak[i])
+		stats.peak[i] = stats.in_use[i];
+}
+
+/* Add n bytes to what is in use of a kind, and to the total. */
+static void add_in_use (int kind, long long n)
+{
+	note_in_use (kind, n);
+	note_in_use (ALLOC_KINDS, n);
+}
+
+void stats_alloc (int kind, size_t size, size_t old_size)
+{
+	LOCK ();
+	stats.allocs[kind]++;
+	if (size > old_size)
+		stats.alloc_bytes[kind] += size - old_size;
+	add_in_use (kind, (long long) size - (long long) old_size);
+	UNLOCK ();
+}
+
+void stats_free (int kind, size_t size)
+{
+	LOCK ();
+	add_in_use (kind, -(long long) size);
+	UNLOCK ();
+}
+
+void stats_input (const char *data, size_t size)
+{
+	const char *end = data + size;
+	unsigned long lines = 0;
+
+	while ((data = memchr (data, '\n', end - data)) != NULL) {
+		data++;
+		lines++;
+	}
+	if (size && end[-1] != '\n')
+		lines++;
+
+	LOCK ();
+	stats.counters[STATS_BYTES] += size;
+	stats.counters[STATS_LINES] += lines;
+	UNLOCK ();
+}
+
+void stats_start (struct stats_timer *timer)
+{
+	timer->wall = wall_time ();
+	timer->cpu = cpu_time ();
+}
+
+void stats_stop (struct stats_timer *timer, enum stats_phase phase)
+{
+	double wall = wall_time () - timer->wall;
+	double cpu = cpu_time () - timer->cpu;
+
+	LOCK ();
+	stats.runs[phase]++;
+	stats.wall[phase] += wall;
+	stats.cpu[phase] += cpu;
+	UNLOCK ();
+}
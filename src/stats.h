@@ -0,0 +1,80 @@
+/*
+ * stats.h - counters and phase timers for --stats - header
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+enum stats_counter {
+	STATS_BYTES,		/* patch input, after decompression */
+	STATS_LINES,
+	STATS_FILES,		/* file headers parsed */
+	STATS_HUNKS,		/* hunks parsed */
+	STATS_REGEX,		/* regexec() and pcre2_match() calls */
+	STATS_SUBPROCESSES,	/* started by xpipe() */
+	STATS_TMPFILE_BYTES,	/* left in xtmpfile() files when closed */
+	STATS_COUNTERS
+};
+
+enum stats_phase {
+	STATS_READ,
+	STATS_CONVERT,
+	STATS_PARSE,
+	STATS_RECONSTRUCT,
+	STATS_APPLY,
+	STATS_DIFF,
+	STATS_OUTPUT,
+	STATS_PHASES
+};
+
+/* Non-zero once --stats or PATCHUTILS_STATS=1 has turned them on.
+ * Nothing is counted otherwise, so callers test this first. */
+extern int stats_enabled;
+
+/* Turn the statistics on if PATCHUTILS_STATS asks for them, or if
+ * force is set (for --stats).  They are printed to stderr when the
+ * program exits. */
+void stats_init (int force);
+
+void stats_add (enum stats_counter counter, unsigned long n);
+
+/* Count an allocation of size bytes, which takes the place of a block
+ * of old_size bytes (0 for a new one); kind is an enum alloc_kind from
+ * util.h. */
+void stats_alloc (int kind, size_t size, size_t old_size);
+/* Count a block of size bytes being freed. */
+void stats_free (int kind, size_t size);
+
+/* Count the bytes and lines of a patch that has been read in. */
+void stats_input (const char *data, size_t size);
+
+/* Time spent between stats_start() and stats_stop() is charged to the
+ * phase, in whichever thread they are called.  Phases are timed
+ * around work that doesn't itself contain timed work, so with -j
+ * their times add up over all the threads. */
+struct stats_timer {
+	double wall, cpu;
+};
+
+void stats_start (struct stats_timer *timer);
+void stats_stop (struct stats_timer *timer, enum stats_phase phase);
+
+#define STATS_ADD(counter, n) \
+	do { if (stats_enabled) stats_add (counter, n); } while (0)
+#define STATS_START(timer) \
+	do { if (stats_enabled) stats_start (timer); } while (0)
+#define STATS_STOP(timer, phase) \
+	do { if (stats_enabled) stats_stop (timer, phase); } while (0)
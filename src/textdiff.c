@@ -0,0 +1,140 @@
+/*
+ * textdiff.c - compare two files held in memory
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * The comparison itself is done by diff(1), so that the hunks are
+ * exactly the ones it prints: the files are written out to temporary
+ * files and its output is read back into memory.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_ERROR_H
+# include <error.h>
+#endif /* HAVE_ERROR_H */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif /* HAVE_SYS_TYPES_H */
+#ifdef HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif /* HAVE_SYS_WAIT_H */
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+
+#include "util.h"
+#include "textdiff.h"
+
+#ifndef DIFF
+#define DIFF "diff"
+#endif
+
+/* Write the lines out to a new temporary file, and return its name. */
+static char *
+write_temp (const char *tail, const struct text_line *lines,
+	    unsigned long count)
+{
+	const char *tmpdir = getenv ("TMPDIR");
+	size_t tmplen;
+	char *name;
+	unsigned long i;
+	FILE *f;
+
+	if (!tmpdir)
+		tmpdir = P_tmpdir;
+
+	tmplen = strlen (tmpdir);
+	name = xmalloc (tmplen + strlen (tail) + 1);
+	memcpy (name, tmpdir, tmplen);
+	strcpy (name + tmplen, tail);
+
+	f = fdopen (xmkstemp (name), "w");
+	if (!f)
+		error (EXIT_FAILURE, errno, "fdopen");
+	for (i = 0; i < count; i++)
+		fwrite (lines[i].line, lines[i].length, 1, f);
+	if (fclose (f))
+		error (EXIT_FAILURE, errno, "%s", name);
+
+	return name;
+}
+
+unsigned long
+textdiff (const struct text_line *a, unsigned long na,
+	  const struct text_line *b, unsigned long nb,
+	  int flags, unsigned long context, struct filebuf *out)
+{
+	char *name1 = write_temp ("/interdiff-1.XXXXXX", a, na);
+	char *name2 = write_temp ("/interdiff-2.XXXXXX", b, nb);
+	char options[100], *p = options;
+	char buf[BUFSIZ];
+	struct filebuf diff;
+	unsigned long hunks = 0;
+	const char *at, *end;
+	pid_t child;
+	size_t got;
+	FILE *in;
+	int lines;
+
+	*p++ = '-';
+	if (flags & TEXTDIFF_IGNORE_BLANK_LINES)
+		*p++ = 'B';
+	if (flags & TEXTDIFF_IGNORE_SPACE_CHANGE)
+		*p++ = 'b';
+	if (flags & TEXTDIFF_IGNORE_CASE)
+		*p++ = 'i';
+	if (flags & TEXTDIFF_IGNORE_ALL_SPACE)
+		*p++ = 'w';
+	sprintf (p, "U%lu", context);
+
+	in = xpipe (DIFF, &child, "r", DIFF, options, name1, name2, NULL);
+	filebuf_init (&diff);
+	while ((got = fread (buf, 1, sizeof (buf), in)) > 0)
+		filebuf_append (&diff, buf, got);
+	fclose (in);
+	waitpid (child, NULL, 0);
+
+	unlink (name1);
+	unlink (name2);
+	xfree (name1);
+	xfree (name2);
+
+	/* Leave out the '---' and '+++' lines, and count the hunks. */
+	at = diff.data;
+	end = diff.data + diff.size;
+	for (lines = 0; at < end; lines++) {
+		const char *nl = memchr (at, '\n', end - at);
+
+		if (lines == 2)
+			filebuf_append (out, at, end - at);
+		if (lines >= 2 && end - at > 2 && !memcmp (at, "@@ ", 3))
+			hunks++;
+		at = nl ? nl + 1 : end;
+	}
+
+	filebuf_free (&diff);
+	return hunks;
+}
@@ -0,0 +1,47 @@
+/*
+ * textdiff.h - compare two files held in memory - header
+ * Copyright (C) 2026 Tim Waugh <twaugh@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+struct filebuf;
+
+/* One line of a file: its text, including the trailing newline
+ * unless it is an incomplete last line. */
+struct text_line {
+	const char *line;
+	size_t length;
+};
+
+/* The diff(1) options that change which lines compare equal. */
+#define TEXTDIFF_IGNORE_CASE		0x01	/* -i */
+#define TEXTDIFF_IGNORE_SPACE_CHANGE	0x02	/* -b */
+#define TEXTDIFF_IGNORE_ALL_SPACE	0x04	/* -w */
+#define TEXTDIFF_IGNORE_BLANK_LINES	0x08	/* -B */
+
+/*
+ * Compare file a (na lines) with file b (nb lines) using diff(1) and
+ * append the differences to out as unified diff hunks with the given
+ * amount of context, leaving out the '---'/'+++' header.
+ *
+ * Returns the number of hunks written, so zero if the files are
+ * the same (as far as the flags are concerned).
+ */
+unsigned long textdiff (const struct text_line *a, unsigned long na,
+			const struct text_line *b, unsigned long nb,
+			int flags, unsigned long context,
+			struct filebuf *out);
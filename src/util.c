@@ -45,45 +45,114 @@
 #ifdef HAVE_SYS_WAIT_H
 # include <sys/wait.h>
 #endif /* HAVE_SYS_WAIT_H */
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif /* HAVE_SYS_MMAN_H */
+#include <sys/stat.h>
+#ifdef HAVE_MALLOC_H
+# include <malloc.h>
+#endif /* HAVE_MALLOC_H */
+#ifdef HAVE_ZLIB_H
+# include <zlib.h>
+#endif /* HAVE_ZLIB_H */
+#ifdef HAVE_BZLIB_H
+# include <bzlib.h>
+#endif /* HAVE_BZLIB_H */
+#ifdef HAVE_LZMA_H
+# include <lzma.h>
+#endif /* HAVE_LZMA_H */
+#ifdef HAVE_ZSTD_H
+# include <zstd.h>
+#endif /* HAVE_ZSTD_H */
 
+#include "stats.h"
 #include "util.h"
 
+/* How much memory a block from malloc() really takes up, which may be
+ * more than was asked for, or size if the C library can't say. */
+static size_t block_size (void *ptr, size_t size)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	return ptr ? malloc_usable_size (ptr) : 0;
+#else
+	return size;
+#endif /* HAVE_MALLOC_USABLE_SIZE */
+}
+
 /* safe malloc */
-void *xmalloc (size_t size)
+void *xmalloc_as (enum alloc_kind kind, size_t size)
 {
 	void *res = malloc(size);
 	if (!res)
 		error (EXIT_FAILURE, errno, "malloc");
+	if (stats_enabled)
+		stats_alloc (kind, block_size (res, size), 0);
 	return res;
 }
 
-void *xrealloc (void *ptr, size_t size)
+void *xrealloc_as (enum alloc_kind kind, void *ptr, size_t size)
 {
+	/* Without malloc_usable_size(), all of the new block counts. */
+	size_t old_size = stats_enabled ? block_size (ptr, 0) : 0;
 	void *res = realloc (ptr, size);
 	if (!res)
 		error (EXIT_FAILURE, errno, "realloc");
+	if (stats_enabled)
+		stats_alloc (kind, block_size (res, size), old_size);
 	return res;
 }
 
+void xfree_as (enum alloc_kind kind, void *ptr)
+{
+	if (stats_enabled && ptr)
+		stats_free (kind, block_size (ptr, 0));
+	free (ptr);
+}
+
 /* safe strdup */
-char *xstrdup (const char *s)
+char *xstrdup_as (enum alloc_kind kind, const char *s)
 {
 	size_t len = strlen (s) + 1;
-	char *result = xmalloc (len);
+	char *result = xmalloc_as (kind, len);
 	memcpy (result, s, len);
 	return result;
 }
 
 /* only copy the first n characters of s */
-char *xstrndup (const char *s, const size_t n)
+char *xstrndup_as (enum alloc_kind kind, const char *s, const size_t n)
 {
 	char *result;
-	result = xmalloc(n + 1);
+	result = xmalloc_as(kind, n + 1);
 	strncpy(result, s, n);
 	result[n] = '\0';
 	return result;
 }
 
+void *xmalloc (size_t size)
+{
+	return xmalloc_as (ALLOC_OTHER, size);
+}
+
+void *xrealloc (void *ptr, size_t size)
+{
+	return xrealloc_as (ALLOC_OTHER, ptr, size);
+}
+
+void xfree (void *ptr)
+{
+	xfree_as (ALLOC_OTHER, ptr);
+}
+
+char *xstrdup (const char *s)
+{
+	return xstrdup_as (ALLOC_OTHER, s);
+}
+
+char *xstrndup (const char *s, const size_t n)
+{
+	return xstrndup_as (ALLOC_OTHER, s, n);
+}
+
 int xmkstemp (char *pattern)
 {
 	int fd = mkstemp (pattern);
@@ -112,26 +181,180 @@ FILE *xtmpfile (void)
 	if (ret == NULL)
 		error (EXIT_FAILURE, errno, "fdopen");
 	unlink (tmpfname);
-	free (tmpfname);
+	xfree (tmpfname);
 	return ret;
 }
 
+void xtmpclose (FILE *f)
+{
+	struct stat st;
+
+	if (stats_enabled && !fflush (f) && !fstat (fileno (f), &st))
+		stats_add (STATS_TMPFILE_BYTES, st.st_size);
+	fclose (f);
+}
+
 /*
  * Pattern operations.
+ *
+ * Patterns are filed by their shape as they are added, so that
+ * matching a name does not mean trying every pattern in turn.  A
+ * pattern with no wildcards is found by looking up the whole name,
+ * one whose only wildcard is a trailing '*' by looking up each of the
+ * name's prefixes, and one whose only wildcard is a leading '*' (such
+ * as "*.c") by looking up each of its suffixes.  Any other pattern is
+ * filed under the literal text it starts with, and fnmatch() is only
+ * tried on it for names that start the same way.
  */
-/* list of patterns */
+
+/* a pattern that needs fnmatch() */
+struct patglob {
+	struct patglob *next;
+	const char *pattern;
+};
+
+/* the patterns filed under one piece of literal text */
+struct patkey {
+	struct patkey *chain;
+	const char *text;
+	size_t length;
+	unsigned long hash;
+	int exact;		/* the text on its own is a pattern */
+	int prefix;		/* the text followed by '*' is a pattern */
+	struct patglob *globs;	/* patterns starting with the text */
+};
+
+struct pattable {
+	struct patkey **buckets;
+	unsigned long nbuckets;
+	unsigned long count;
+	size_t longest;
+};
 
 struct patlist {
-	struct patlist *next;
-	char *pattern;
+	struct pattable forward;	/* names and their prefixes */
+	struct pattable backward;	/* suffixes, hashed from the end */
+	struct arena pool;
 };
 
+#define FNV_OFFSET 2166136261UL
+#define FNV_PRIME 16777619UL
+
+static unsigned long hash_forward (const char *s, size_t n)
+{
+	unsigned long h = FNV_OFFSET;
+	while (n--) {
+		h ^= (unsigned char) *s++;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static unsigned long hash_backward (const char *s, size_t n)
+{
+	unsigned long h = FNV_OFFSET;
+	while (n--) {
+		h ^= (unsigned char) s[n];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static struct patkey *find_patkey (const struct pattable *table,
+				   const char *text, size_t n,
+				   unsigned long hash)
+{
+	struct patkey *at;
+
+	if (!table->nbuckets || n > table->longest)
+		return NULL;
+
+	for (at = table->buckets[hash % table->nbuckets]; at; at = at->chain)
+		if (at->hash == hash && at->length == n &&
+		    !memcmp (at->text, text, n))
+			return at;
+	return NULL;
+}
+
+static struct patkey *add_patkey (struct patlist *list,
+				  struct pattable *table,
+				  const char *text, size_t n,
+				  unsigned long hash)
+{
+	struct patkey *key = find_patkey (table, text, n, hash);
+
+	if (key)
+		return key;
+
+	if (table->count >= table->nbuckets) {
+		size_t size = table->nbuckets ? 2 * table->nbuckets : 64;
+		struct patkey **buckets = xmalloc_as (ALLOC_REGEX, size *
+						      sizeof *buckets);
+		struct patkey *at, *next;
+		size_t i;
+
+		memset (buckets, 0, size * sizeof *buckets);
+		for (i = 0; i < table->nbuckets; i++)
+			for (at = table->buckets[i]; at; at = next) {
+				next = at->chain;
+				at->chain = buckets[at->hash % size];
+				buckets[at->hash % size] = at;
+			}
+
+		xfree_as (ALLOC_REGEX, table->buckets);
+		table->buckets = buckets;
+		table->nbuckets = size;
+	}
+
+	key = arena_alloc (&list->pool, sizeof *key);
+	key->text = arena_strndup (&list->pool, text, n);
+	key->length = n;
+	key->hash = hash;
+	key->exact = key->prefix = 0;
+	key->globs = NULL;
+	key->chain = table->buckets[hash % table->nbuckets];
+	table->buckets[hash % table->nbuckets] = key;
+	table->count++;
+	if (n > table->longest)
+		table->longest = n;
+	return key;
+}
+
 void patlist_add(struct patlist **dst, const char *s)
 {
-	struct patlist *item = xmalloc (sizeof *item);
-	item->pattern = xstrdup (s);
-	item->next = *dst;
-	*dst = item;
+	struct patlist *list = *dst;
+	size_t len = strlen (s);
+	size_t literal = strcspn (s, "*?[\\");
+	struct patkey *key;
+
+	if (!list) {
+		list = *dst = xmalloc_as (ALLOC_REGEX, sizeof *list);
+		memset (list, 0, sizeof *list);
+		list->pool.kind = ALLOC_REGEX;
+	}
+
+	if (literal == len) {
+		key = add_patkey (list, &list->forward, s, len,
+				  hash_forward (s, len));
+		key->exact = 1;
+	} else if (literal == len - 1 && s[literal] == '*') {
+		key = add_patkey (list, &list->forward, s, literal,
+				  hash_forward (s, literal));
+		key->prefix = 1;
+	} else if (literal == 0 && s[0] == '*' &&
+		   strcspn (s + 1, "*?[\\") == len - 1) {
+		key = add_patkey (list, &list->backward, s + 1, len - 1,
+				  hash_backward (s + 1, len - 1));
+		key->exact = 1;
+	} else {
+		struct patglob *glob = arena_alloc (&list->pool,
+						    sizeof *glob);
+		key = add_patkey (list, &list->forward, s, literal,
+				  hash_forward (s, literal));
+		glob->pattern = arena_strndup (&list->pool, s, len);
+		glob->next = key->globs;
+		key->globs = glob;
+	}
 }
 
 void patlist_add_file(struct patlist **dst, const char *fn)
@@ -159,27 +382,57 @@ void patlist_add_file(struct patlist **dst, const char *fn)
 		}
 		patlist_add (dst, line);
 	} 
+	free (line);
 	fclose (fd);
 }
 
 int patlist_match(struct patlist *list, const char *s)
 {
-	while (list) {
-		if (!fnmatch (list->pattern, s, 0))
+	size_t len, i;
+	unsigned long hash;
+	struct patkey *key;
+	struct patglob *glob;
+
+	if (!list)
+		return 0;
+
+	/* Whole names, prefixes, and the patterns filed under them. */
+	len = strlen (s);
+	hash = FNV_OFFSET;
+	for (i = 0; i <= len && i <= list->forward.longest; i++) {
+		key = find_patkey (&list->forward, s, i, hash);
+		if (key) {
+			if (key->prefix || (key->exact && i == len))
+				return 1;
+			for (glob = key->globs; glob; glob = glob->next)
+				if (!fnmatch (glob->pattern, s, 0))
+					return 1;
+		}
+		hash ^= (unsigned char) s[i];
+		hash *= FNV_PRIME;
+	}
+
+	/* Suffixes. */
+	hash = FNV_OFFSET;
+	for (i = 1; i <= len && i <= list->backward.longest; i++) {
+		hash ^= (unsigned char) s[len - i];
+		hash *= FNV_PRIME;
+		if (find_patkey (&list->backward, s + len - i, i, hash))
 			return 1;
-		list = list->next;
 	}
+
 	return 0;
 }
 
 void patlist_free(struct patlist **list)
 {
-	struct patlist *l, *next;
-	for (l = *list; l; l = next) {
-		next = l->next;
-		free (l->pattern);
-		free (l);
-	}
+	if (!*list)
+		return;
+
+	xfree_as (ALLOC_REGEX, (*list)->forward.buckets);
+	xfree_as (ALLOC_REGEX, (*list)->backward.buckets);
+	arena_free (&(*list)->pool);
+	xfree_as (ALLOC_REGEX, *list);
 	*list = NULL;
 }
 
@@ -196,89 +449,6 @@ FILE *xopen (const char *name, const char *mode)
 	return f;
 }
 
-FILE *xopen_seekable (const char *name, const char *mode)
-{
-	/* If it's seekable, good.  If not, we need to make it seekable. */
-	FILE *f = xopen (name, mode);
-
-	if (fseek (f, 0L, SEEK_SET) != 0) {
-		const size_t buflen = 64 * 1024;
-		char *buffer = xmalloc (buflen);
-		FILE *tmp = xtmpfile();
-
-		while (!feof (f)) {
-			size_t count = fread (buffer, 1, buflen, f);
-			if (count < 1)
-				break;
-			fwrite (buffer, count, 1, tmp);
-		}
-
-		free (buffer);
-		fclose (f);
-
-		f = tmp;
-		fseek (f, 0L, SEEK_SET);
-	}
-
-	return f;
-}
-
-/* unzip if needed */
-FILE *xopen_unzip (const char *name, const char *mode)
-{
-	char *p, *zprog = NULL;
-	FILE *fi, *fo;
-	const size_t buflen = 64 * 1024;
-	char *buffer;
-	pid_t pid;
-	int status;
-	int any_data = 0;
-
-	p = strrchr(name, '.');
-	if (p != NULL) {
-		if (!strcmp (p, ".bz2"))
-			zprog = "bzcat";
-		else if (!strcmp(p, ".gz"))
-			zprog = "zcat";
-	}
-	if (zprog == NULL)
-		return xopen_seekable (name, mode);
-	
-	buffer = xmalloc (buflen);
-	fo = xtmpfile();
-	fi = xpipe(zprog, &pid, "r", zprog, name, NULL);
-	
-	while (!feof (fi)) {
-		size_t count = fread (buffer, 1, buflen, fi);
-		if (ferror (fi)) {
-			perror(name);
-			exit(1);
-		}
-		if (count < 1)
-			break;
-		
-		fwrite (buffer, count, 1, fo);
-		if (ferror (fo))
-			error (EXIT_FAILURE, errno, "writing temp file");
-
-		any_data = 1;
-	}
-	
-	free (buffer);
-	fclose (fi);
-	
-	waitpid (pid, &status, 0);
-	if (any_data == 0 && WEXITSTATUS (status) != 0)
-	{
-		fclose (fo);
-		exit (1);
-	}
-
-	fseek (fo, 0L, SEEK_SET);
-
-	return fo;
-}
-
 /* safe pipe/popen.  mode is either "r" or "w" */
 FILE * xpipe(const char * cmd, pid_t *pid, const char *mode, ...)
 {
@@ -308,6 +478,7 @@ FILE * xpipe(const char * cmd, pid_t *pid, const char *mode, ...)
 		perror ("fork");
 		exit (1);
 	}
+	STATS_ADD (STATS_SUBPROCESSES, 1);
 	if (child == 0) {
 		if (*mode == 'r') {
 			close (fildes[0]);
@@ -342,6 +513,596 @@ FILE * xpipe(const char * cmd, pid_t *pid, const char *mode, ...)
 	return res;
 }
 
+/*
+ * In-memory input files.
+ */
+
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+# define FILEBUF_MMAP 1
+#endif
+
+#ifdef FILEBUF_MMAP
+static size_t page_round (size_t size)
+{
+	size_t pagesize = sysconf (_SC_PAGESIZE);
+	return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+/* Map the rest of a regular file.  Returns 0 if f can't be mapped. */
+static int filebuf_map (struct filebuf *buf, FILE *f)
+{
+	struct stat st;
+	size_t pagesize, skip, len;
+	char *map;
+	off_t pos;
+	int fd = fileno (f);
+
+	if (fd == -1 || fstat (fd, &st) || !S_ISREG (st.st_mode))
+		return 0;
+
+	pos = ftello (f);
+	if (pos == -1 || pos >= st.st_size)
+		return 0;
+
+	pagesize = sysconf (_SC_PAGESIZE);
+	skip = pos & (pagesize - 1);
+	len = st.st_size - (pos - skip);
+
+	/* Reserve one byte more than the file, so that there is always
+	 * a zero byte after the data even when its size is a multiple
+	 * of the page size, then map the file over the front of it. */
+	map = mmap (NULL, page_round (len + 1), PROT_READ,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	if (mmap (map, len, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+		  fd, pos - skip) == MAP_FAILED) {
+		munmap (map, page_round (len + 1));
+		return 0;
+	}
+
+#ifdef HAVE_MADVISE
+	madvise (map, len, MADV_SEQUENTIAL);
+#endif
+
+	buf->map = map;
+	buf->allocated = page_round (len + 1);
+	buf->mapped = 1;
+	buf->data = map + skip;
+	buf->size = len - skip;
+	return 1;
+}
+#endif /* FILEBUF_MMAP */
+
+void filebuf_init (struct filebuf *buf)
+{
+	buf->allocated = 64 * 1024;
+#ifdef FILEBUF_MMAP
+	/* An anonymous mapping starts out zero-filled and can be
+	 * grown without copying. */
+	buf->map = mmap (NULL, buf->allocated, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf->map == MAP_FAILED)
+		error (EXIT_FAILURE, errno, "mmap");
+	if (stats_enabled)
+		stats_alloc (ALLOC_IO, buf->allocated, 0);
+#else
+	buf->map = xmalloc_as (ALLOC_IO, buf->allocated);
+#endif
+	buf->mapped = 0;
+	buf->data = buf->map;
+	buf->size = 0;
+}
+
+/* Make room for at least want more bytes at the end of a growable
+ * buffer, and return how much there is (always leaving space for the
+ * NUL). */
+static size_t filebuf_reserve (struct filebuf *buf, size_t want)
+{
+	if (buf->allocated - buf->size - 1 < want) {
+		size_t allocated = buf->allocated * 2;
+		while (allocated - buf->size - 1 < want)
+			allocated *= 2;
+#if defined(FILEBUF_MMAP) && defined(HAVE_MREMAP)
+		buf->map = mremap (buf->map, buf->allocated, allocated,
+				   MREMAP_MAYMOVE);
+		if (buf->map == MAP_FAILED)
+			error (EXIT_FAILURE, errno, "mremap");
+#elif defined(FILEBUF_MMAP)
+		char *grown = mmap (NULL, allocated, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (grown == MAP_FAILED)
+			error (EXIT_FAILURE, errno, "mmap");
+		memcpy (grown, buf->map, buf->size);
+		munmap (buf->map, buf->allocated);
+		buf->map = grown;
+#endif
+#ifdef FILEBUF_MMAP
+		if (stats_enabled)
+			stats_alloc (ALLOC_IO, allocated, buf->allocated);
+#else
+		buf->map = xrealloc_as (ALLOC_IO, buf->map, allocated);
+#endif
+		buf->data = buf->map;
+		buf->allocated = allocated;
+	}
+
+	return buf->allocated - buf->size - 1;
+}
+
+void filebuf_read (struct filebuf *buf, FILE *f)
+{
+#ifdef FILEBUF_MMAP
+	if (filebuf_map (buf, f))
+		return;
+#endif
+
+	/* Not a regular file (a pipe, say). */
+	filebuf_init (buf);
+	for (;;) {
+		size_t space = filebuf_reserve (buf, 1);
+		size_t count = fread (buf->data + buf->size, 1, space, f);
+
+		buf->size += count;
+		if (count == 0) {
+			if (ferror (f))
+				error (EXIT_FAILURE, errno, "read error");
+			break;
+		}
+	}
+
+	buf->data[buf->size] = '\0';
+}
+
+void filebuf_append (struct filebuf *buf, const char *data, size_t len)
+{
+	filebuf_reserve (buf, len);
+	memcpy (buf->data + buf->size, data, len);
+	buf->size += len;
+	buf->data[buf->size] = '\0';
+}
+
+void filebuf_printf (struct filebuf *buf, const char *format, ...)
+{
+	va_list ap;
+	size_t space = filebuf_reserve (buf, 1);
+	int len;
+
+	va_start (ap, format);
+	len = vsnprintf (buf->data + buf->size, space + 1, format, ap);
+	va_end (ap);
+	if (len < 0)
+		error (EXIT_FAILURE, errno, "vsnprintf");
+
+	if ((size_t) len > space) {
+		filebuf_reserve (buf, len);
+		va_start (ap, format);
+		vsnprintf (buf->data + buf->size, len + 1, format, ap);
+		va_end (ap);
+	}
+
+	buf->size += len;
+}
+
+void filebuf_free (struct filebuf *buf)
+{
+#ifdef FILEBUF_MMAP
+	if (buf->map) {
+		munmap (buf->map, buf->allocated);
+		if (stats_enabled && !buf->mapped)
+			stats_free (ALLOC_IO, buf->allocated);
+	}
+#else
+	xfree_as (ALLOC_IO, buf->map);
+#endif
+	buf->map = buf->data = NULL;
+	buf->size = buf->allocated = 0;
+}
+
+/*
+ * Arenas.
+ */
+
+#define ARENA_BLOCK (64 * 1024)
+#define ARENA_ALIGN (2 * sizeof (void *))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+};
+
+/* Block headers are padded so that the space after them is aligned. */
+#define ARENA_HEADER \
+	((sizeof (struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+void *arena_alloc (struct arena *arena, size_t size)
+{
+	struct arena_block *block;
+	char *res;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (size <= arena->left) {
+		res = arena->next;
+		arena->next += size;
+		arena->left -= size;
+		return res;
+	}
+
+	if (size > ARENA_BLOCK / 4) {
+		/* Give it a block of its own, behind the current one
+		 * so that what is left of that can still be used. */
+		block = xmalloc_as (arena->kind, ARENA_HEADER + size);
+		block->size = size;
+		if (arena->blocks) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			block->next = NULL;
+			arena->blocks = block;
+		}
+		return (char *) block + ARENA_HEADER;
+	}
+
+	block = xmalloc_as (arena->kind, ARENA_HEADER + ARENA_BLOCK);
+	block->size = ARENA_BLOCK;
+	block->next = arena->blocks;
+	arena->blocks = block;
+	res = (char *) block + ARENA_HEADER;
+	arena->next = res + size;
+	arena->left = ARENA_BLOCK - size;
+	return res;
+}
+
+char *arena_strndup (struct arena *arena, const char *s, size_t n)
+{
+	char *res = arena_alloc (arena, n + 1);
+	memcpy (res, s, n);
+	res[n] = '\0';
+	return res;
+}
+
+void arena_adopt (struct arena *arena, struct arena *other)
+{
+	struct arena_block **tail = &arena->blocks;
+
+	if (!arena->blocks) {
+		arena->blocks = other->blocks;
+		arena->next = other->next;
+		arena->left = other->left;
+	} else {
+		/* Keep allocating from our own current block, which
+		 * is at the head of the list. */
+		while (*tail)
+			tail = &(*tail)->next;
+		*tail = other->blocks;
+	}
+
+	other->blocks = NULL;
+	other->next = NULL;
+	other->left = 0;
+}
+
+void arena_reset (struct arena *arena)
+{
+	struct arena_block *block = arena->blocks;
+
+	if (!block || block->size != ARENA_BLOCK) {
+		arena_free (arena);
+		return;
+	}
+
+	/* The current block is at the head of the list; keep it. */
+	arena->blocks = block->next;
+	block->next = NULL;
+	arena_free (arena);
+	arena->blocks = block;
+	arena->next = (char *) block + ARENA_HEADER;
+	arena->left = ARENA_BLOCK;
+}
+
+void arena_free (struct arena *arena)
+{
+	struct arena_block *block, *next;
+
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		xfree_as (arena->kind, block);
+	}
+
+	arena->blocks = NULL;
+	arena->next = NULL;
+	arena->left = 0;
+}
+
+/*
+ * Decompression.  Compressed input is recognised by its magic number
+ * and decoded in memory when the library for it is available;
+ * otherwise the corresponding command-line tool is run.
+ */
+
+/* Largest chunk to hand to libraries that count in unsigned ints. */
+#define UNZIP_CHUNK (1024 * 1024 * 1024)
+
+/* Whatever follows a compressed stream is only another stream if it
+ * starts with the same magic number.  Anything else is ignored, as
+ * gzip and bzip2 do. */
+static int another_stream (const char *data, size_t size,
+			   const char *magic, size_t len, const char *name)
+{
+	if (!size)
+		return 0;
+	if (size >= len && !memcmp (data, magic, len))
+		return 1;
+	error (0, 0, "%s: %s", name, "trailing garbage ignored");
+	return 0;
+}
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+static void unzip_gzip (struct filebuf *out, const char *data, size_t size,
+			const char *name)
+{
+	z_stream zs;
+	int ret = Z_OK;
+
+	memset (&zs, 0, sizeof (zs));
+	/* 32 enables gzip header detection. */
+	if (inflateInit2 (&zs, 15 + 32) != Z_OK)
+		error (EXIT_FAILURE, 0, "%s: %s", name, "inflateInit2 failed");
+
+	while (ret != Z_STREAM_END ||
+	       another_stream (data, size, "\x1f\x8b", 2, name)) {
+		size_t in = size < UNZIP_CHUNK ? size : UNZIP_CHUNK;
+		size_t space = filebuf_reserve (out, 1);
+
+		if (space > UNZIP_CHUNK)
+			space = UNZIP_CHUNK;
+
+		if (ret == Z_STREAM_END)
+			/* Another member follows, as with zcat. */
+			inflateReset (&zs);
+
+		zs.next_in = (Bytef *) data;
+		zs.avail_in = in;
+		zs.next_out = (Bytef *) out->data + out->size;
+		zs.avail_out = space;
+		ret = inflate (&zs, Z_NO_FLUSH);
+		data += in - zs.avail_in;
+		size -= in - zs.avail_in;
+		out->size += space - zs.avail_out;
+
+		if (ret == Z_BUF_ERROR && zs.avail_out)
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       "unexpected end of file");
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       zs.msg ? zs.msg : "invalid compressed data");
+	}
+
+	inflateEnd (&zs);
+}
+#endif /* zlib */
+
+#if defined(HAVE_BZLIB_H) && defined(HAVE_LIBBZ2)
+static void unzip_bzip2 (struct filebuf *out, const char *data, size_t size,
+			 const char *name)
+{
+	bz_stream bs;
+	int ret = BZ_STREAM_END;
+
+	/* The data starts with the magic number, so the first time
+	 * round this starts the first stream. */
+	memset (&bs, 0, sizeof (bs));
+	while (ret != BZ_STREAM_END ||
+	       another_stream (data, size, "BZh", 3, name)) {
+		size_t in = size < UNZIP_CHUNK ? size : UNZIP_CHUNK;
+		size_t space = filebuf_reserve (out, 1);
+
+		if (space > UNZIP_CHUNK)
+			space = UNZIP_CHUNK;
+
+		if (ret == BZ_STREAM_END) {
+			/* Start of the (next) stream. */
+			BZ2_bzDecompressEnd (&bs);
+			if (BZ2_bzDecompressInit (&bs, 0, 0) != BZ_OK)
+				error (EXIT_FAILURE, 0, "%s: %s", name,
+				       "BZ2_bzDecompressInit failed");
+		}
+
+		bs.next_in = (char *) data;
+		bs.avail_in = in;
+		bs.next_out = out->data + out->size;
+		bs.avail_out = space;
+		ret = BZ2_bzDecompress (&bs);
+		data += in - bs.avail_in;
+		size -= in - bs.avail_in;
+		out->size += space - bs.avail_out;
+
+		if (ret == BZ_OK && !size && bs.avail_out)
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       "unexpected end of file");
+		if (ret != BZ_OK && ret != BZ_STREAM_END)
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       "invalid compressed data");
+	}
+
+	BZ2_bzDecompressEnd (&bs);
+}
+#endif /* bzlib */
+
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+static void unzip_xz (struct filebuf *out, const char *data, size_t size,
+		      const char *name)
+{
+	lzma_stream ls = LZMA_STREAM_INIT;
+	lzma_ret ret;
+
+	do {
+		/* One stream at a time, so that what follows can be
+		 * checked the same way as for the other formats. */
+		if (lzma_stream_decoder (&ls, UINT64_MAX, 0) != LZMA_OK)
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       "lzma_stream_decoder failed");
+
+		ls.next_in = (const uint8_t *) data;
+		ls.avail_in = size;
+		do {
+			size_t space = filebuf_reserve (out, 1);
+
+			ls.next_out = (uint8_t *) out->data + out->size;
+			ls.avail_out = space;
+			ret = lzma_code (&ls, LZMA_FINISH);
+			out->size += space - ls.avail_out;
+		} while (ret == LZMA_OK);
+
+		if (ret != LZMA_STREAM_END)
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       ret == LZMA_BUF_ERROR ?
+			       "unexpected end of file" :
+			       "invalid compressed data");
+
+		data = (const char *) ls.next_in;
+		size = ls.avail_in;
+
+		/* Streams may be followed by null-byte padding. */
+		while (size && !*data) {
+			data++;
+			size--;
+		}
+	} while (another_stream (data, size, "\xfd" "7zXZ\0", 6, name));
+
+	lzma_end (&ls);
+}
+#endif /* lzma */
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+static int zstd_skippable (const char *data, size_t size)
+{
+	return size >= 4 && (data[0] & 0xf0) == 0x50 &&
+		!memcmp (data + 1, "\x2a\x4d\x18", 3);
+}
+
+static void unzip_zstd (struct filebuf *out, const char *data, size_t size,
+			const char *name)
+{
+	ZSTD_DStream *zs = ZSTD_createDStream ();
+	ZSTD_inBuffer in = { data, size, 0 };
+	size_t ret = 0;
+
+	if (!zs || ZSTD_isError (ZSTD_initDStream (zs)))
+		error (EXIT_FAILURE, 0, "%s: %s", name,
+		       "ZSTD_initDStream failed");
+
+	/* Frames may be concatenated; ret is 0 at the end of each.
+	 * Skippable frames (magic 0x184d2a5?) are passed over by the
+	 * library. */
+	do {
+		ZSTD_outBuffer o;
+
+		o.size = filebuf_reserve (out, 1);
+		o.dst = out->data + out->size;
+		o.pos = 0;
+		ret = ZSTD_decompressStream (zs, &o, &in);
+		out->size += o.pos;
+		if (ZSTD_isError (ret))
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       ZSTD_getErrorName (ret));
+		if (ret && in.pos == in.size && o.pos < o.size)
+			error (EXIT_FAILURE, 0, "%s: %s", name,
+			       "unexpected end of file");
+	} while (ret || (in.pos < in.size &&
+			 (zstd_skippable (data + in.pos, in.size - in.pos) ||
+			  another_stream (data + in.pos, in.size - in.pos,
+					  "\x28\xb5\x2f\xfd", 4, name))));
+
+	ZSTD_freeDStream (zs);
+}
+#endif /* zstd */
+
+/* Decompress by running zprog on the named file. */
+static void unzip_pipe (struct filebuf *out, const char *zprog,
+			const char *name)
+{
+	pid_t pid;
+	int status;
+	FILE *fi = xpipe (zprog, &pid, "r", zprog, name, NULL);
+
+	filebuf_free (out);
+	filebuf_read (out, fi);
+	fclose (fi);
+
+	waitpid (pid, &status, 0);
+	if (out->size == 0 && WEXITSTATUS (status) != 0)
+		exit (1);
+}
+
+static const struct {
+	const char *magic;
+	size_t len;
+	const char *zprog;
+	void (*unzip) (struct filebuf *, const char *, size_t, const char *);
+} compressors[] = {
+	{ "\x1f\x8b", 2, "zcat",
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+	  unzip_gzip
+#else
+	  NULL
+#endif
+	},
+	{ "BZh", 3, "bzcat",
+#if defined(HAVE_BZLIB_H) && defined(HAVE_LIBBZ2)
+	  unzip_bzip2
+#else
+	  NULL
+#endif
+	},
+	{ "\xfd" "7zXZ\0", 6, "xzcat",
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+	  unzip_xz
+#else
+	  NULL
+#endif
+	},
+	{ "\x28\xb5\x2f\xfd", 4, "zstdcat",
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+	  unzip_zstd
+#else
+	  NULL
+#endif
+	},
+};
+
+void filebuf_read_unzip (struct filebuf *buf, const char *name)
+{
+	struct filebuf in;
+	FILE *f = xopen (name, "rb");
+	size_t i;
+
+	filebuf_read (&in, f);
+	fclose (f);
+
+	for (i = 0; i < sizeof (compressors) / sizeof (compressors[0]); i++)
+		if (in.size >= compressors[i].len &&
+		    !memcmp (in.data, compressors[i].magic,
+			     compressors[i].len))
+			break;
+
+	if (i == sizeof (compressors) / sizeof (compressors[0])) {
+		/* Not compressed. */
+		*buf = in;
+		return;
+	}
+
+	filebuf_init (buf);
+	if (compressors[i].unzip)
+		compressors[i].unzip (buf, in.data, in.size, name);
+	else
+		unzip_pipe (buf, compressors[i].zprog, name);
+
+	buf->data[buf->size] = '\0';
+	filebuf_free (&in);
+}
+
 /*
  * stuff needed for non-GNU systems
  */
@@ -34,20 +34,97 @@
 /* safe malloc */
 void *xmalloc (size_t size);
 void *xrealloc (void *tr, size_t size);
+void xfree (void *ptr);
 /* safe strdup */
 char *xstrdup (const char *s);
 /* safe strndup */
 char *xstrndup (const char *s, const size_t n);
+
+/* What memory is wanted for, as counted by --stats.  The functions
+ * above count as ALLOC_OTHER. */
+enum alloc_kind {
+	ALLOC_OTHER,
+	ALLOC_HEADER,		/* file names and headers */
+	ALLOC_LINES,		/* lines kept from a patch or file */
+	ALLOC_HUNKS,		/* hunks being converted or rebuilt */
+	ALLOC_REGEX,		/* patterns and their compiled forms */
+	ALLOC_IO,		/* input and output buffers */
+	ALLOC_KINDS
+};
+
+void *xmalloc_as (enum alloc_kind kind, size_t size);
+/* Only what the block grows by is counted, where the C library can
+ * say how big it was, so one that keeps doubling counts as its final
+ * size. */
+void *xrealloc_as (enum alloc_kind kind, void *ptr, size_t size);
+char *xstrdup_as (enum alloc_kind kind, const char *s);
+char *xstrndup_as (enum alloc_kind kind, const char *s, const size_t n);
+/* Free a block from one of the above, with the kind it was allocated
+ * as, so that --stats knows how much of each kind is still in use.
+ * Plain free() leaves the block counted as in use. */
+void xfree_as (enum alloc_kind kind, void *ptr);
 /* safe mkstemp */
 int xmkstemp (char *pattern);
 /* safe tmpfile */
 FILE *xtmpfile (void);
+/* close a file from xtmpfile, counting its size for --stats */
+void xtmpclose (FILE *f);
 
 FILE *xopen(const char *file, const char *mode);
-FILE *xopen_seekable(const char *file, const char *mode);
-FILE *xopen_unzip(const char *file, const char *mode);
 FILE *xpipe(const char *cmd, pid_t *pid, const char *mode, ...);
 
+/*
+ * A whole input file held in memory.  The data is always followed by
+ * a NUL byte (not counted in size), so that a line within it can be
+ * scanned up to its terminating newline without running off the end.
+ *
+ * Regular files are mapped read-only rather than copied; anything else
+ * is read into an anonymous mapping.
+ */
+struct filebuf {
+	char *data;
+	size_t size;
+	char *map;		/* start of the mapping or allocation */
+	size_t allocated;	/* length of the mapping or allocation */
+	int mapped;		/* is it the file itself that is mapped? */
+};
+
+/* read (or map) the rest of f into buf */
+void filebuf_read(struct filebuf *buf, FILE *f);
+/* read the named file into buf, decompressing it if necessary */
+void filebuf_read_unzip(struct filebuf *buf, const char *name);
+/* start an empty buffer, then append to it */
+void filebuf_init(struct filebuf *buf);
+void filebuf_append(struct filebuf *buf, const char *data, size_t len);
+void filebuf_printf(struct filebuf *buf, const char *format, ...)
+	FORMAT ((__printf__, 2, 3));
+void filebuf_free(struct filebuf *buf);
+
+/*
+ * Memory for many small objects that are all freed together.  It is
+ * carved out of large blocks, so each allocation costs no more than
+ * its size.  A zeroed struct arena is ready to use, and counts its
+ * blocks as ALLOC_OTHER; use ARENA_INIT to say what they are for.
+ */
+struct arena_block;
+struct arena {
+	struct arena_block *blocks;
+	char *next;		/* free space in the current block */
+	size_t left;
+	enum alloc_kind kind;
+};
+
+#define ARENA_INIT(kind) { NULL, NULL, 0, kind }
+
+void *arena_alloc(struct arena *arena, size_t size);
+/* copy n bytes of s, adding a NUL */
+char *arena_strndup(struct arena *arena, const char *s, size_t n);
+/* take over everything allocated from other, leaving it empty */
+void arena_adopt(struct arena *arena, struct arena *other);
+/* free everything allocated, keeping a block for reuse */
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+
 struct patlist;
 
 /* create a new item */